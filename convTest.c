@@ -0,0 +1,217 @@
+// convTest - Check ImageConvolve against a brute-force reference.
+//
+// Convolves random images with random kernels (of rank 1, which take the
+// separable path, and of full rank), in every border mode, with the
+// kernels of each instruction set supported by this CPU (scalar first),
+// and checks every pixel against a direct evaluation of the definition:
+// the sum over the whole kernel, divided with rounding to nearest (halves
+// up), plus bias, saturated to [0, maxval].
+// Exits with status 1 if any result differs.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "image8bit.h"
+
+#define MAXK 15           // max kernel width and height
+
+static const char* borderNames[IMAGE_BORDER_ZERO + 1] = {
+  "clamp", "mirror", "wrap", "zero"
+};
+
+// A test case: a kernel, its parameters, and a description.
+struct convCase {
+  int k[MAXK * MAXK];
+  int kw, kh;
+  int divisor, bias;
+  const char* kind;
+};
+
+static int randRange(int lo, int hi) {
+  return lo + rand() % (hi - lo + 1);
+}
+
+// Random odd size in [1, max].
+static int randOdd(int max) {
+  return 2 * randRange(0, (max - 1) / 2) + 1;
+}
+
+// Pixel (x, y) of img for any x, y, as given by border.
+static int refPixel(Image img, int x, int y, int border) {
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  if (border == IMAGE_BORDER_ZERO &&
+      (x < 0 || x >= w || y < 0 || y >= h)) {
+    return 0;
+  }
+  // Clamp, or else reflect (about the edge pixels) or shift until inside
+  int p[2] = { x, y };
+  int n[2] = { w, h };
+  for (int a = 0; a < 2; a++) {
+    while (p[a] < 0 || p[a] >= n[a]) {
+      switch (border) {
+      case IMAGE_BORDER_CLAMP:
+        p[a] = p[a] < 0 ? 0 : n[a] - 1;
+        break;
+      case IMAGE_BORDER_MIRROR:
+        if (n[a] == 1) p[a] = 0;
+        else p[a] = p[a] < 0 ? -p[a] : 2 * (n[a] - 1) - p[a];
+        break;
+      default:
+        p[a] += p[a] < 0 ? n[a] : -n[a];
+      }
+    }
+  }
+  return ImageGetPixel(img, p[0], p[1]);
+}
+
+// Brute-force ImageConvolve of img, into a new raster image.
+static Image refConvolve(Image img, const struct convCase* c, int border) {
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  int maxval = ImageMaxval(img);
+  Image out = ImageCreate(w, h, (uint8)maxval);
+  if (out == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      long long s = 0;
+      for (int j = 0; j < c->kh; j++) {
+        for (int i = 0; i < c->kw; i++) {
+          s += (long long)c->k[j * c->kw + i] *
+               refPixel(img, x + i - c->kw / 2, y + j - c->kh / 2, border);
+        }
+      }
+      // Round s / divisor to nearest, halves up: floor(s/d + 1/2)
+      long long d = c->divisor;
+      long long t = s + d / 2;   // (exact for even d; odd d has no halves)
+      long long q = t / d;
+      if (t % d < 0) q--;
+      q += c->bias;
+      ImageSetPixel(out, x, y, (uint8)(q < 0 ? 0 : q > maxval ? maxval : q));
+    }
+  }
+  return out;
+}
+
+// A random test case, of the given kind.
+static void randomCase(struct convCase* c, int kind) {
+  c->kw = randOdd(7);
+  c->kh = randOdd(7);
+  int n = c->kw * c->kh;
+  switch (kind) {
+  case 0: {   // rank 1: column times row (with zeros, signs, common factors)
+    int u[MAXK], v[MAXK];
+    for (int j = 0; j < c->kh; j++) u[j] = randRange(-4, 4);
+    for (int i = 0; i < c->kw; i++) v[i] = 2 * randRange(-6, 6);
+    for (int j = 0; j < c->kh; j++) {
+      for (int i = 0; i < c->kw; i++) c->k[j * c->kw + i] = u[j] * v[i];
+    }
+    c->kind = "rank 1";
+    break;
+  }
+  case 1:     // full rank (almost surely), small coefficients
+    for (int i = 0; i < n; i++) c->k[i] = randRange(-9, 9);
+    c->kind = "full rank";
+    break;
+  case 2:     // rank 1, but for one coefficient
+    randomCase(c, 0);
+    c->k[rand() % n] += 1;
+    c->kind = "rank 1 plus 1";
+    return;   // (divisor and bias already chosen)
+  default:    // large sums, beyond the multiplicative division
+    c->kw = MAXK;
+    c->kh = randRange(5, 7) * 2 + 1;
+    n = c->kw * c->kh;
+    for (int i = 0; i < n; i++) c->k[i] = randRange(0, 1) ? 32767 : -32767;
+    // Even multiples of 32767, so that there are halves to round, and
+    // results in range
+    c->divisor = 32767 * (2 << randRange(0, 4));
+    c->bias = 128;
+    c->kind = "large";
+    return;
+  }
+  int sum = 0;
+  for (int i = 0; i < n; i++) sum += c->k[i];
+  // Divisors that give halves (even), none (odd), or the sum (means)
+  static const int divisors[] = { 1, 2, 4, 7, 256, 1000, 65537 };
+  int nd = sizeof(divisors) / sizeof(divisors[0]);
+  c->divisor = rand() % 4 == 0 && sum > 0 ? sum : divisors[rand() % nd];
+  c->bias = rand() % 3 == 0 ? randRange(-300, 300) : 0;
+}
+
+// Random image: levels in [0, maxval].
+static Image randomImage(int w, int h, int maxval, int layout) {
+  Image img = ImageCreateLayout(w, h, (uint8)maxval, layout);
+  if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      ImageSetPixel(img, x, y, (uint8)(rand() % (maxval + 1)));
+    }
+  }
+  return img;
+}
+
+// Are a and b the same image?
+static int sameImage(Image a, Image b) {
+  if (ImageWidth(a) != ImageWidth(b) || ImageHeight(a) != ImageHeight(b) ||
+      ImageMaxval(a) != ImageMaxval(b)) {
+    return 0;
+  }
+  for (int y = 0; y < ImageHeight(a); y++) {
+    for (int x = 0; x < ImageWidth(a); x++) {
+      if (ImageGetPixel(a, x, y) != ImageGetPixel(b, x, y)) return 0;
+    }
+  }
+  return 1;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 1) {
+    error(1, 0, "Usage: convTest");
+  }
+  static const int layouts[] = { IMAGE_RASTER, IMAGE_TILED, IMAGE_ALIGNED };
+  ImageInit();
+  srand(2024);
+
+  int checks = 0;
+  int bad = 0;
+  for (int n = 0; n < 400; n++) {
+    struct convCase c;
+    int kind = n % 4;
+    randomCase(&c, kind);
+    // Small images (so windows often wrap around them more than once),
+    // and wider ones (for the vector kernels)
+    int w = n % 2 ? randRange(1, 9) : randRange(1, 150);
+    int h = randRange(1, 12);
+    int maxval = n % 5 == 0 ? randRange(1, 254) : 255;
+    Image img = randomImage(w, h, maxval, layouts[n % 3]);
+    for (int border = 0; border <= IMAGE_BORDER_ZERO; border++) {
+      Image ref = refConvolve(img, &c, border);
+      for (int simd = IMAGE_SIMD_SCALAR; simd <= IMAGE_SIMD_AVX512; simd++) {
+        if (!ImageSetSimd(simd)) continue;
+        Image out = ImageClone(img);
+        if (out == NULL || !ImageConvolve(out, c.k, c.kw, c.kh, c.divisor,
+                                          c.bias, border)) {
+          error(2, errno, "Convolution: %s", ImageErrMsg());
+        }
+        checks++;
+        if (!sameImage(ref, out)) {
+          printf("MISMATCH: %s %dx%d kernel (divisor %d, bias %d), "
+                 "border %s, %s, on %dx%d image (maxval %d)\n",
+                 c.kind, c.kw, c.kh, c.divisor, c.bias, borderNames[border],
+                 ImageSimdName(simd), w, h, maxval);
+          bad++;
+        }
+        ImageDestroy(&out);
+      }
+      ImageDestroy(&ref);
+    }
+    ImageDestroy(&img);
+  }
+  printf("%s (%d results checked)\n", bad == 0 ? "OK" : "FAILED", checks);
+  return bad == 0 ? 0 : 1;
+}
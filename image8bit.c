@@ -18,14 +18,32 @@
 // Date: 2023-11-03
 //
 
+#define _GNU_SOURCE   // for F_SETPIPE_SZ
+
 #include "image8bit.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#define KERNELS_X86   // build AVX2 and AVX-512 kernels too (see CPU dispatch)
+#include <immintrin.h>
+#endif
 #include "instrumentation.h"
 
 // The data structure
@@ -39,6 +57,24 @@
 // For example, in a 100-pixel wide image (img->width == 100),
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
 //   pixel position (x,y) = (22,1) is stored in img->pixel[122].
+//
+// Alternatively, an image may use a tiled layout (img->layout ==
+// IMAGE_TILED): the image is split into TILESIZE x TILESIZE tiles, stored
+// one after the other in raster order of tiles, and each tile is stored as
+// a raster scan of its TILESIZE rows.  Tiles on the right and bottom edges
+// are padded to full size.  Pixels that are close in 2D are then close in
+// memory, whatever the image width.
+//
+// Or it may use an aligned layout (img->layout == IMAGE_ALIGNED): rows
+// are stored as in a raster scan, but each one starts on a ROWALIGN byte
+// boundary, padded to img->stride pixels (the width rounded up to a
+// multiple of ROWALIGN).  Vector kernels can then use aligned loads, and
+// process the tail of each row as a whole vector.  Pixel (x,y) is stored
+// in img->pixel[y*img->stride + x] in both raster layouts.
+//
+// The pixel array may be shared by several images (see ImageClone): it is
+// kept in a reference counted buffer (struct pixbuf), and an image that
+// shares its buffer copies it before modifying any pixel (copy-on-write).
 // 
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -47,14 +83,84 @@
 // Maximum value you can store in a pixel (maximum maxval accepted)
 const uint8 PixMax = 255;
 
+// Rectangle [x0, x1) x [y0, y1) (empty if x0 >= x1 or y0 >= y1)
+struct rect {
+  int x0, y0, x1, y1;
+};
+
 // Internal structure for storing 8-bit graymap images
 struct image {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
-  uint8* pixel; // pixel data (a raster scan)
+  int layout;   // IMAGE_RASTER, IMAGE_TILED or IMAGE_ALIGNED
+  size_t stride;  // pixels from a row to the next (raster layouts)
+  uint8* pixel; // pixel data (a raster scan, or tiles) == buf->pixel
+  struct pixbuf* buf;  // (possibly shared) buffer holding the pixel data
+  struct rect dirty;   // bounds of pixels changed since ImageMarkClean
+  struct stats* stats; // cached statistics (or NULL)
+};
+
+// Statistics of the pixel levels of an image, cached between operations.
+// In-place operations mark them invalid (in makeWritable), unless they
+// can update them (see ImageNegative, ImagePaste, ...).
+struct stats {
+  int valid;
+  size_t hist[256];   // number of pixels of each level
 };
 
+// Alignment of pixel buffers, and of rows in the aligned layout (bytes):
+// the width of the widest vector registers (AVX-512).
+#define ROWALIGN 64
+
+// Reference counted pixel buffer
+struct pixbuf {
+  atomic_int refs;  // number of images using this buffer
+  size_t size;      // number of pixels
+  size_t mapped;    // bytes mapped with mmap (0 if allocated with malloc)
+  _Alignas(ROWALIGN) uint8 pixel[];   // the pixel array
+};
+
+// Largest pixel buffer (in pixels) that may be allocated.
+#define PIXBUFMAX ((size_t)PTRDIFF_MAX - sizeof(struct pixbuf))
+
+// Pixel buffers of at least PIXMAPMIN bytes are mapped directly from the
+// system, in whole huge pages (of HUGEPAGE bytes) where possible, so that
+// sweeps over gigapixel images do not thrash the TLB.
+#define PIXMAPMIN ((size_t)32 << 20)
+#define HUGEPAGE ((size_t)2 << 20)
+
+// Tile size for the tiled layout (a power of 2)
+#define TILESHIFT 6
+#define TILESIZE (1 << TILESHIFT)
+#define TILEMASK (TILESIZE - 1)
+
+// Number of tiles needed to cover n pixels
+static inline int tileCount(int n) {
+  return (int)(((unsigned)n + TILEMASK) >> TILESHIFT);
+}
+
+// Distance between rows of a width pixels wide image in the given layout.
+static inline size_t rowStride(int width, int layout) {
+  if (layout == IMAGE_ALIGNED) {
+    return ((size_t)width + ROWALIGN - 1) & ~(size_t)(ROWALIGN - 1);
+  }
+  return (size_t)width;
+}
+
+// Size of the pixel array of a width x height image in the given layout,
+// or SIZE_MAX if it would exceed PIXBUFMAX.
+static inline size_t pixelArraySize(int width, int height, int layout) {
+  size_t w = rowStride(width, layout);
+  size_t h = (size_t)height;
+  if (layout == IMAGE_TILED) {
+    w = (size_t)tileCount(width) * TILESIZE;
+    h = (size_t)tileCount(height) * TILESIZE;
+  }
+  if (h != 0 && w > PIXBUFMAX / h) return SIZE_MAX;
+  return w * h;
+}
+
 
 // This module follows "design-by-contract" principles.
 // Read `Design-by-Contract.md` for more details.
@@ -76,10 +182,12 @@ struct image {
 // Additional information:  man 3 errno;  man 3 error;
 
 // Variable to preserve errno temporarily
-static int errsave = 0;
+static _Thread_local int errsave = 0;
 
 // Error cause
-static char* errCause;
+// (Kept per thread, like errno, so that several threads may use the module
+// at the same time, on different images.)
+static _Thread_local char* errCause;
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -144,13 +252,14 @@ static int check(int condition, const char* failmsg) {
 
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply set names of instrumentation counters.
+/// (Instrumentation is calibrated lazily, on the first InstrPrint.)
 void ImageInit(void) { ///
-  InstrCalibrate();
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
   // Add more instrumentation names here...
   InstrName[1] = "imagelocatesubimage";
   InstrName[2] = "imageblur";
+  InstrName[3] = "imagemedian";  // pixels filtered by ImageMedian
  
 
 
@@ -162,6 +271,7 @@ void ImageInit(void) { ///
 // Add more macros here...
 #define IMAGELOCATESUBIMAGE InstrCount[1]
 #define IMAGEBLUR InstrCount[2]
+#define IMAGEMEDIAN InstrCount[3]
 
 
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
@@ -174,18 +284,124 @@ static inline uint8 roundPixel(double pixel) {
 
 /// Image management functions
 
+// Map len bytes of fresh (zeroed) memory for a large pixel buffer, on huge
+// pages if any are reserved, or else advising transparent huge pages.
+// Returns NULL on failure.
+static void* pixbufMap(size_t len) {
+  void* p = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+  p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+#if defined(MADV_HUGEPAGE)
+    (void)madvise(p, len, MADV_HUGEPAGE);  // only a hint
+#endif
+  }
+  return p;
+}
+
+// Allocate a pixel buffer for size pixels, used by one image.
+// If zero is nonzero, pixels are set to 0.
+// The pixel array is aligned to ROWALIGN bytes.
+// Returns NULL on failure (with errno set).
+static struct pixbuf* pixbufNew(size_t size, int zero) {
+  if (size > PIXBUFMAX) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  size_t bytes = sizeof(struct pixbuf) + size * sizeof(uint8);
+  struct pixbuf* pb;
+  size_t mapped = 0;
+  if (bytes >= PIXMAPMIN && bytes <= PIXBUFMAX - HUGEPAGE) {
+    mapped = (bytes + HUGEPAGE - 1) & ~(HUGEPAGE - 1);
+    pb = (struct pixbuf*)pixbufMap(mapped);   // always zeroed
+  } else {
+    bytes = (bytes + ROWALIGN - 1) & ~(size_t)(ROWALIGN - 1);
+    pb = (struct pixbuf*)aligned_alloc(ROWALIGN, bytes);
+    if (pb != NULL && zero) memset(pb, 0, bytes);
+  }
+  if (pb != NULL) {
+    atomic_init(&pb->refs, 1);
+    pb->size = size;
+    pb->mapped = mapped;
+  }
+  return pb;
+}
+
+// Release one reference to pixel buffer pb, freeing it if it was the last.
+static void pixbufRelease(struct pixbuf* pb) {
+  if (atomic_fetch_sub(&pb->refs, 1) == 1) {
+    if (pb->mapped != 0) {
+      munmap(pb, pb->mapped);
+    } else {
+      free(pb);
+    }
+  }
+}
+
+// Ensure that img does not share its pixel buffer, so that it may be
+// modified.  If it is shared, img gets its own copy of the pixels.
+// Returns nonzero on success, or 0 on allocation failure (img unchanged).
+// The w x h rectangle at (x, y), where pixels are about to change, is
+// added to the dirty area of img (see ImageMarkClean).
+static int makeWritableRect(Image img, int x, int y, int w, int h) {
+  if (atomic_load(&img->buf->refs) != 1) {
+    struct pixbuf* pb = pixbufNew(img->buf->size, 0);
+    if (pb == NULL) {
+      errCause = "Memory allocation error for copy of shared pixels";
+      return 0;
+    }
+    memcpy(pb->pixel, img->buf->pixel, pb->size);
+    PIXMEM += 2 * (unsigned long)pb->size;
+    pixbufRelease(img->buf);
+    img->buf = pb;
+    img->pixel = pb->pixel;
+  }
+  if (img->stats != NULL) img->stats->valid = 0;
+  struct rect* d = &img->dirty;
+  if (d->x0 >= d->x1 || d->y0 >= d->y1) {
+    *d = (struct rect){ x, y, x + w, y + h };
+  } else {
+    if (x < d->x0) d->x0 = x;
+    if (y < d->y0) d->y0 = y;
+    if (x + w > d->x1) d->x1 = x + w;
+    if (y + h > d->y1) d->y1 = y + h;
+  }
+  return 1;
+}
+
+// Same, for operations that may change any pixel of img.
+static int makeWritable(Image img) {
+  return makeWritableRect(img, 0, 0, img->width, img->height);
+}
+
 /// Create a new black image.
 ///   width, height : the dimensions of the new image.
 ///   maxval: the maximum gray level (corresponding to white).
 /// Requires: width and height must be non-negative, maxval > 0.
+/// (The number of pixels, width*height, may exceed INT_MAX.)
 /// 
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
+/// On failure, returns NULL and errno/errCause are set accordingly
+/// (errCause is "Image too large" if it could never fit in memory).
 Image ImageCreate(int width, int height, uint8 maxval) { ///
+  return ImageCreateLayout(width, height, maxval, IMAGE_RASTER);
+}
+
+/// Create a new black image with the given pixel storage layout.
+/// Like ImageCreate, but layout may be IMAGE_RASTER, IMAGE_TILED or
+/// IMAGE_ALIGNED.
+Image ImageCreateLayout(int width, int height, uint8 maxval, int layout) { ///
   assert (width >= 0);
   assert (height >= 0);
   assert (0 < maxval && maxval <= PixMax);
+  assert (layout == IMAGE_RASTER || layout == IMAGE_TILED ||
+          layout == IMAGE_ALIGNED);
   Image img = (Image)malloc(sizeof(struct image));
   if (img == NULL) {
     errCause = "Memory allocation error";
@@ -195,23 +411,53 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
   img->width = width;
   img->height = height;
   img->maxval = maxval;
+  img->layout = layout;
+  img->stride = rowStride(width, layout);
 
-  // Allocate memory for the pixel data
-  img->pixel = (uint8*)malloc(sizeof(uint8) * width * height);
-  if (img->pixel == NULL) {
+  // Allocate memory for the pixel data, all set to 0 (black)
+  size_t size = pixelArraySize(width, height, layout);
+  img->buf = pixbufNew(size, 1);
+  if (img->buf == NULL) {
+    errsave = errno;
     free(img); // Clean up the partially allocated image structure
-    errCause = "Memory allocation error for pixel data";
+    errno = errsave;
+    errCause = size == SIZE_MAX ? "Image too large"
+                                : "Memory allocation error for pixel data";
     return NULL;
   }
-
-  // Initialize the pixel data, set all pixels to 0 (black)
-  for (int i = 0; i < width * height; i++) {
-    img->pixel[i] = 0;
-  }
+  img->pixel = img->buf->pixel;
+  img->dirty = (struct rect){ 0, 0, width, height };
+  img->stats = NULL;
 
   return img;
 }
 
+/// Create a copy of an image.
+/// The copy shares the pixel data with img until either of them is
+/// modified, so this takes constant time and no pixel memory.
+/// (Operations that modify an image in-place copy its pixels first if they
+/// are shared.  This is the only case where they may fail.)
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageClone(Image img) { ///
+  assert (img != NULL);
+  Image copy = (Image)malloc(sizeof(struct image));
+  if (copy == NULL) {
+    errCause = "Memory allocation error";
+    return NULL;
+  }
+  *copy = *img;
+  atomic_fetch_add(&img->buf->refs, 1);
+  // Copy the cached statistics (if there is memory for them)
+  if (img->stats != NULL) {
+    copy->stats = (struct stats*)malloc(sizeof(struct stats));
+    if (copy->stats != NULL) *copy->stats = *img->stats;
+  }
+  return copy;
+}
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -222,8 +468,9 @@ void ImageDestroy(Image* imgp) { ///
   // Insert your code here!
 
   if (*imgp != NULL) {
-    // Deallocate the pixel data
-    free((*imgp)->pixel);
+    // Deallocate the pixel data (unless shared)
+    pixbufRelease((*imgp)->buf);
+    free((*imgp)->stats);
     // Deallocate the image structure itself
     free(*imgp);
     *imgp = NULL;
@@ -231,650 +478,5189 @@ void ImageDestroy(Image* imgp) { ///
 }
 
 
-/// PGM file operations
+/// Pixel storage layout
 
-// See also:
-// PGM format specification: http://netpbm.sourceforge.net/doc/pgm.html
+// Index of pixel (x,y) in the pixel array of a tiled image.
+static inline size_t tiledIndex(Image img, int x, int y) {
+  size_t tile = (size_t)(y >> TILESHIFT) * tileCount(img->width) + (x >> TILESHIFT);
+  return (tile << (2 * TILESHIFT)) + ((y & TILEMASK) << TILESHIFT) + (x & TILEMASK);
+}
 
-// Match and skip 0 or more comment lines in file f.
-// Comments start with a # and continue until the end-of-line, inclusive.
-// Returns the number of comments skipped.
-static int skipComments(FILE* f) {
-  char c;
-  int i = 0;
-  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
-    i++;
+// Pointer to pixel (x,y), and number of pixels (x, x+1, ...) of row y that
+// follow it contiguously in memory, in *len.
+// Loops over the pixel array in any layout may be written as:
+//   for (int y = 0; y < img->height; y++)
+//     for (int x = 0; x < img->width; x += len) {
+//       uint8* p = spanAt(img, x, y, &len);
+//       ... p[0 .. len-1] ...
+//     }
+static inline uint8* spanAt(Image img, int x, int y, int* len) {
+  if (img->layout == IMAGE_TILED) {
+    int end = (x | TILEMASK) + 1;
+    *len = (end < img->width ? end : img->width) - x;
+    return img->pixel + tiledIndex(img, x, y);
   }
-  return i;
+  *len = img->width - x;
+  return img->pixel + (size_t)y * img->stride + x;
 }
 
-/// Load a raw PGM file.
-/// Only 8 bit PGM files are accepted.
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageLoad(const char* filename) { ///
-  int w, h;
-  int maxval;
-  char c;
-  FILE* f = NULL;
-  Image img = NULL;
+// Copy all pixels of src into dst, which must have the same size
+// (but possibly another layout).
+static void copyPixels(Image dst, Image src) {
+  assert (dst->width == src->width && dst->height == src->height);
+  int w = src->width;
+  for (int y = 0; y < src->height; y++) {
+    int x = 0;
+    while (x < w) {
+      int slen, dlen;
+      const uint8* s = spanAt(src, x, y, &slen);
+      uint8* d = spanAt(dst, x, y, &dlen);
+      int len = slen < dlen ? slen : dlen;
+      memcpy(d, s, len);
+      x += len;
+    }
+  }
+  PIXMEM += 2 * (unsigned long)w * src->height;
+}
 
-  int success = 
-  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
-  // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
-  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
-  // Allocate image
-  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
-  // Read pixels
-  check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+/// Get the pixel storage layout of an image
+/// (IMAGE_RASTER, IMAGE_TILED or IMAGE_ALIGNED).
+int ImageLayout(Image img) { ///
+  assert (img != NULL);
+  return img->layout;
+}
 
-  // Cleanup
-  if (!success) {
+/// Change the pixel storage layout of an image.
+/// Pixel values are not changed.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img is not modified.
+int ImageSetLayout(Image img, int layout) { ///
+  assert (img != NULL);
+  assert (layout == IMAGE_RASTER || layout == IMAGE_TILED ||
+          layout == IMAGE_ALIGNED);
+  if (img->layout == layout) return 1;
+  Image tmp = ImageCreateLayout(img->width, img->height, img->maxval, layout);
+  if (tmp == NULL) return 0;
+  copyPixels(tmp, img);
+  // Swap pixel buffers, and destroy the old one (if not shared)
+  struct pixbuf* buf = img->buf;
+  img->buf = tmp->buf;
+  img->pixel = tmp->pixel;
+  img->layout = layout;
+  img->stride = tmp->stride;
+  tmp->buf = buf;
+  ImageDestroy(&tmp);
+  return 1;
+}
+
+// Many kernels below walk the pixel array row by row, with rows
+// img->stride bytes apart, so they work directly on raster and aligned
+// images.  For tiled images they work on a raster copy:
+// rasterOf returns img itself if it is not tiled, or otherwise a new
+// raster copy of img, which is also stored in (*copy) so that the caller
+// destroys it afterwards.  Returns NULL on failure.
+// (Kernels create their results in the layout of the image returned.)
+static Image rasterOf(Image img, Image* copy) {
+  *copy = NULL;
+  if (img->layout != IMAGE_TILED) return img;
+  *copy = ImageCreate(img->width, img->height, img->maxval);
+  if (*copy != NULL) copyPixels(*copy, img);
+  return *copy;
+}
+
+// Likewise for in-place operations: convert img to raster if it is tiled.
+// Returns 0 (with errno/errCause set) on failure.
+static int rowsOf(Image img) {
+  return img->layout != IMAGE_TILED || ImageSetLayout(img, IMAGE_RASTER);
+}
+
+// Convert a result image created by a row kernel to the given layout.
+// Layout is only a matter of performance, so if there is no memory for
+// the conversion, the result is simply left as a raster image.
+static Image toLayout(Image img, int layout) {
+  if (img != NULL) {
     errsave = errno;
-    ImageDestroy(&img);
+    ImageSetLayout(img, layout);
     errno = errsave;
   }
-  if (f != NULL) fclose(f);
   return img;
 }
 
-/// Save image to PGM file.
-/// On success, returns nonzero.
-/// On failure, returns 0, errno/errCause are set appropriately, and
-/// a partial and invalid file may be left in the system.
-int ImageSave(Image img, const char* filename) { ///
-  assert (img != NULL);
-  int w = img->width;
-  int h = img->height;
-  uint8 maxval = img->maxval;
-  FILE* f = NULL;
 
-  int success =
-  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
-  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+/// Parallel execution
 
-  // Cleanup
-  if (f != NULL) fclose(f);
-  return success;
-}
+// Row operations on large images are split among a pool of worker
+// threads by parallelFor.  The rows are divided into chunks, dealt out
+// evenly to the participating threads (the caller and the workers), and
+// each thread processes its own chunks from the front, and then steals
+// the remaining chunks of the others from the back.
+//
+// The pool runs one parallelFor at a time: calls made while it is busy
+// (from other threads, or from the workers themselves) run serially.
+// Workers are started lazily; if they cannot be created, operations just
+// use fewer threads.
 
+#define PARMAX 64           // max threads
+#define PARMIN (1 << 16)    // min pixels to go parallel
+#define PARCHUNKS 8         // chunks per thread
 
-/// Information queries
+typedef void (*RowsFn)(void* arg, int y0, int y1);
 
-/// These functions do not modify the image and never fail.
+// Chunks not yet taken by a thread: next (low 32 bits) to end (high bits)
+struct parSlot {
+  _Atomic uint64_t range;
+} __attribute__((aligned(64)));
 
-/// Get image width
-int ImageWidth(Image img) { ///
-  assert (img != NULL);
-  return img->width;
-}
+static struct {
+  pthread_mutex_t lock;   // held by the caller for the whole parallelFor
+  pthread_mutex_t wlock;  // protects the fields below
+  pthread_cond_t start;
+  pthread_cond_t done;
+  int nworkers;     // workers started
+  unsigned gen;     // incremented for each job
+  int finished;     // workers finished with the current job
+  // Current job
+  RowsFn fn;
+  void* arg;
+  int rows;         // total rows
+  int chunk;        // rows per chunk
+  int nslots;       // participating threads
+  struct parSlot slot[PARMAX];
+} pool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+};
 
-/// Get image height
-int ImageHeight(Image img) { ///
-  assert (img != NULL);
-  return img->height;
+static int poolThreads = 0;   // configured threads (0 = one per CPU)
+static _Thread_local int inWorker = 0;
+
+/// Set the number of threads used by image operations.
+void ImageSetThreads(int n) { ///
+  assert (n >= 0);
+  poolThreads = n;
 }
 
-/// Get image maximum gray level
-int ImageMaxval(Image img) { ///
-  assert (img != NULL);
-  return img->maxval;
+// Number of threads to use.
+static int parThreads(void) {
+  int n = poolThreads;
+  if (n == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n = cpus > 0 ? (int)cpus : 1;
+  }
+  return n < PARMAX ? n : PARMAX;
 }
 
-/// Pixel stats
-/// Find the minimum and maximum gray levels in image.
-/// On return,
-/// *min is set to the minimum gray level in the image,
-/// *max is set to the maximum.
-void ImageStats(Image img, uint8* min, uint8* max) { ///
-  assert (img != NULL);
-  assert (min != NULL);
-  assert (max != NULL);
-  
-  *min = PixMax; // Configurando o mínimo para o valor máximo possível inicialmente
-    *max = 0;      // Configurando o máximo para 0 inicialmente
+// Take a chunk of slot s: from the front if own, else from the back.
+// Returns the chunk number, or -1 if there are none left.
+static int parTake(struct parSlot* s, int own) {
+  uint64_t r = atomic_load(&s->range);
+  for (;;) {
+    uint32_t next = (uint32_t)r;
+    uint32_t end = (uint32_t)(r >> 32);
+    if (next >= end) return -1;
+    uint64_t taken = own ? r + 1 : r - ((uint64_t)1 << 32);
+    if (atomic_compare_exchange_weak(&s->range, &r, taken)) {
+      return (int)(own ? next : end - 1);
+    }
+  }
+}
 
-    for (int i = 0; i < img->width * img->height; i++) {
-        if (img->pixel[i] < *min) {
-            *min = img->pixel[i]; // Atualiza o mínimo se encontrar um valor menor
-        }
-        if (img->pixel[i] > *max) {
-            *max = img->pixel[i]; // Atualiza o máximo se encontrar um valor maior
-        }
+// Process the chunks of the current job as thread number self.
+static void parRun(int self) {
+  int n = pool.nslots;
+  for (int k = 0; k < n; k++) {
+    int s = (self + k) % n;
+    int c;
+    while ((c = parTake(&pool.slot[s], s == self)) >= 0) {
+      int y0 = c * pool.chunk;
+      int y1 = y0 + pool.chunk < pool.rows ? y0 + pool.chunk : pool.rows;
+      pool.fn(pool.arg, y0, y1);
     }
+  }
 }
 
-/// Check if pixel position (x,y) is inside img.
-int ImageValidPos(Image img, int x, int y) { ///
-  assert (img != NULL);
-  return (0 <= x && x < img->width) && (0 <= y && y < img->height);
+static void* parWorker(void* arg) {
+  int self = (int)(intptr_t)arg;
+  inWorker = 1;
+  pthread_mutex_lock(&pool.wlock);
+  // (Workers are started by parallelFor just before it starts a job.)
+  unsigned gen = pool.gen - 1;
+  for (;;) {
+    while (pool.gen == gen) pthread_cond_wait(&pool.start, &pool.wlock);
+    gen = pool.gen;
+    int joins = self < pool.nslots;
+    pthread_mutex_unlock(&pool.wlock);
+    if (joins) parRun(self);
+    pthread_mutex_lock(&pool.wlock);
+    pool.finished++;
+    pthread_cond_signal(&pool.done);
+  }
+  return NULL;
 }
 
-/// Check if rectangular area (x,y,w,h) is completely inside img.
-int ImageValidRect(Image img, int x, int y, int w, int h) { ///
-  assert (img != NULL);
-  // Verifica se as coordenadas superior esquerda e inferior direita do retângulo estão dentro dos limites da imagem
-    return ImageValidPos(img, x, y) && ImageValidPos(img, x + w - 1, y + h - 1);
+// Call fn(arg, y0, y1) for consecutive row ranges [y0, y1) covering rows
+// 0 to rows-1, in parallel if the operation is large enough (pixels is
+// the number of pixels processed).  The calls must be independent.
+static void parallelFor(int rows, size_t pixels, RowsFn fn, void* arg) {
+  int n = parThreads();
+  if (n > rows) n = rows;
+  if (n <= 1 || pixels < PARMIN || inWorker ||
+      pthread_mutex_trylock(&pool.lock) != 0) {
+    if (rows > 0) fn(arg, 0, rows);
+    return;
+  }
+  // Start more workers, if needed
+  pthread_mutex_lock(&pool.wlock);
+  while (pool.nworkers < n - 1) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, parWorker, (void*)(intptr_t)(pool.nworkers + 1)) != 0) break;
+    pthread_detach(thread);
+    pool.nworkers++;
+  }
+  if (n > pool.nworkers + 1) n = pool.nworkers + 1;
+
+  // Deal out the chunks
+  int chunks = n * PARCHUNKS < rows ? n * PARCHUNKS : rows;
+  pool.chunk = (rows + chunks - 1) / chunks;
+  chunks = (rows + pool.chunk - 1) / pool.chunk;
+  for (int s = 0; s < n; s++) {
+    uint64_t first = (uint64_t)chunks * s / n;
+    uint64_t last = (uint64_t)chunks * (s + 1) / n;
+    atomic_store(&pool.slot[s].range, first | last << 32);
+  }
+  pool.fn = fn;
+  pool.arg = arg;
+  pool.rows = rows;
+  pool.nslots = n;
+  pool.finished = 0;
+  pool.gen++;
+  pthread_cond_broadcast(&pool.start);
+  pthread_mutex_unlock(&pool.wlock);
+
+  parRun(0);
+
+  // Wait for all workers (including those not participating)
+  pthread_mutex_lock(&pool.wlock);
+  while (pool.finished < pool.nworkers) pthread_cond_wait(&pool.done, &pool.wlock);
+  pthread_mutex_unlock(&pool.wlock);
+  pthread_mutex_unlock(&pool.lock);
 }
 
-/// Pixel get & set operations
 
-/// These are the primitive operations to access and modify a single pixel
-/// in the image.
-/// These are very simple, but fundamental operations, which may be used to 
-/// implement more complex operations.
+/// CPU dispatch
 
-// Transform (x, y) coords into linear pixel index.
-// This internal function is used in ImageGetPixel / ImageSetPixel. 
-// The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y) {
-  int index;
-  assert (img != NULL);
-  assert (ImageValidPos(img, x, y));
-  index = y*img->width + x;
-  if (index < 0) index = 0;
-  if (index >= img->width*img->height) index = img->width*img->height - 1;
+// The inner loops of several operations ("kernels") have a portable
+// scalar implementation and vector implementations for SSE2, AVX2 and
+// AVX-512, as supported by the compiler.  One binary runs everywhere:
+// the AVX2 and AVX-512 code is compiled for those targets function by
+// function, and the set of kernels is chosen on first use, according to
+// the CPU (and IMAGE_SIMD, see ImageSimd).
+// All implementations of a kernel must give identical results (simdTest
+// checks them against the scalar ones); a set for an instruction set
+// borrows the kernels of the one below it where it has no better one.
 
-  assert (0 <= index && index < img->width*img->height);
-  return index;
+// Kernel signatures (see the scalar implementations for their meaning)
+struct kernels {
+  uint32_t (*adler32)(const uint8* p, size_t n);
+  void (*rowDelta)(uint8* d, const uint8* a, const uint8* b, int n, int add);
+  void (*rowMinMax)(uint8* d, const uint8* a, const uint8* b, int n, int isMax);
+  void (*sobelSpan)(const uint8* r0, const uint8* r1, const uint8* r2,
+                    uint8* d, int n, int maxval);
+  void (*accumulate)(uint32_t* acc, const uint16_t* t, int wgt, int n);
+  void (*halveRow)(uint8* d, const uint8* r0, const uint8* r1, int w, int n);
+  void (*bilinear)(uint8* d, const uint8* p00, const uint8* p01,
+                   const uint8* p10, const uint8* p11,
+                   const uint8* fx, const uint8* fy, int n);
+  void (*packBlocks)(uint64_t* row, const uint8* p, int blocks, uint8 thr);
+  void (*convRow)(int32_t* acc, const uint8* const* src, const int16_t* coef,
+                  int taps, int n);
+  void (*convCol)(int32_t* acc, const int32_t* const* src,
+                  const int16_t* coef, int taps, int n);
+  int (*findPair)(const uint8* a, uint8 va, const uint8* b, uint8 vb,
+                  int i, int n);
+};
+
+// Kernel sets, by instruction set (all NULL if not built; see the end of
+// this file)
+static const struct kernels kernelSets[IMAGE_SIMD_AVX512 + 1];
+
+#if defined(KERNELS_X86)
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+
+static pthread_once_t kernelsOnce = PTHREAD_ONCE_INIT;
+static _Atomic(const struct kernels*) kernelsUsed;
+
+static void kernelsInit(void);
+
+// The kernels in use.
+static inline const struct kernels* K(void) {
+  pthread_once(&kernelsOnce, kernelsInit);
+  return atomic_load_explicit(&kernelsUsed, memory_order_relaxed);
 }
 
-/// Get the pixel (level) at position (x,y).
-uint8 ImageGetPixel(Image img, int x, int y) { ///
-  assert (img != NULL);
-  assert (ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (read)
-  return img->pixel[G(img, x, y)];
-} 
 
-/// Set the pixel at position (x,y) to new level.
-void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
-  assert (img != NULL);
-  assert (ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (store)
-  img->pixel[G(img, x, y)] = level;
-} 
+/// PGM file operations
 
+// See also:
+// PGM format specification: http://netpbm.sourceforge.net/doc/pgm.html
 
-/// Pixel transformations
+// Match and skip 0 or more comment lines in file f.
+// Comments start with a # and continue until the end-of-line, inclusive.
+// Returns the number of comments skipped.
+static int skipComments(FILE* f) {
+  char c;
+  int i = 0;
+  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
+    i++;
+  }
+  return i;
+}
 
-/// These functions modify the pixel levels in an image, but do not change
-/// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
-/// They never fail.
+// Compressed file format
+//
+// A lossless format for images with large flat areas (such as document
+// scans), which is much smaller than PGM and decodes faster than disks
+// can deliver it.  The file starts with a 16 byte header:
+//   "I8Z1", width, height (32 bit little-endian), maxval, 3 zero bytes,
+// followed by bands of ZBAND rows (the last one may be shorter).
+// Each band is stored as:
+//   encoded length, Adler-32 checksum of the pixels (32 bit little-endian),
+//   encoded bytes.
+// To encode a band, each row except the first is replaced by its
+// difference to the row above (mod 256), so flat areas become runs of
+// zeros.  The result is coded, in the style of LZ4, as a sequence of
+//   token, literal bytes, [run byte]
+// where the token has the number of literals in the high nibble and
+// the run length (0 for no run, or length-ZRUNMIN+1) in the low nibble.
+// A nibble of 15 is followed by extra bytes to add to it, up to and
+// including the first one that is not 255 (the literal count's extra bytes
+// precede the literals, the run's precede the run byte).
+// Bands are independent of each other, and the same block coding is used
+// for the tiles of tiled files.
 
+#define ZMAGIC "I8Z1"
+#define ZBAND 64          // rows per band
+#define ZRUNMIN 3         // min run length
+#define ZBOUND(n) ((n) + (n) / 255 + 16)   // max encoded size of n bytes
 
-/// Transform image to negative image.
-/// This transforms dark pixels to light pixels and vice-versa,
-/// resulting in a "photographic negative" effect.
-void ImageNegative(Image img) { ///
-  assert (img != NULL);
-  // Insert your code here!
-	for (int x = 0; x < img->width; x++)
-		for (int y = 0; y < img->height; y++)
-			ImageSetPixel(img, x, y, img->maxval - ImageGetPixel(img, x, y));
+static void put32(uint8* p, uint32_t v) {
+  p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
 }
 
-/// Apply threshold to image.
-/// Transform all pixels with level<thr to black (0) and
-/// all pixels with level>=thr to white (maxval).
-void ImageThreshold(Image img, uint8 thr) { ///
-  assert (img != NULL);
-  // Insert your code here!
-	for (int x = 0; x < img->width; x++)
-		for (int y = 0; y < img->height; y++)
-			ImageSetPixel(img, x, y, ImageGetPixel(img, x, y) >= thr ? img->maxval : 0);
+static uint32_t get32(const uint8* p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
 }
 
-/// Brighten image by a factor.
-/// Multiply each pixel level by a factor, but saturate at maxval.
-/// This will brighten the image if factor>1.0 and
-/// darken the image if factor<1.0.
-void ImageBrighten(Image img, double factor) { ///
-  assert (img != NULL);
-  // ? assert (factor >= 0.0);
-  assert(factor >= 0.0); // Se desejar garantir que o fator seja positivo
-    
-    int width = img->width;
-    int height = img->height;
+static void put64(uint8* p, uint64_t v) {
+  put32(p, (uint32_t)v);
+  put32(p + 4, (uint32_t)(v >> 32));
+}
 
-	for (int x = 0; x < width; x++)
-		for (int y = 0; y < height; y++) {
-        	// Saturar o valor para o máximo, se necessário
-			ImageSetPixel(img, x, y, roundPixel(ImageGetPixel(img, x, y) * factor));
-    		if (ImageGetPixel(img, x, y) > img->maxval)
-				ImageSetPixel(img, x, y, img->maxval);
-	}
+static uint64_t get64(const uint8* p) {
+  return get32(p) | (uint64_t)get32(p + 4) << 32;
 }
 
-/// Geometric transformations
+// Adler-32 checksum of p[0..n-1].
+static uint32_t adler32Scalar(const uint8* p, size_t n) {
+  uint32_t a = 1, b = 0;
+  while (n > 0) {
+    size_t k = n < 5552 ? n : 5552;   // max k without overflow of b
+    n -= k;
+    while (k-- > 0) {
+      a += *p++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return b << 16 | a;
+}
 
-/// These functions apply geometric transformations to an image,
-/// returning a new image as a result.
-/// 
-/// Success and failure are treated as in ImageCreate:
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
+#if defined(__SSE2__)
+static uint32_t adler32SSE2(const uint8* p, size_t n) {
+  uint32_t a = 1, b = 0;
+  while (n > 0) {
+    size_t k = n < 5552 ? n : 5552;   // max k without overflow of b
+    n -= k;
+    // 16 bytes at a time: a grows by their sum, and b by 16 times the
+    // previous a plus their sum weighted 16, 15, ..., 1.
+    size_t blocks = k / 16;
+    if (blocks > 0) {
+      const __m128i zero = _mm_setzero_si128();
+      const __m128i wlo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+      const __m128i whi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+      __m128i vs1 = zero;   // sum of bytes
+      __m128i vps = zero;   // sum of vs1 before each block
+      __m128i vs2 = zero;   // sum of weighted bytes
+      for (size_t i = 0; i < blocks; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        vps = _mm_add_epi32(vps, vs1);
+        vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(v, zero));
+        vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), wlo));
+        vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), whi));
+        p += 16;
+      }
+      uint32_t s1[4], ps[4], s2[4];
+      _mm_storeu_si128((__m128i*)s1, vs1);
+      _mm_storeu_si128((__m128i*)ps, vps);
+      _mm_storeu_si128((__m128i*)s2, vs2);
+      uint64_t bb = b + 16 * (uint64_t)a * blocks +
+                    16 * ((uint64_t)ps[0] + ps[1] + ps[2] + ps[3]) +
+                    ((uint64_t)s2[0] + s2[1] + s2[2] + s2[3]);
+      a = (a + s1[0] + s1[1] + s1[2] + s1[3]) % 65521;
+      b = bb % 65521;
+      k -= blocks * 16;
+    }
+    while (k-- > 0) {
+      a += *p++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return b << 16 | a;
+}
+#endif
 
-// Implementation hint: 
-// Call ImageCreate whenever you need a new image!
+// d[i] = a[i] - b[i] (or + if add) mod 256, for i in [0, n).
+// (d may be a.)
+static void rowDeltaScalar(uint8* d, const uint8* a, const uint8* b, int n,
+                           int add) {
+  for (int i = 0; i < n; i++) d[i] = add ? a[i] + b[i] : a[i] - b[i];
+}
+
+#if defined(__SSE2__)
+static void rowDeltaSSE2(uint8* d, const uint8* a, const uint8* b, int n,
+                         int add) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+    __m128i vd = add ? _mm_add_epi8(va, vb) : _mm_sub_epi8(va, vb);
+    _mm_storeu_si128((__m128i*)(d + i), vd);
+  }
+  rowDeltaScalar(d + i, a + i, b + i, n - i, add);
+}
+#endif
+
+#if defined(KERNELS_X86)
+TARGET("avx2")
+static void rowDeltaAVX2(uint8* d, const uint8* a, const uint8* b, int n,
+                         int add) {
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+    __m256i vd = add ? _mm256_add_epi8(va, vb) : _mm256_sub_epi8(va, vb);
+    _mm256_storeu_si256((__m256i*)(d + i), vd);
+  }
+  rowDeltaScalar(d + i, a + i, b + i, n - i, add);
+}
+
+// (The tail is done with masked loads and stores.)
+TARGET("avx512f,avx512bw")
+static void rowDeltaAVX512(uint8* d, const uint8* a, const uint8* b, int n,
+                           int add) {
+  for (int i = 0; i < n; i += 64) {
+    __mmask64 m = n - i >= 64 ? ~(__mmask64)0 : ((__mmask64)1 << (n - i)) - 1;
+    __m512i va = _mm512_maskz_loadu_epi8(m, a + i);
+    __m512i vb = _mm512_maskz_loadu_epi8(m, b + i);
+    __m512i vd = add ? _mm512_add_epi8(va, vb) : _mm512_sub_epi8(va, vb);
+    _mm512_mask_storeu_epi8(d + i, m, vd);
+  }
+}
+#endif
+
+// Emit a length nibble value k (given the bits for it are already in the
+// token) as extra bytes to out, if needed.  Returns the new end of out.
+static uint8* zExtra(uint8* out, size_t k) {
+  if (k >= 15) {
+    for (k -= 15; k >= 255; k -= 255) *out++ = 255;
+    *out++ = (uint8)k;
+  }
+  return out;
+}
+
+// Read the extra bytes of a length nibble k from (*src) up to end.
+// Returns the length, or (size_t)-1 if the data ends prematurely.
+static size_t zLength(const uint8** src, const uint8* end, size_t k) {
+  if (k == 15) {
+    unsigned b;
+    do {
+      if (*src == end) return (size_t)-1;
+      b = *(*src)++;
+      k += b;
+    } while (b == 255);
+  }
+  return k;
+}
+
+// Emit a sequence with the nlit literals at lit, followed by a run of
+// length run (0 for none) of byte v, to out.  Returns the new end of out.
+static uint8* zSequence(uint8* out, const uint8* lit, size_t nlit,
+                        size_t run, uint8 v) {
+  size_t code = run > 0 ? run - ZRUNMIN + 1 : 0;
+  *out++ = (uint8)((nlit < 15 ? nlit : 15) << 4 | (code < 15 ? code : 15));
+  out = zExtra(out, nlit);
+  memcpy(out, lit, nlit);
+  out += nlit;
+  if (run > 0) {
+    out = zExtra(out, code);
+    *out++ = v;
+  }
+  return out;
+}
+
+// Encode src[0..n-1] into dst, which must have room for ZBOUND(n) bytes.
+// Returns the encoded size.
+static size_t zEncode(const uint8* src, size_t n, uint8* dst) {
+  uint8* out = dst;
+  size_t lit = 0;   // start of pending literals
+  size_t i = 0;
+  while (n >= ZRUNMIN && i <= n - ZRUNMIN) {
+    // Find the next run of at least ZRUNMIN equal bytes
+    uint8 v = src[i];
+    if (src[i + 1] != v || src[i + 2] != v) {
+      i++;
+      continue;
+    }
+    // Extend it, 8 bytes at a time while possible
+    size_t j = i + ZRUNMIN;
+    uint64_t vv = v * 0x0101010101010101ULL;
+    uint64_t word;
+    while (j + 8 <= n && (memcpy(&word, src + j, 8), word == vv)) j += 8;
+    while (j < n && src[j] == v) j++;
+    out = zSequence(out, src + lit, i - lit, j - i, v);
+    i = lit = j;
+  }
+  if (lit < n) out = zSequence(out, src + lit, n - lit, 0, 0);
+  return out - dst;
+}
+
+// Decode src[0..len-1] into dst[0..n-1].
+// Returns nonzero if the encoded data decodes to exactly n bytes.
+static int zDecode(const uint8* src, size_t len, uint8* dst, size_t n) {
+  const uint8* end = src + len;
+  uint8* out = dst;
+  uint8* oend = dst + n;
+  while (src < end) {
+    unsigned token = *src++;
+    size_t k = zLength(&src, end, token >> 4);
+    if (k > (size_t)(end - src) || k > (size_t)(oend - out)) return 0;
+    // (Short copies are done as fixed 16 byte copies, when there is room.)
+    if (k <= 16 && end - src >= 16 && oend - out >= 16) memcpy(out, src, 16);
+    else memcpy(out, src, k);
+    src += k;
+    out += k;
+    if ((token & 15) > 0) {
+      k = zLength(&src, end, token & 15);
+      if (k == (size_t)-1 || src == end) return 0;
+      k += ZRUNMIN - 1;
+      if (k > (size_t)(oend - out)) return 0;
+      if (k <= 16 && oend - out >= 16) memset(out, *src, 16);
+      else memset(out, *src, k);
+      src++;
+      out += k;
+    }
+  }
+  return out == oend;
+}
+
+// Encode the w x h block of img at (x0, y0) into dst, which must have room
+// for ZBOUND(w*h) bytes, using raw (room for w*h bytes) as work space.
+// Sets (*sum) to the checksum of the block and returns the encoded size.
+static size_t zEncodeBlock(Image img, int x0, int y0, int w, int h,
+                           uint8* raw, uint8* dst, uint32_t* sum) {
+  // Gather the rows
+  uint8* r = raw;
+  for (int y = y0; y < y0 + h; y++) {
+    int len;
+    for (int x = x0; x < x0 + w; x += len) {
+      const uint8* p = spanAt(img, x, y, &len);
+      if (len > x0 + w - x) len = x0 + w - x;
+      memcpy(r, p, len);
+      r += len;
+    }
+  }
+  *sum = K()->adler32(raw, (size_t)w * h);
+  // Differences to the row above (bottom-up, in-place)
+  for (int y = h - 1; y > 0; y--) {
+    uint8* row = raw + (size_t)y * w;
+    K()->rowDelta(row, row, row - w, w, 0);
+  }
+  return zEncode(raw, (size_t)w * h, dst);
+}
+
+// Decode a w x h block encoded by zEncodeBlock into raw (w*h bytes).
+// Returns nonzero on success, 0 if the data is corrupt.
+static int zDecodeBlock(const uint8* src, size_t len, uint32_t sum,
+                        uint8* raw, int w, int h) {
+  if (!zDecode(src, len, raw, (size_t)w * h)) return 0;
+  for (int y = 1; y < h; y++) {
+    uint8* row = raw + (size_t)y * w;
+    K()->rowDelta(row, row, row - w, w, 1);
+  }
+  return K()->adler32(raw, (size_t)w * h) == sum;
+}
+
+// Tiled file format
+//
+// For random access to parts of huge images.  The file starts with a 16
+// byte header:
+//   "I8T1", width, height (32 bit little-endian), maxval,
+//   log2 of the tile size, 2 zero bytes,
+// followed by an index with a 16 byte entry for each tile (in raster
+// order of tiles):
+//   offset from the start of the header (64 bit), encoded length,
+//   Adler-32 checksum (32 bit),
+// and then by the tiles, each encoded as a block (see zEncodeBlock).
+// Tiles are square, except at the right and bottom edges.
+// So reading a region only takes reading the index entries and the tiles
+// that intersect it.
+
+#define TMAGIC "I8T1"
+#define TSHIFT 8          // log2 of the tile size written
+
+// An image file open for reading (see openImageFile)
+struct imageFile {
+  FILE* f;
+  int format;        // IMAGE_PGM, IMAGE_I8Z or IMAGE_I8T
+  int width;
+  int height;
+  uint8 maxval;
+  int tileShift;     // log2 of the tile size (IMAGE_I8T)
+  off_t base;        // file offset of the header (-1 if not seekable)
+  off_t start;       // file offset of the data after the header
+  int atStart;       // nothing has been read after the header yet
+};
+
+// Read the header of an image file in any format from f, into r.
+// Returns nonzero on success.
+// On failure, returns 0 and errno/errCause are set accordingly.
+static int openImageFile(struct imageFile* r, FILE* f) {
+  int success;
+  r->f = f;
+  errsave = errno;
+  r->base = ftello(f);   // (-1 if f is not seekable)
+  errno = errsave;
+  int c = getc(f);
+  ungetc(c, f);
+  if (c == ZMAGIC[0]) {
+    uint8 head[16];
+    success =
+    check( fread(head, 1, 16, f) == 16 , "Invalid file format" ) &&
+    check( memcmp(head, ZMAGIC, 4) == 0 || memcmp(head, TMAGIC, 4) == 0 , "Invalid file format" ) &&
+    check( get32(head + 4) <= INT_MAX , "Invalid width" ) &&
+    check( get32(head + 8) <= INT_MAX , "Invalid height" ) &&
+    check( head[12] > 0 , "Invalid maxval" ) &&
+    check( head[2] == ZMAGIC[2] || (4 <= head[13] && head[13] <= 15) , "Invalid tile size" );
+    if (success) {
+      r->format = head[2] == ZMAGIC[2] ? IMAGE_I8Z : IMAGE_I8T;
+      r->width = get32(head + 4);
+      r->height = get32(head + 8);
+      r->maxval = head[12];
+      r->tileShift = head[13];
+      r->start = r->base >= 0 ? r->base + 16 : -1;
+      r->atStart = 1;
+    }
+    return success;
+  }
+  int w, h;
+  int maxval;
+  char ch;
+  success = 
+  // Parse PGM header
+  check( fscanf(f, "P%c ", &ch) == 1 && ch == '5' , "Invalid file format" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
+  check( fscanf(f, "%c", &ch) == 1 && isspace(ch) , "Whitespace expected" );
+  if (success) {
+    r->format = IMAGE_PGM;
+    r->width = w;
+    r->height = h;
+    r->maxval = (uint8)maxval;
+    r->tileShift = 0;
+    errsave = errno;
+    r->start = ftello(f);   // (-1 if f is not seekable)
+    errno = errsave;
+    r->atStart = 1;
+  }
+  return success;
+}
+
+// Seek to position pos of image file r.
+static int seekTo(struct imageFile* r, off_t pos) {
+  return check( pos >= 0 && fseeko(r->f, pos, SEEK_SET) == 0 , "Seek failed" );
+}
+
+// Copy rows [y0, y1) of the w x h region at (x, y) of an image from raw,
+// which holds a block of width bw at (bx, by) of that image, into img
+// (which holds the region).
+static void copyRegionRows(Image img, int x, int y, const uint8* raw,
+                           int bx, int by, int bw, int y0, int y1) {
+  int x0 = x > bx ? x : bx;
+  int x1 = x + img->width < bx + bw ? x + img->width : bx + bw;
+  for (int yy = y0; yy < y1; yy++) {
+    memcpy(img->pixel + (size_t)(yy - y) * img->stride + (x0 - x),
+           raw + (size_t)(yy - by) * bw + (x0 - bx), x1 - x0);
+  }
+}
+
+// Read the pixels of the region at (x, y) of PGM file r into img
+// (in a raster layout).
+// Returns nonzero on success, or 0 with errno/errCause set on failure.
+static int readPGMRegion(struct imageFile* r, Image img, int x, int y) {
+  int w = img->width;
+  int h = img->height;
+  if (w == r->width) {   // whole rows: a single read
+    int success =
+    ((r->atStart && y == 0) || seekTo(r, r->start + (off_t)y * w)) &&
+    check( fread(img->pixel, 1, (size_t)w * h, r->f) == (size_t)w * h , "Reading pixels" );
+    // Spread padded rows out to their place, from the last one
+    size_t pad = img->stride - w;
+    for (int i = h - 1; success && pad > 0 && i >= 0; i--) {
+      uint8* row = img->pixel + (size_t)i * img->stride;
+      memmove(row, img->pixel + (size_t)i * w, w);
+      memset(row + w, 0, pad);
+    }
+    return success;
+  }
+  for (int i = 0; i < h; i++) {
+    int success =
+    seekTo(r, r->start + (off_t)(y + i) * r->width + x) &&
+    check( fread(img->pixel + (size_t)i * img->stride, 1, w, r->f) == (size_t)w , "Reading pixels" );
+    if (!success) return 0;
+  }
+  return 1;
+}
+
+// Read the pixels of the region at (x, y) of compressed file r into img
+// (in a raster layout).
+// Bands above the region are skipped, and those below are not read.
+// (Regions read right after the header, such as whole images, are read
+// sequentially, without seeking.)
+// Returns nonzero on success, or 0 with errno/errCause set on failure.
+static int readI8ZRegion(struct imageFile* r, Image img, int x, int y) {
+  int W = r->width;
+  int whole = (img->width == W && img->height == r->height &&
+               img->stride == (size_t)W);
+  size_t n = (size_t)W * ZBAND;
+  uint8* enc = (uint8*)malloc(ZBOUND(n) + (whole ? 0 : n));
+  int success =
+  check( enc != NULL , "Memory allocation error" ) &&
+  (r->atStart || seekTo(r, r->start));
+  uint8* raw = success ? enc + ZBOUND(n) : NULL;   // band (unless decoded in place)
+  for (int by = 0; success && by < y + img->height; by += ZBAND) {
+    int bh = r->height - by < ZBAND ? r->height - by : ZBAND;
+    uint8 rec[8];
+    size_t len;
+    success =
+    check( fread(rec, 1, 8, r->f) == 8 , "Reading pixels" ) &&
+    check( (len = get32(rec)) <= ZBOUND((size_t)W * bh) , "Corrupt compressed data" );
+    if (success && by + bh <= y) {   // skip band
+      success = check( fseeko(r->f, len, SEEK_CUR) == 0 , "Seek failed" );
+      continue;
+    }
+    uint8* dst = whole ? img->pixel + (size_t)by * W : raw;
+    success = success &&
+    check( fread(enc, 1, len, r->f) == len , "Reading pixels" ) &&
+    check( zDecodeBlock(enc, len, get32(rec + 4), dst, W, bh) , "Corrupt compressed data" );
+    if (success && !whole) {
+      int y0 = by > y ? by : y;
+      int y1 = by + bh < y + img->height ? by + bh : y + img->height;
+      copyRegionRows(img, x, y, raw, 0, by, W, y0, y1);
+    }
+  }
+  errsave = errno;
+  free(enc);
+  errno = errsave;
+  return success;
+}
+
+// Read the pixels of the region at (x, y) of tiled file r into img
+// (in a raster layout).
+// Only the index entries and tiles that intersect the region are read.
+// Returns nonzero on success, or 0 with errno/errCause set on failure.
+static int readI8TRegion(struct imageFile* r, Image img, int x, int y) {
+  int w = img->width;
+  int h = img->height;
+  if (w == 0 || h == 0) return 1;
+  int s = r->tileShift;
+  int ts = 1 << s;
+  int nx = (int)(((int64_t)r->width + ts - 1) >> s);   // tiles per row
+  int tx0 = x >> s, tx1 = (x + w - 1) >> s;
+  int ty0 = y >> s, ty1 = (y + h - 1) >> s;
+  size_t nidx = (size_t)(tx1 - tx0 + 1) * 16;
+  size_t tsize = (size_t)ts * ts;
+  uint8* idx = (uint8*)malloc(nidx + tsize + ZBOUND(tsize));
+  int success = check( idx != NULL , "Memory allocation error" );
+  uint8* raw = success ? idx + nidx : NULL;
+  uint8* enc = success ? raw + tsize : NULL;
+  for (int ty = ty0; success && ty <= ty1; ty++) {
+    int y0 = ty << s;
+    int th = r->height - y0 < ts ? r->height - y0 : ts;
+    success =
+    seekTo(r, r->start + 16 * ((off_t)ty * nx + tx0)) &&
+    check( fread(idx, 1, nidx, r->f) == nidx , "Reading tile index" );
+    for (int tx = tx0; success && tx <= tx1; tx++) {
+      const uint8* e = idx + 16 * (tx - tx0);
+      int x0 = tx << s;
+      int tw = r->width - x0 < ts ? r->width - x0 : ts;
+      size_t len = get32(e + 8);
+      success =
+      check( len <= ZBOUND((size_t)tw * th) && get64(e) <= (uint64_t)INT64_MAX - r->base , "Corrupt tiled data" ) &&
+      seekTo(r, r->base + (off_t)get64(e)) &&
+      check( fread(enc, 1, len, r->f) == len , "Reading pixels" ) &&
+      check( zDecodeBlock(enc, len, get32(e + 12), raw, tw, th) , "Corrupt tiled data" );
+      if (success) {
+        copyRegionRows(img, x, y, raw, x0, y0, tw,
+                       y0 > y ? y0 : y, y0 + th < y + h ? y0 + th : y + h);
+      }
+    }
+  }
+  errsave = errno;
+  free(idx);
+  errno = errsave;
+  return success;
+}
+
+// Read the w x h region at (x, y) of image file r, which must be inside
+// the image, into a new image in the given layout.
+// On success, a new image is returned.
+// On failure, returns NULL and errno/errCause are set accordingly.
+static Image readRegion(struct imageFile* r, int x, int y, int w, int h,
+                        int layout) {
+  // (Tiled images are read in raster layout, and then converted)
+  Image img = ImageCreateLayout(w, h, r->maxval,
+                                layout == IMAGE_TILED ? IMAGE_RASTER : layout);
+  if (img == NULL) return NULL;
+  int success;
+  switch (r->format) {
+  case IMAGE_I8Z: success = readI8ZRegion(r, img, x, y); break;
+  case IMAGE_I8T: success = readI8TRegion(r, img, x, y); break;
+  default: success = readPGMRegion(r, img, x, y);
+  }
+  r->atStart = 0;
+  PIXMEM += (unsigned long)w * h;  // count pixel memory accesses
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(&img);
+    errno = errsave;
+  }
+  return toLayout(img, layout);
+}
+
+// Standard input and output
+//
+// The file name "-" stands for the standard input, when loading, and for
+// the standard output, when saving.  Like netpbm tools, these may hold
+// several images one after the other (frames), which are read (or
+// written) by successive calls, straight between the pipe or file and the
+// pixel buffers.  Pipes are grown to hold a large part of a frame, so
+// frames cross them in few large reads and writes.
+
+#define STDNAME "-"
+#define PIPEMAX (1 << 20)   // max pipe size to ask for (bytes)
+
+// Grow fd, if it is a pipe, to hold up to size bytes (or PIPEMAX).
+// Preserves errno.
+static void pipeGrow(int fd, size_t size) {
+#if defined(F_SETPIPE_SZ)
+  int err = errno;
+  int cur = fcntl(fd, F_GETPIPE_SZ);
+  if (cur >= 0 && (size_t)cur < size && cur < PIPEMAX) {
+    fcntl(fd, F_SETPIPE_SZ, size < PIPEMAX ? (int)size : PIPEMAX);
+  }
+  errno = err;
+#endif
+}
+
+// Read the w x h region at (x, y) of the image at the current position of
+// stream f, or the whole image if w < 0, into a new image in the given
+// layout.  The file must be in the given format (or any, if format < 0).
+// On success, a new image is returned.
+// On failure, returns NULL and errno/errCause are set accordingly.
+static Image readFile(FILE* f, int format, int layout,
+                      int x, int y, int w, int h) {
+  Image img = NULL;
+  struct imageFile r;
+  int success =
+  openImageFile(&r, f) &&
+  check( format < 0 || r.format == format , "Invalid file format" );
+  if (success && w < 0) {
+    x = y = 0;
+    w = r.width;
+    h = r.height;
+  }
+  success = success &&
+  check( x >= 0 && y >= 0 && h >= 0 && x <= r.width - w && y <= r.height - h , "Invalid region" ) &&
+  (img = readRegion(&r, x, y, w, h, layout)) != NULL;
+  return img;
+}
+
+// Is stream f at its end (rather than at the start of another image)?
+// If so, sets errCause, and errno to 0 (unless reading failed).
+static int atEnd(FILE* f) {
+  int c = getc(f);
+  if (c != EOF) {
+    ungetc(c, f);
+    return 0;
+  }
+  if (!ferror(f)) errno = 0;
+  errCause = (char*)(ferror(f) ? "Reading failed" : "End of file");
+  return 1;
+}
+
+// Load the w x h region at (x, y) of image file filename (the next image
+// of the standard input, for "-"), or the whole image if w < 0, into a
+// new image in the given layout.  The file must be in the given format
+// (or any, if format < 0).
+// On success, a new image is returned.
+// On failure, returns NULL and errno/errCause are set accordingly.
+static Image loadFile(const char* filename, int format, int layout,
+                      int x, int y, int w, int h) {
+  if (strcmp(filename, STDNAME) == 0) {
+    pipeGrow(STDIN_FILENO, PIPEMAX);
+    if (atEnd(stdin)) return NULL;
+    return readFile(stdin, format, layout, x, y, w, h);
+  }
+  FILE* f = fopen(filename, "rb");
+  if (!check( f != NULL , "Open failed" )) return NULL;
+  Image img = readFile(f, format, layout, x, y, w, h);
+  errsave = errno;
+  fclose(f);
+  errno = errsave;
+  return img;
+}
+
+// Write the n buffers in iov to fd, resuming after partial writes.
+// (iov is modified.)  Returns nonzero on success.
+static int writevAll(int fd, struct iovec* iov, int n) {
+  while (n > 0) {
+    ssize_t k = writev(fd, iov, n);
+    if (k < 0) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    // Skip the buffers written, and advance into the next one
+    while (n > 0 && (size_t)k >= iov->iov_len) {
+      k -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (uint8*)iov->iov_base + k;
+      iov->iov_len -= k;
+    }
+  }
+  return 1;
+}
+
+// Write buffer p[0..n-1] to fd at offset pos, resuming after partial
+// writes.  Returns nonzero on success.
+static int pwriteAll(int fd, const uint8* p, size_t n, off_t pos) {
+  while (n > 0) {
+    ssize_t k = pwrite(fd, p, n, pos);
+    if (k < 0) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    p += k;
+    n -= k;
+    pos += k;
+  }
+  return 1;
+}
+
+// Write img to fd in compressed format.  Returns nonzero on success.
+// (Sets errno, but not errCause, on failure: see saveFile.)
+static int writeCompressed(int fd, Image img) {
+  int w = img->width;
+  size_t n = (size_t)w * ZBAND;
+  uint8* raw = (uint8*)malloc(n + ZBOUND(n));
+  if (raw == NULL) return 0;
+  uint8* enc = raw + n;
+  uint8 head[16] = ZMAGIC;
+  put32(head + 4, w);
+  put32(head + 8, img->height);
+  head[12] = img->maxval;
+  struct iovec iov[2] = { { head, 16 } };
+  int success = writevAll(fd, iov, 1);
+  for (int y = 0; success && y < img->height; y += ZBAND) {
+    int h = img->height - y < ZBAND ? img->height - y : ZBAND;
+    uint8 rec[8];
+    uint32_t sum;
+    size_t len = zEncodeBlock(img, 0, y, w, h, raw, enc, &sum);
+    put32(rec, len);
+    put32(rec + 4, sum);
+    iov[0].iov_base = rec;
+    iov[0].iov_len = 8;
+    iov[1].iov_base = enc;
+    iov[1].iov_len = len;
+    success = writevAll(fd, iov, 2);
+  }
+  int err = errno;
+  free(raw);
+  errno = err;
+  return success;
+}
+
+// Write an image to fd in tiled format.
+// The pixels come from img or, if img is NULL, are read from image file
+// src one row of tiles at a time.
+// Returns nonzero on success.
+// On failure, returns 0, errno is set, and (*cause) is set to the failure
+// cause.  (errCause is only changed when reading src.)
+static int writeTiled(int fd, Image img, struct imageFile* src,
+                      const char** cause) {
+  int W = img != NULL ? img->width : src->width;
+  int H = img != NULL ? img->height : src->height;
+  int ts = 1 << TSHIFT;
+  int nx = (int)(((int64_t)W + ts - 1) >> TSHIFT);
+  int ny = (int)(((int64_t)H + ts - 1) >> TSHIFT);
+  size_t isize = 16 + 16 * (size_t)nx * ny;   // header and index
+  size_t rsize = (size_t)ts * ts;
+  uint8* index = (uint8*)calloc(isize, 1);
+  uint8* raw = (uint8*)malloc(rsize + ZBOUND(rsize) * (nx > 0 ? nx : 1));
+  int success = index != NULL && raw != NULL;
+  uint8* enc = success ? raw + rsize : NULL;   // tiles of a row, encoded
+  int seekable = 0;
+  off_t base = 0;   // file offset of the header
+  uint8* body = NULL;
+  size_t blen = 0, bcap = 0;
+  *cause = "Memory allocation error";
+  if (success) {
+    memcpy(index, TMAGIC, 4);
+    put32(index + 4, W);
+    put32(index + 8, H);
+    index[12] = img != NULL ? img->maxval : src->maxval;
+    index[13] = TSHIFT;
+    // Tiles go after the index, which is written last.  If fd is not
+    // seekable (a pipe, say), or only appends, the tiles are kept in body
+    // instead, and written after the index.
+    // (fd may already hold other data, such as earlier frames of a stream,
+    // so the file is written from its current offset.)
+    int err = errno;
+    base = lseek(fd, 0, SEEK_CUR);
+    if (base >= 0) {
+      int flags = fcntl(fd, F_GETFL);
+      success = flags >= 0;
+      seekable = success && !(flags & O_APPEND);
+      success = success && (!seekable || lseek(fd, base + isize, SEEK_SET) >= 0);
+    } else {
+      base = 0;
+      success = errno == ESPIPE;
+    }
+    if (success) errno = err;
+    *cause = "Writing pixels failed";
+  }
+  off_t pos = isize;
+  for (int ty = 0; success && ty < ny; ty++) {
+    int y0 = ty << TSHIFT;
+    int th = H - y0 < ts ? H - y0 : ts;
+    Image band = img;
+    int by = y0;
+    if (img == NULL) {
+      band = readRegion(src, 0, y0, W, th, IMAGE_RASTER);
+      by = 0;
+      if (band == NULL) {
+        *cause = errCause;
+        success = 0;
+        break;
+      }
+    }
+    size_t len = 0;
+    for (int tx = 0; tx < nx; tx++) {
+      int x0 = tx << TSHIFT;
+      int tw = W - x0 < ts ? W - x0 : ts;
+      uint32_t sum;
+      size_t tlen = zEncodeBlock(band, x0, by, tw, th, raw, enc + len, &sum);
+      uint8* e = index + 16 + 16 * ((size_t)ty * nx + tx);
+      put64(e, pos + len);
+      put32(e + 8, tlen);
+      put32(e + 12, sum);
+      len += tlen;
+    }
+    if (img == NULL) ImageDestroy(&band);
+    if (seekable) {
+      struct iovec iov = { enc, len };
+      success = writevAll(fd, &iov, 1);
+    } else {
+      if (blen + len > bcap) {
+        bcap = 2 * bcap > blen + len ? 2 * bcap : blen + len;
+        uint8* b = (uint8*)realloc(body, bcap);
+        success = b != NULL;
+        if (!success) {
+          *cause = "Memory allocation error";
+          break;
+        }
+        body = b;
+      }
+      memcpy(body + blen, enc, len);
+      blen += len;
+    }
+    pos += len;
+  }
+  if (seekable) {
+    success = success && pwriteAll(fd, index, isize, base);
+  } else {
+    struct iovec iov[2] = { { index, isize }, { body, blen } };
+    success = success && writevAll(fd, iov, 2);
+  }
+  int err = errno;
+  free(body);
+  free(index);
+  free(raw);
+  errno = err;
+  return success;
+}
+
+// Write img to fd in tiled format (as writeTiled).
+static int writeTiledImage(int fd, Image img) {
+  const char* cause;
+  return writeTiled(fd, img, NULL, &cause);
+}
+
+/// Load a raw PGM file.
+/// Only 8 bit PGM files are accepted.
+/// Files in the compressed (I8Z) and tiled (I8T) formats of this module
+/// are also accepted: they are recognized by their signature.
+/// The image is loaded in IMAGE_RASTER layout.
+/// If filename is "-", the next image of the standard input is read
+/// (as ImageRead(stdin)).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoad(const char* filename) { ///
+  return loadFile(filename, -1, IMAGE_RASTER, 0, 0, -1, -1);
+}
+
+/// Load an image file (as ImageLoad) into an image with the given pixel
+/// storage layout (IMAGE_RASTER, IMAGE_TILED or IMAGE_ALIGNED).
+/// Raster and aligned images are read in place: the padding of aligned
+/// rows is handled while reading.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadLayout(const char* filename, int layout) { ///
+  assert (layout == IMAGE_RASTER || layout == IMAGE_TILED ||
+          layout == IMAGE_ALIGNED);
+  return loadFile(filename, -1, layout, 0, 0, -1, -1);
+}
+
+/// Load a rectangular region of an image file.
+/// Loads the same image as ImageCrop(ImageLoad(filename), x, y, w, h),
+/// but only reads the parts of the file needed:
+/// the rows of the region for PGM files, the bands of rows up to the region
+/// (decoding only those that intersect it) for compressed files, and just
+/// the tiles that intersect the region for tiled files (see ImageSaveTiled).
+/// Except for whole images, the file must be seekable.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure (including if the region is not inside the image),
+/// returns NULL and errno/errCause are set accordingly.
+Image ImageLoadRegion(const char* filename, int x, int y, int w, int h) { ///
+  assert (w >= 0 && h >= 0);
+  return loadFile(filename, -1, IMAGE_RASTER, x, y, w, h);
+}
+
+// Saving
+//
+// Images are written with writev() of the header and the pixel rows (or
+// spans, for tiled images), to a temporary file in the same directory,
+// which is synced and renamed to filename only when complete.  So a failed
+// save (or a crash) never leaves a partial file behind, and readers never
+// see one.  Files that are not regular files, such as FIFOs, are written
+// directly (see tempCreate).
+//
+// ImageSaveAsync queues an image for a background writer thread, which
+// saves queued images one at a time, in order.  What is queued is a clone
+// of the image (see ImageClone), so the caller may go on modifying or
+// destroy its image right away.
+//
+// errno and errCause are per thread, so the outcome of each save is kept
+// in its job, and passed on to the errno/errCause of the thread that calls
+// ImageSaveWait or ImageSaveFlush.
+
+#define SAVEIOV 256   // max iovecs per writev() call
+
+// Write img to fd in PGM format.  Returns nonzero on success.
+static int writePGM(int fd, Image img) {
+  char header[64];
+  struct iovec iov[SAVEIOV];
+  int n = 1;
+  iov[0].iov_base = header;
+  iov[0].iov_len = snprintf(header, sizeof(header), "P5\n%d %d\n%u\n",
+                            img->width, img->height, img->maxval);
+  if (img->layout == IMAGE_RASTER) {
+    iov[1].iov_base = img->pixel;
+    iov[1].iov_len = (size_t)img->width * img->height;
+    return writevAll(fd, iov, 2);
+  }
+  for (int y = 0; y < img->height; y++) {
+    int len;
+    for (int x = 0; x < img->width; x += len) {
+      if (n == SAVEIOV) {
+        if (!writevAll(fd, iov, n)) return 0;
+        n = 0;
+      }
+      iov[n].iov_base = spanAt(img, x, y, &len);
+      iov[n].iov_len = len;
+      n++;
+    }
+  }
+  return writevAll(fd, iov, n);
+}
+
+// A file being saved.  If it is a regular file (or a new one), it is
+// written to a temporary file in the same directory, named tmp, which is
+// renamed to target when complete.  Otherwise (a FIFO or a device, say),
+// it is written directly, and tmp is NULL.
+struct tempFile {
+  int fd;
+  char* tmp;
+  char* target;   // the file to replace (symbolic links resolved)
+};
+
+// Open filename for saving, into (*t).
+// Symbolic links are followed, so that the file they point to is
+// replaced, and the temporary file gets the permissions of that file.
+// Returns the file descriptor t->fd, or -1 on failure (with errno set).
+// Thread-safe.
+static int tempCreate(const char* filename, struct tempFile* t) {
+  static atomic_uint serial;   // to make unique temporary file names
+  t->fd = -1;
+  t->tmp = NULL;
+  t->target = NULL;
+  struct stat st;
+  int exists = stat(filename, &st) == 0;
+  if (!exists && errno != ENOENT) return -1;
+  struct stat lst;
+  if (exists ? !S_ISREG(st.st_mode)
+             : lstat(filename, &lst) == 0 && S_ISLNK(lst.st_mode)) {
+    // Not a regular file, or a dangling symbolic link: write through it
+    t->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    return t->fd;
+  }
+  t->target = exists ? realpath(filename, NULL) : strdup(filename);
+  if (t->target == NULL) return -1;
+  size_t size = strlen(t->target) + 32;
+  t->tmp = (char*)malloc(size);
+  if (t->tmp != NULL) {
+    for (int tries = 0; t->fd < 0 && tries < 100; tries++) {
+      snprintf(t->tmp, size, "%s.%ld.%u.tmp", t->target, (long)getpid(),
+               atomic_fetch_add(&serial, 1));
+      t->fd = open(t->tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+      if (t->fd < 0 && errno != EEXIST) break;
+    }
+  }
+  if (t->fd >= 0 && exists && fchmod(t->fd, st.st_mode & 07777) != 0) {
+    int err = errno;
+    close(t->fd);
+    unlink(t->tmp);
+    t->fd = -1;
+    errno = err;
+  }
+  if (t->fd < 0) {
+    int err = errno;
+    free(t->tmp);
+    free(t->target);
+    t->tmp = t->target = NULL;
+    errno = err;
+  }
+  return t->fd;
+}
+
+// Finish saving to (*t): sync and close the temporary file, and then
+// rename it to the target if success is nonzero, or remove it otherwise.
+// (A file written directly is just closed.)
+// Returns nonzero on success.  If success was nonzero, but this fails,
+// sets errno and (*cause).  Thread-safe.
+static int tempCommit(struct tempFile* t, int success, const char** cause) {
+  if (success && t->tmp != NULL && fsync(t->fd) != 0) {
+    success = 0;
+    *cause = "Syncing file failed";
+  }
+  int err = errno;
+  if (close(t->fd) != 0 && success) {
+    success = 0;
+    *cause = "Closing file failed";
+  } else {
+    errno = err;
+  }
+  if (t->tmp != NULL) {
+    if (success && rename(t->tmp, t->target) != 0) {
+      success = 0;
+      *cause = "Renaming temporary file failed";
+    }
+    if (!success) {
+      err = errno;
+      unlink(t->tmp);
+      errno = err;
+    }
+  }
+  free(t->tmp);
+  free(t->target);
+  t->fd = -1;
+  t->tmp = t->target = NULL;
+  return success;
+}
+
+// Write img to stream f, using function write, after flushing it.
+// Returns nonzero on success.
+// On failure, returns 0, errno is set and (*cause) is set to the failure
+// cause.
+static int writeStream(Image img, FILE* f, int (*write)(int, Image),
+                       const char** cause) {
+  if (fflush(f) != 0) {
+    *cause = "Writing failed";
+    return 0;
+  }
+  pipeGrow(fileno(f), (size_t)img->width * img->height + 64);
+  *cause = "Writing pixels failed";
+  return write(fileno(f), img);
+}
+
+// Save img to filename, through a temporary file, using function write
+// (writePGM, writeCompressed or writeTiledImage).
+// For "-", img is written to the standard output instead.
+// Returns nonzero on success.
+// On failure, returns 0, errno is set and (*cause) is set to the failure
+// cause.  Thread-safe.
+static int saveFile(Image img, const char* filename,
+                    int (*write)(int, Image), const char** cause) {
+  if (strcmp(filename, STDNAME) == 0) {
+    return writeStream(img, stdout, write, cause);
+  }
+  struct tempFile t;
+  if (tempCreate(filename, &t) < 0) {
+    *cause = "Open failed";
+    return 0;
+  }
+  *cause = "Writing pixels failed";
+  int success = write(t.fd, img);
+  return tempCommit(&t, success, cause);
+}
+
+/// Save image to PGM file.
+/// The file is replaced only when it has been completely written and
+/// synced to disk, and keeps its permissions.  Symbolic links are followed.
+/// Files that are not regular files, such as FIFOs, are written directly.
+/// If filename is "-", the image is written to the standard output
+/// instead (as ImageWrite(img, stdout)).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// the file (if it was a regular file) is left untouched.
+int ImageSave(Image img, const char* filename) { ///
+  assert (img != NULL);
+  assert (filename != NULL);
+  const char* cause;
+  int success = saveFile(img, filename, writePGM, &cause);
+  PIXMEM += (unsigned long)img->width * img->height;  // count pixel memory accesses
+  errCause = (char*)(success ? "" : cause);
+  return success;
+}
+
+/// Read the next image from stream f, in IMAGE_RASTER layout.
+/// The image may be in any format accepted by ImageLoad (but I8T needs a
+/// seekable f).  f may hold several images one after the other, like
+/// the frames of a video piped between programs: each call reads the
+/// next one, leaving f just after it.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// At the end of f, returns NULL with errno == 0 and errCause
+/// "End of file".
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRead(FILE* f) { ///
+  assert (f != NULL);
+  if (atEnd(f)) return NULL;
+  return readFile(f, -1, IMAGE_RASTER, 0, 0, -1, -1);
+}
+
+/// Write image to stream f in PGM format, after flushing f.
+/// Images written one after the other form a multi-image PGM stream,
+/// which ImageRead reads back one by one.
+/// The pixels are written straight from the image to the file descriptor
+/// of f.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately (part
+/// of the image may have been written).
+int ImageWrite(Image img, FILE* f) { ///
+  assert (img != NULL);
+  assert (f != NULL);
+  const char* cause;
+  int success = writeStream(img, f, writePGM, &cause);
+  PIXMEM += (unsigned long)img->width * img->height;  // count pixel memory accesses
+  errCause = (char*)(success ? "" : cause);
+  return success;
+}
+
+/// Load an image file in the compressed (I8Z) format.
+/// (ImageLoad also loads these files.)
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadCompressed(const char* filename) { ///
+  return loadFile(filename, IMAGE_I8Z, IMAGE_RASTER, 0, 0, -1, -1);
+}
+
+/// Save image to a file in the compressed (I8Z) format.
+/// This is a lossless format, usually much smaller than PGM for images with
+/// flat areas (such as scanned documents), and fast to load.
+/// The file is replaced as in ImageSave.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// the file (if it was a regular file) is left untouched.
+int ImageSaveCompressed(Image img, const char* filename) { ///
+  assert (img != NULL);
+  assert (filename != NULL);
+  const char* cause;
+  int success = saveFile(img, filename, writeCompressed, &cause);
+  PIXMEM += (unsigned long)img->width * img->height;  // count pixel memory accesses
+  errCause = (char*)(success ? "" : cause);
+  return success;
+}
+
+/// Save image to a file in the tiled (I8T) format.
+/// This format stores the image compressed (as ImageSaveCompressed) in
+/// square tiles, with an index, so that ImageLoadRegion can read any
+/// region of it by reading just the tiles that intersect the region.
+/// The file is replaced as in ImageSave.
+/// If filename is "-", the file is written to the standard output, after
+/// anything already written there.  When that (or the file) is not
+/// seekable, such as a pipe, all tiles are kept in memory until the index,
+/// which precedes them, has been written.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// the file (if it was a regular file) is left untouched.
+int ImageSaveTiled(Image img, const char* filename) { ///
+  assert (img != NULL);
+  assert (filename != NULL);
+  const char* cause;
+  int success = saveFile(img, filename, writeTiledImage, &cause);
+  PIXMEM += (unsigned long)img->width * img->height;  // count pixel memory accesses
+  errCause = (char*)(success ? "" : cause);
+  return success;
+}
+
+/// Convert an image file to the tiled (I8T) format.
+/// src may be in any format accepted by ImageLoad, but must be seekable.
+/// The image is read and converted one row of tiles at a time, so images
+/// much larger than the available memory may be converted (unless dst is
+/// not seekable: see ImageSaveTiled).
+/// The file dst is replaced as in ImageSave.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// dst (if it was a regular file) is left untouched.
+int ImageConvertToTiled(const char* src, const char* dst) { ///
+  assert (src != NULL);
+  assert (dst != NULL);
+  FILE* f = NULL;
+  struct imageFile r;
+  struct tempFile t = { -1, NULL, NULL };
+  int success =
+  check( (f = fopen(src, "rb")) != NULL , "Open failed" ) &&
+  openImageFile(&r, f) &&
+  check( tempCreate(dst, &t) >= 0 , "Open failed" );
+  if (t.fd >= 0) {
+    const char* cause;
+    success = writeTiled(t.fd, NULL, &r, &cause);
+    success = tempCommit(&t, success, &cause);
+    errCause = (char*)(success ? "" : cause);
+  }
+  if (f != NULL) {
+    errsave = errno;
+    fclose(f);
+    errno = errsave;
+  }
+  return success;
+}
+
+// A queued (asynchronous) save
+struct saveJob {
+  Image img;              // clone of the image to save
+  char* filename;
+  int (*write)(int, Image);   // writePGM, writeCompressed or writeTiledImage
+  int detached;           // no handle: outcome reported by ImageSaveFlush
+  int done;               // set by the writer thread when finished
+  int success;            // outcome, when done
+  int err;                // errno, on failure
+  const char* cause;      // errCause, on failure
+  struct saveJob* next;   // next in queue
+};
+
+// Writer thread state (all protected by saveLock)
+static pthread_mutex_t saveLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t saveCond = PTHREAD_COND_INITIALIZER;  // any change
+static struct saveJob* saveHead = NULL;   // queue of jobs to write
+static struct saveJob* saveTail = NULL;
+static int savePending = 0;         // jobs queued or being written
+static int saveStarted = 0;         // writer thread is running
+static const char* saveFailCause = NULL;  // first failure of a detached job
+static int saveFailErr = 0;
+
+static void* saveWriter(void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&saveLock);
+  for (;;) {
+    while (saveHead == NULL) pthread_cond_wait(&saveCond, &saveLock);
+    struct saveJob* job = saveHead;
+    saveHead = job->next;
+    if (saveHead == NULL) saveTail = NULL;
+    pthread_mutex_unlock(&saveLock);
+
+    int success = saveFile(job->img, job->filename, job->write, &job->cause);
+    int err = errno;
+    ImageDestroy(&job->img);
+
+    pthread_mutex_lock(&saveLock);
+    job->success = success;
+    job->err = err;
+    job->done = 1;
+    savePending--;
+    if (job->detached) {
+      if (!success && saveFailCause == NULL) {
+        saveFailCause = job->cause;
+        saveFailErr = err;
+      }
+      free(job->filename);
+      free(job);
+    }
+    pthread_cond_broadcast(&saveCond);
+  }
+  return NULL;
+}
+
+// Make sure queued saves are completed when the program exits.
+static void saveAtExit(void) {
+  ImageSaveFlush();
+}
+
+/// Save image to PGM file, asynchronously.
+/// The save is queued for a background writer thread, and this returns
+/// immediately.  The caller may modify or destroy img right away: the file
+/// gets the pixels img had at the time of this call.
+/// Otherwise, the file is written as in ImageSave, ImageSaveCompressed or
+/// ImageSaveTiled, for format IMAGE_PGM, IMAGE_I8Z or IMAGE_I8T.
+/// If jobp is not NULL, (*jobp) is set to a handle that must later be
+/// passed to ImageSaveWait, to get the outcome of the save.
+/// If jobp is NULL, the outcome is reported by ImageSaveFlush.
+/// Saves still queued when the program exits are completed.
+/// On success (the save was queued), returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageSaveAsync(Image img, const char* filename, int format,
+                   ImageSaveJob* jobp) { ///
+  assert (img != NULL);
+  assert (filename != NULL);
+  assert (format == IMAGE_PGM || format == IMAGE_I8Z || format == IMAGE_I8T);
+  struct saveJob* job = (struct saveJob*)calloc(1, sizeof(struct saveJob));
+  int success =
+  check( job != NULL, "Memory allocation error" ) &&
+  check( (job->filename = strdup(filename)) != NULL, "Memory allocation error" ) &&
+  (job->img = ImageClone(img)) != NULL;
+  if (success) {
+    job->write = format == IMAGE_I8Z ? writeCompressed :
+                 format == IMAGE_I8T ? writeTiledImage : writePGM;
+    job->detached = (jobp == NULL);
+    pthread_mutex_lock(&saveLock);
+    if (!saveStarted) {
+      pthread_t thread;
+      int rc = pthread_create(&thread, NULL, saveWriter, NULL);
+      if (rc == 0) {
+        pthread_detach(thread);
+        saveStarted = 1;
+        atexit(saveAtExit);
+      } else {
+        errno = rc;
+        success = check(0, "Starting writer thread failed");
+      }
+    }
+    if (success) {
+      if (saveTail != NULL) saveTail->next = job;
+      else saveHead = job;
+      saveTail = job;
+      savePending++;
+      pthread_cond_broadcast(&saveCond);
+    }
+    pthread_mutex_unlock(&saveLock);
+  }
+  if (!success) {
+    errsave = errno;
+    if (job != NULL) {
+      ImageDestroy(&job->img);
+      free(job->filename);
+      free(job);
+    }
+    errno = errsave;
+    return 0;
+  }
+  PIXMEM += (unsigned long)img->width * img->height;  // count pixel memory accesses
+  if (jobp != NULL) *jobp = job;
+  return 1;
+}
+
+/// Wait for the asynchronous save (*jobp) to complete.
+///   jobp : address of a handle set by ImageSaveAsync.
+/// Ensures: (*jobp)==NULL.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// the file (if it was a regular file) is left untouched.
+int ImageSaveWait(ImageSaveJob* jobp) { ///
+  assert (jobp != NULL && *jobp != NULL);
+  struct saveJob* job = *jobp;
+  pthread_mutex_lock(&saveLock);
+  while (!job->done) pthread_cond_wait(&saveCond, &saveLock);
+  pthread_mutex_unlock(&saveLock);
+  int success = job->success;
+  errCause = (char*)(success ? "" : job->cause);
+  if (!success) errno = job->err;
+  free(job->filename);
+  free(job);
+  *jobp = NULL;
+  return success;
+}
+
+/// Wait for all asynchronous saves queued so far to complete.
+/// (The outcome of saves with a handle must still be collected with
+/// ImageSaveWait.)
+/// Returns nonzero if all saves without a handle succeeded since the
+/// previous ImageSaveFlush.
+/// Otherwise, returns 0, and errno/errCause are set as for the first that
+/// failed.
+int ImageSaveFlush(void) { ///
+  pthread_mutex_lock(&saveLock);
+  while (savePending > 0) pthread_cond_wait(&saveCond, &saveLock);
+  const char* cause = saveFailCause;
+  int err = saveFailErr;
+  saveFailCause = NULL;
+  pthread_mutex_unlock(&saveLock);
+  if (cause != NULL) {
+    errCause = (char*)cause;
+    errno = err;
+  }
+  return cause == NULL;
+}
+
+
+/// Information queries
+
+/// These functions do not modify the image and never fail.
+
+/// Get image width
+int ImageWidth(Image img) { ///
+  assert (img != NULL);
+  return img->width;
+}
+
+/// Get image height
+int ImageHeight(Image img) { ///
+  assert (img != NULL);
+  return img->height;
+}
+
+/// Get image maximum gray level
+int ImageMaxval(Image img) { ///
+  assert (img != NULL);
+  return img->maxval;
+}
+
+// Histogram of a w x h rectangle at (x, y), computed in parallel.
+struct histArg {
+  Image img;
+  int x, y, w;
+  pthread_mutex_t lock;
+  size_t hist[256];
+};
+
+static void histRows(void* arg, int y0, int y1) {
+  struct histArg* a = (struct histArg*)arg;
+  size_t hist[256] = { 0 };
+  for (int y = a->y + y0; y < a->y + y1; y++) {
+    int len;
+    for (int x = a->x; x < a->x + a->w; x += len) {
+      const uint8* p = spanAt(a->img, x, y, &len);
+      if (len > a->x + a->w - x) len = a->x + a->w - x;
+      for (int i = 0; i < len; i++) hist[p[i]]++;
+    }
+  }
+  pthread_mutex_lock(&a->lock);
+  for (int v = 0; v < 256; v++) a->hist[v] += hist[v];
+  pthread_mutex_unlock(&a->lock);
+}
+
+// Compute the histogram of the w x h rectangle at (x, y) of img in hist.
+static void rectHistogram(Image img, int x, int y, int w, int h, size_t hist[256]) {
+  struct histArg a = { img, x, y, w, PTHREAD_MUTEX_INITIALIZER, { 0 } };
+  parallelFor(h, (size_t)w * h, histRows, &a);
+  PIXMEM += (unsigned long)w * h;  // count pixel reads
+  memcpy(hist, a.hist, sizeof(a.hist));
+}
+
+// Get the statistics of img: the cached ones, or else computed (and
+// cached, if there is memory for them).  Result stored in (*st).
+static void getStats(Image img, struct stats* st) {
+  if (img->stats != NULL && img->stats->valid) {
+    *st = *img->stats;
+    return;
+  }
+  rectHistogram(img, 0, 0, img->width, img->height, st->hist);
+  st->valid = 1;
+  if (img->stats == NULL) img->stats = (struct stats*)malloc(sizeof(struct stats));
+  if (img->stats != NULL) *img->stats = *st;
+}
+
+/// Pixel stats
+/// Find the minimum and maximum gray levels in image.
+/// On return,
+/// *min is set to the minimum gray level in the image,
+/// *max is set to the maximum.
+/// (Statistics are cached in the image, and kept up to date by the
+/// operations that can do so cheaply, so repeated calls are fast.)
+void ImageStats(Image img, uint8* min, uint8* max) { ///
+  assert (img != NULL);
+  assert (min != NULL);
+  assert (max != NULL);
+  struct stats st;
+  getStats(img, &st);
+  int v0 = 0;
+  while (v0 < 255 && st.hist[v0] == 0) v0++;
+  int v1 = 255;
+  while (v1 > 0 && st.hist[v1] == 0) v1--;
+  if (v0 > v1) {   // (empty image)
+    v0 = PixMax;
+    v1 = 0;
+  }
+  *min = (uint8)v0;
+  *max = (uint8)v1;
+}
+
+/// Get the histogram of img: hist[v] is set to the number of pixels with
+/// level v, for v = 0..255.
+void ImageHistogram(Image img, size_t hist[256]) { ///
+  assert (img != NULL);
+  assert (hist != NULL);
+  struct stats st;
+  getStats(img, &st);
+  memcpy(hist, st.hist, sizeof(st.hist));
+}
+
+/// Get the sum of the levels of all pixels of img.
+uint64_t ImageSum(Image img) { ///
+  assert (img != NULL);
+  struct stats st;
+  getStats(img, &st);
+  uint64_t sum = 0;
+  for (int v = 0; v < 256; v++) sum += (uint64_t)v * st.hist[v];
+  return sum;
+}
+
+/// Check if pixel position (x,y) is inside img.
+int ImageValidPos(Image img, int x, int y) { ///
+  assert (img != NULL);
+  return (0 <= x && x < img->width) && (0 <= y && y < img->height);
+}
+
+/// Check if rectangular area (x,y,w,h) is completely inside img.
+int ImageValidRect(Image img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  // Verifica se as coordenadas superior esquerda e inferior direita do retângulo estão dentro dos limites da imagem
+    return ImageValidPos(img, x, y) && ImageValidPos(img, x + w - 1, y + h - 1);
+}
+
+/// Pixel get & set operations
+
+/// These are the primitive operations to access and modify a single pixel
+/// in the image.
+/// These are very simple, but fundamental operations, which may be used to 
+/// implement more complex operations.
+
+// Transform (x, y) coords into linear pixel index.
+// This internal function is used in ImageGetPixel / ImageSetPixel. 
+// The returned index must be inside the pixel array
+// (0 <= index < img->stride*img->height, for raster layouts).
+static inline size_t G(Image img, int x, int y) {
+  size_t index;
+  assert (img != NULL);
+  assert (ImageValidPos(img, x, y));
+  if (img->layout == IMAGE_TILED) {
+    index = tiledIndex(img, x, y);
+  } else {
+    index = (size_t)y*img->stride + x;
+  }
+
+  assert (index < pixelArraySize(img->width, img->height, img->layout));
+  return index;
+}
+
+/// Get the pixel (level) at position (x,y).
+uint8 ImageGetPixel(Image img, int x, int y) { ///
+  assert (img != NULL);
+  assert (ImageValidPos(img, x, y));
+  PIXMEM += 1;  // count one pixel access (read)
+  return img->pixel[G(img, x, y)];
+} 
+
+/// Set the pixel at position (x,y) to new level.
+/// On success, returns nonzero.
+/// Fails (returns 0, errno/errCause are set appropriately, and img is not
+/// modified) only if img shares its pixels with a clone and there is no
+/// memory to copy them.
+int ImageSetPixel(Image img, int x, int y, uint8 level) { ///
+  assert (img != NULL);
+  assert (ImageValidPos(img, x, y));
+  if (!makeWritableRect(img, x, y, 1, 1)) return 0;
+  PIXMEM += 1;  // count one pixel access (store)
+  img->pixel[G(img, x, y)] = level;
+  return 1;
+} 
+
+
+/// Pixel transformations
+
+/// These functions modify the pixel levels in an image, but do not change
+/// pixel positions or image geometry in any way.
+/// All of these functions modify the image in-place: no allocation involved,
+/// unless img shares its pixels with a clone (see ImageClone).
+/// On success, they return nonzero.
+/// They only fail if img shares its pixels and there is no memory to copy
+/// them: then they return 0, errno/errCause are set appropriately, and
+/// img is not modified.
+
+
+// The transformations below map each level v to lut[v], in parallel.
+struct mapArg {
+  Image img;
+  uint8 lut[256];
+};
+
+static void mapRows(void* arg, int y0, int y1) {
+  struct mapArg* a = (struct mapArg*)arg;
+  Image img = a->img;
+  for (int y = y0; y < y1; y++) {
+    int len;
+    for (int x = 0; x < img->width; x += len) {
+      uint8* p = spanAt(img, x, y, &len);
+      for (int i = 0; i < len; i++) p[i] = a->lut[p[i]];
+    }
+  }
+}
+
+// Map all pixels of img through a->lut.
+// Cached statistics are mapped too: level v becomes level lut[v].
+static int mapPixels(struct mapArg* a) {
+  Image img = a->img;
+  struct stats* st = img->stats;
+  int known = st != NULL && st->valid;
+  if (!makeWritable(img)) return 0;
+  parallelFor(img->height, (size_t)img->width * img->height, mapRows, a);
+  PIXMEM += 2 * (unsigned long)img->width * img->height;  // reads and stores
+  if (known) {
+    size_t hist[256] = { 0 };
+    for (int v = 0; v < 256; v++) hist[a->lut[v]] += st->hist[v];
+    memcpy(st->hist, hist, sizeof(hist));
+    st->valid = 1;
+  }
+  return 1;
+}
+
+
+/// Transform image to negative image.
+/// This transforms dark pixels to light pixels and vice-versa,
+/// resulting in a "photographic negative" effect.
+int ImageNegative(Image img) { ///
+  assert (img != NULL);
+  struct mapArg a;
+  a.img = img;
+  for (int v = 0; v < 256; v++) a.lut[v] = (uint8)(img->maxval - v);
+  return mapPixels(&a);
+}
+
+/// Apply threshold to image.
+/// Transform all pixels with level<thr to black (0) and
+/// all pixels with level>=thr to white (maxval).
+int ImageThreshold(Image img, uint8 thr) { ///
+  assert (img != NULL);
+  struct mapArg a;
+  a.img = img;
+  for (int v = 0; v < 256; v++) a.lut[v] = v >= thr ? img->maxval : 0;
+  return mapPixels(&a);
+}
+
+/// Brighten image by a factor.
+/// Multiply each pixel level by a factor, but saturate at maxval.
+/// This will brighten the image if factor>1.0 and
+/// darken the image if factor<1.0.
+int ImageBrighten(Image img, double factor) { ///
+  assert (img != NULL);
+  assert (factor >= 0.0);
+  struct mapArg a;
+  a.img = img;
+  for (int v = 0; v < 256; v++) {
+    uint8 level = roundPixel(v * factor);
+    a.lut[v] = level > img->maxval ? img->maxval : level;
+  }
+  return mapPixels(&a);
+}
+
+/// Geometric transformations
+
+/// These functions apply geometric transformations to an image,
+/// returning a new image as a result.
+/// 
+/// Success and failure are treated as in ImageCreate:
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+
+// Implementation hint: 
+// Call ImageCreate whenever you need a new image!
+
+// Arguments of the row kernels below, which copy (or blend) a w-wide
+// rectangle at (sx, sy) of src into (dx, dy) of dst.
+struct rectArg {
+  Image dst, src;
+  int dx, dy, sx, sy, w;
+  double alpha;   // (for blendRows)
+};
+
+// Copy rows y0..y1-1 of the rectangle.
+static void copyRows(void* arg, int y0, int y1) {
+  struct rectArg* a = (struct rectArg*)arg;
+  for (int y = y0; y < y1; y++) {
+    int x = 0;
+    while (x < a->w) {
+      int slen, dlen;
+      const uint8* s = spanAt(a->src, a->sx + x, a->sy + y, &slen);
+      uint8* d = spanAt(a->dst, a->dx + x, a->dy + y, &dlen);
+      int len = slen < dlen ? slen : dlen;
+      if (len > a->w - x) len = a->w - x;
+      memcpy(d, s, len);
+      x += len;
+    }
+  }
+}
+
+// Blend rows y0..y1-1 of the rectangle (src over dst, with a->alpha).
+static void blendRows(void* arg, int y0, int y1) {
+  struct rectArg* a = (struct rectArg*)arg;
+  double alpha = a->alpha;
+  uint8 maxval = a->dst->maxval;
+  for (int y = y0; y < y1; y++) {
+    int x = 0;
+    while (x < a->w) {
+      int slen, dlen;
+      const uint8* s = spanAt(a->src, a->sx + x, a->sy + y, &slen);
+      uint8* d = spanAt(a->dst, a->dx + x, a->dy + y, &dlen);
+      int len = slen < dlen ? slen : dlen;
+      if (len > a->w - x) len = a->w - x;
+      for (int i = 0; i < len; i++) {
+        uint8 level = roundPixel(alpha * s[i] + (1.0 - alpha) * d[i]);
+        d[i] = level > maxval ? maxval : level;
+      }
+      x += len;
+    }
+  }
+}
+
+// Mirror rows y0..y1-1 of a->src into a->dst.
+static void mirrorRows(void* arg, int y0, int y1) {
+  struct rectArg* a = (struct rectArg*)arg;
+  Image src = a->src;
+  int w = src->width;
+  for (int y = y0; y < y1; y++) {
+    int len;
+    for (int x = 0; x < w; x += len) {
+      uint8* d = spanAt(a->dst, x, y, &len);
+      if (src->layout == IMAGE_TILED) {
+        for (int i = 0; i < len; i++) d[i] = src->pixel[tiledIndex(src, w - 1 - x - i, y)];
+      } else {
+        const uint8* s = src->pixel + (size_t)y * src->stride + (w - 1 - x);
+        for (int i = 0; i < len; i++) d[i] = s[-i];
+      }
+    }
+  }
+}
 
 /// Rotate an image.
 /// Returns a rotated version of the image.
 /// The rotation is 90 degrees clockwise.
 /// Ensures: The original img is not modified.
-/// 
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate(Image img) { ///
+  assert (img != NULL);
+  int width = img->width;
+  int height = img->height;
+  uint8 maxval = img->maxval;
+
+  // Criar uma nova imagem com dimensões trocadas para a rotação
+  Image rotatedImage = ImageCreateLayout(height, width, maxval, img->layout);
+  if (rotatedImage == NULL) {
+    errCause = "Memory allocation error for rotated image";
+	return NULL;
+  }
+  // Made writable once, so pixels are stored directly
+  if (!makeWritable(rotatedImage)) {
+    errsave = errno;
+    ImageDestroy(&rotatedImage);
+    errno = errsave;
+    return NULL;
+  }
+  for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            // Obter o valor do pixel da imagem original
+            uint8 currentPixel = ImageGetPixel(img, j, i);
+            // Preencher a nova imagem com os valores rotacionados
+            PIXMEM += 1;  // count one pixel access (store)
+            rotatedImage->pixel[G(rotatedImage, i, width - j - 1)] = currentPixel;
+        }
+    }
+
+    return rotatedImage;
+
+}
+
+/// Mirror an image = flip left-right.
+/// Returns a mirrored version of the image.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageMirror(Image img) { ///
+  assert (img != NULL);
+  Image mirroredImage = ImageCreateLayout(img->width, img->height, img->maxval, img->layout);
+  if (mirroredImage == NULL) {
+    errCause = "Memory allocation error for mirrored image";
+    return NULL;
+  }
+  struct rectArg a = { mirroredImage, img, 0, 0, 0, 0, img->width, 0.0 };
+  parallelFor(img->height, (size_t)img->width * img->height, mirrorRows, &a);
+  PIXMEM += 2 * (unsigned long)img->width * img->height;
+  return mirroredImage;
+}
+
+/// Crop a rectangular subimage from img.
+/// The rectangle is specified by the top left corner coords (x, y) and
+/// width w and height h.
+/// Requires:
+///   The rectangle must be inside the original image.
+/// Ensures:
+///   The original img is not modified.
+///   The returned image has width w and height h.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCrop(Image img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  assert (ImageValidRect(img, x, y, w, h));
+  Image croppedImage = ImageCreateLayout(w, h, img->maxval, img->layout);
+  if (croppedImage == NULL) {
+    errCause = "Memory allocation error for cropped image";
+    return NULL;
+  }
+  struct rectArg a = { croppedImage, img, 0, 0, x, y, w, 0.0 };
+  parallelFor(h, (size_t)w * h, copyRows, &a);
+  PIXMEM += 2 * (unsigned long)w * h;
+  return croppedImage;
+}
+
+
+/// Operations on two images
+
+/// Paste an image into a larger image.
+/// Paste img2 into position (x, y) of img1.
+/// This modifies img1 in-place: no allocation involved (unless img1 shares
+/// its pixels, see ImageClone).
+/// Requires: img2 must fit inside img1 at position (x, y).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img1 is not modified.
+int ImagePaste(Image img1, int x, int y, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+  // Cached statistics of img1 are updated: the pixels of the pasted area
+  // are replaced by those of img2.
+  struct stats* st = img1->stats;
+  int known = st != NULL && st->valid;
+  size_t covered[256];
+  struct stats st2;
+  if (known) {
+    rectHistogram(img1, x, y, img2->width, img2->height, covered);
+    getStats(img2, &st2);
+  }
+  if (!makeWritableRect(img1, x, y, img2->width, img2->height)) return 0;
+  // The maxval of the result is the largest of both
+  if (img2->maxval > img1->maxval) img1->maxval = img2->maxval;
+  struct rectArg a = { img1, img2, x, y, 0, 0, img2->width, 0.0 };
+  parallelFor(img2->height, (size_t)img2->width * img2->height, copyRows, &a);
+  PIXMEM += 2 * (unsigned long)img2->width * img2->height;
+  if (known) {
+    for (int v = 0; v < 256; v++) st->hist[v] += st2.hist[v] - covered[v];
+    st->valid = 1;
+  }
+  return 1;
+}
+
+/// Blend an image into a larger image.
+/// Blend img2 into position (x, y) of img1.
+/// This modifies img1 in-place: no allocation involved (unless img1 shares
+/// its pixels, see ImageClone).
+/// Requires: img2 must fit inside img1 at position (x, y).
+/// alpha usually is in [0.0, 1.0], but values outside that interval
+/// may provide interesting effects.  Over/underflows should saturate.
+/// Success and failure as in ImagePaste.
+int ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+  if (!makeWritableRect(img1, x, y, img2->width, img2->height)) return 0;
+  // The maxval of the result is the largest of both
+  if (img2->maxval > img1->maxval) img1->maxval = img2->maxval;
+  struct rectArg a = { img1, img2, x, y, 0, 0, img2->width, alpha };
+  parallelFor(img2->height, (size_t)img2->width * img2->height, blendRows, &a);
+  PIXMEM += 3 * (unsigned long)img2->width * img2->height;
+  return 1;
+}
+
+// Does img2 match img1 at (x, y)?  (Both in any layout; img2 must fit.)
+// Rows are compared span by span, with memcmp (which is vectorized).
+static int rowsMatch(Image img1, int x, int y, Image img2) {
+  for (int i = 0; i < img2->height; i++) {
+    int j = 0;
+    while (j < img2->width) {
+      int len1, len2;
+      const uint8* p1 = spanAt(img1, x + j, y + i, &len1);
+      const uint8* p2 = spanAt(img2, j, i, &len2);
+      int len = len1 < len2 ? len1 : len2;
+      IMAGELOCATESUBIMAGE += len;
+      if (memcmp(p1, p2, len) != 0) return 0;
+      j += len;
+    }
+  }
+  return 1;
+}
+
+/// Compare an image to a subimage of a larger image.
+/// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
+/// Returns 0, otherwise.
+int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (ImageValidPos(img1, x, y));
+  if (!ImageValidRect(img1, x, y, img2->width, img2->height)) return 0;
+  return rowsMatch(img1, x, y, img2);
+}
+
+// ImageLocateSubImage rejects most positions by first checking a few
+// anchor pixels of img2: those with the levels that are rarest in img1
+// (by its histogram, which is cached).  The first two anchors are checked
+// for a vector of positions at a time (by the findPair kernels).
+#define ANCHORS 4
+
+struct anchor {
+  int x, y;
+  uint8 level;
+};
+
+// Choose up to ANCHORS anchors of img2 (raster or aligned), with distinct levels,
+// for a search in img1.  Returns their number, or 0 if some level of
+// img2 does not occur in img1 (so it cannot match anywhere).
+static int chooseAnchors(Image img1, Image img2, struct anchor a[ANCHORS]) {
+  struct stats st1, st2;
+  getStats(img1, &st1);
+  getStats(img2, &st2);
+  int n = 0;
+  for (int v = 0; v < 256; v++) {
+    if (st2.hist[v] == 0) continue;
+    if (st1.hist[v] == 0) return 0;
+    // Insert level v by increasing count in img1
+    int k = n < ANCHORS ? n++ : ANCHORS;
+    while (k > 0 && st1.hist[a[k-1].level] > st1.hist[v]) {
+      if (k < ANCHORS) a[k] = a[k-1];
+      k--;
+    }
+    if (k < ANCHORS) a[k].level = (uint8)v;
+  }
+  // Position of (the first pixel with) each level
+  for (int k = 0; k < n; k++) {
+    const uint8* p = NULL;
+    int y = 0;
+    for (; p == NULL; y++) {
+      p = memchr(img2->pixel + y * img2->stride, a[k].level, img2->width);
+    }
+    a[k].x = (int)(p - (img2->pixel + (y - 1) * img2->stride));
+    a[k].y = y - 1;
+  }
+  return n;
+}
+
+// First i in [i, n) where a[i] == va and b[i] == vb, or n if none.
+static int findPairScalar(const uint8* a, uint8 va, const uint8* b, uint8 vb,
+                          int i, int n) {
+  while (i < n && !(a[i] == va && b[i] == vb)) i++;
+  return i;
+}
+
+#if defined(__SSE2__)
+static int findPairSSE2(const uint8* a, uint8 va, const uint8* b, uint8 vb,
+                        int i, int n) {
+  __m128i v0 = _mm_set1_epi8((char)va);
+  __m128i v1 = _mm_set1_epi8((char)vb);
+  for (; i + 16 <= n; i += 16) {
+    __m128i m = _mm_and_si128(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), v0),
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(b + i)), v1));
+    unsigned mask = (unsigned)_mm_movemask_epi8(m);
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+  return findPairScalar(a, va, b, vb, i, n);
+}
+#endif
+
+#if defined(KERNELS_X86)
+TARGET("avx2")
+static int findPairAVX2(const uint8* a, uint8 va, const uint8* b, uint8 vb,
+                        int i, int n) {
+  __m256i v0 = _mm256_set1_epi8((char)va);
+  __m256i v1 = _mm256_set1_epi8((char)vb);
+  for (; i + 32 <= n; i += 32) {
+    __m256i m = _mm256_and_si256(
+        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i)), v0),
+        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(b + i)), v1));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+  return findPairScalar(a, va, b, vb, i, n);
+}
+#endif
+
+// Does img2 match img1 (raster or aligned) at (x, y), checking anchors
+// a[1..n-1] first?
+static inline int anchoredMatch(Image img1, int x, int y, Image img2,
+                                const struct anchor* a, int n) {
+  for (int k = 1; k < n; k++) {
+    if (img1->pixel[(y + a[k].y) * img1->stride + x + a[k].x] != a[k].level) return 0;
+  }
+  return rowsMatch(img1, x, y, img2);
+}
+
+/// Locate a subimage inside another image.
+/// Searches for img2 inside img1.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (px != NULL && py != NULL);
+  int w1 = img1->width;
+  int h1 = img1->height;
+  int w2 = img2->width;
+  int h2 = img2->height;
+  if (w2 > w1 || h2 > h1) return 0;
+
+  // Search raster copies of tiled images
+  Image copy1, copy2;
+  Image r1 = rasterOf(img1, &copy1);
+  Image r2 = rasterOf(img2, &copy2);
+  if (r1 == NULL || r2 == NULL) {
+    // No memory for copies: check positions one by one
+    ImageDestroy(&copy1);
+    ImageDestroy(&copy2);
+    for (int y = 0; y <= h1 - h2; y++) {
+      for (int x = 0; x <= w1 - w2; x++) {
+        if (ImageMatchSubImage(img1, x, y, img2)) {
+          *px = x;
+          *py = y;
+          return 1;
+        }
+      }
+    }
+    return 0;
+  }
+
+  struct anchor a[ANCHORS];
+  int na = w2 > 0 && h2 > 0 ? chooseAnchors(img1, r2, a) : -1;
+  int found = 0;
+  int nx = w1 - w2 + 1;
+  if (na < 0) {   // (empty img2 matches at the origin)
+    found = 1;
+    *px = *py = 0;
+  }
+  const struct anchor* b = &a[na > 1];   // (second anchor, or the first)
+  for (int y = 0; na > 0 && !found && y <= h1 - h2; y++) {
+    const uint8* p0 = r1->pixel + (y + a[0].y) * r1->stride + a[0].x;
+    const uint8* p1 = r1->pixel + (y + b->y) * r1->stride + b->x;
+    int x = 0;
+    while (!found &&
+           (x = K()->findPair(p0, a[0].level, p1, b->level, x, nx)) < nx) {
+      if (anchoredMatch(r1, x, y, r2, a, na)) {
+        found = 1;
+        *px = x;
+        *py = y;
+      }
+      x++;
+    }
+    IMAGELOCATESUBIMAGE += nx;   // count positions checked
+  }
+  ImageDestroy(&copy1);
+  ImageDestroy(&copy2);
+  return found;
+}
+
+
+// Multi-subimage search (ImageLocateMany)
+//
+// Subimages are grouped in buckets of similar sizes.  For each bucket,
+// the kw x kh key window (the largest rectangle that fits in all its
+// subimages) of each subimage is hashed into a table, and the key windows
+// at all positions of img are hashed in one pass, with a 2D rolling hash:
+// a polynomial hash of each row window (rolling along x), combined along
+// y (rolling down).  Positions whose hash is in the table are then
+// verified by comparing the whole subimage.
+
+// Multipliers of the rolling hash, along x and y (odd, mod 2^64)
+#define HASHX 0x9E3779B97F4A7C15ull
+#define HASHY 0xC2B2AE3D27D4EB4Full
+
+// Integer power b^e (mod 2^64).
+static uint64_t hashPow(uint64_t b, int e) {
+  uint64_t r = 1;
+  for (; e > 0; e >>= 1, b *= b) {
+    if (e & 1) r *= b;
+  }
+  return r;
+}
+
+// Hash of the w x h rectangle at (0, 0) of img (raster or aligned).
+static uint64_t keyHash(Image img, int w, int h) {
+  uint64_t v = 0;
+  for (int y = 0; y < h; y++) {
+    const uint8* p = img->pixel + y * img->stride;
+    uint64_t r = 0;
+    for (int x = 0; x < w; x++) r = r * HASHX + p[x];
+    v = v * HASHY + r;
+  }
+  return v;
+}
+
+// Hashes of all w-wide windows of row y of img (raster or aligned), in
+// out[x], for x = 0 .. width-w.  powx must be HASHX^w.
+static void rowHashes(Image img, int y, int w, uint64_t powx, uint64_t* out) {
+  const uint8* p = img->pixel + y * img->stride;
+  uint64_t r = 0;
+  for (int x = 0; x < w; x++) r = r * HASHX + p[x];
+  out[0] = r;
+  for (int x = 1; x + w <= img->width; x++) {
+    r = r * HASHX - p[x-1] * powx + p[x+w-1];
+    out[x] = r;
+  }
+}
+
+// Search state of ImageLocateMany
+struct locateMany {
+  Image img;        // (raster or aligned)
+  Image* sub;       // subimages (likewise)
+  int* order;       // subimage indices, by increasing area
+  ImageMatch* found;
+  int nfound;
+  int capfound;
+};
+
+// Hash table slot: key hash, and first subimage with it (or -1)
+struct keySlot {
+  uint64_t key;
+  int first;
+};
+
+// Search for subimages order[b0..b1-1], with a kw x kh key window.
+// Returns 0 on failure.
+static int locateBucket(struct locateMany* s, int b0, int b1, int kw, int kh) {
+  Image img = s->img;
+  int n = b1 - b0;
+  int bits = 1;
+  while ((1 << bits) < 2 * n) bits++;
+  int nslots = 1 << bits;
+  int npos = img->width - kw + 1;
+  struct keySlot* table = (struct keySlot*)malloc(nslots * sizeof(struct keySlot));
+  int* next = (int*)malloc(n * sizeof(int));
+  uint64_t* col = (uint64_t*)malloc(3 * (size_t)npos * sizeof(uint64_t));
+  int success = check(table != NULL && next != NULL && col != NULL,
+                      "Memory allocation error for search tables");
+  if (success) {
+    // Index the key windows of the subimages
+    for (int k = 0; k < nslots; k++) table[k].first = -1;
+    for (int k = 0; k < n; k++) {
+      uint64_t key = keyHash(s->sub[s->order[b0 + k]], kw, kh);
+      int slot = (int)(key >> (64 - bits));
+      while (table[slot].first >= 0 && table[slot].key != key) slot = (slot + 1) & (nslots - 1);
+      table[slot].key = key;
+      next[k] = table[slot].first;
+      table[slot].first = k;
+    }
+
+    // Roll the key window over img
+    uint64_t* rowOut = col + npos;
+    uint64_t* rowIn = rowOut + npos;
+    uint64_t powx = hashPow(HASHX, kw);
+    uint64_t powy = hashPow(HASHY, kh);
+    memset(col, 0, npos * sizeof(uint64_t));
+    for (int i = 0; i < kh; i++) {
+      rowHashes(img, i, kw, powx, rowIn);
+      for (int x = 0; x < npos; x++) col[x] = col[x] * HASHY + rowIn[x];
+    }
+    PIXMEM += (unsigned long)img->width * kh;
+    for (int y = 0; success && y + kh <= img->height; y++) {
+      for (int x = 0; x < npos; x++) {
+        uint64_t key = col[x];
+        int slot = (int)(key >> (64 - bits));
+        while (table[slot].first >= 0 && table[slot].key != key) slot = (slot + 1) & (nslots - 1);
+        for (int k = table[slot].first; k >= 0; k = next[k]) {
+          int index = s->order[b0 + k];
+          Image sub = s->sub[index];
+          if (x + sub->width > img->width || y + sub->height > img->height ||
+              !rowsMatch(img, x, y, sub)) continue;
+          if (s->nfound == s->capfound) {
+            int cap = s->capfound == 0 ? 16 : 2 * s->capfound;
+            ImageMatch* found = (ImageMatch*)realloc(s->found, cap * sizeof(ImageMatch));
+            if (!check(found != NULL, "Memory allocation error for matches")) {
+              success = 0;
+              break;
+            }
+            s->found = found;
+            s->capfound = cap;
+          }
+          s->found[s->nfound++] = (ImageMatch){ index, x, y };
+        }
+      }
+      if (y + kh < img->height) {
+        rowHashes(img, y, kw, powx, rowOut);
+        rowHashes(img, y + kh, kw, powx, rowIn);
+        for (int x = 0; x < npos; x++) col[x] = col[x] * HASHY - rowOut[x] * powy + rowIn[x];
+        PIXMEM += 2 * (unsigned long)img->width;
+      }
+    }
+  }
+
+  // Cleanup
+  errsave = errno;
+  free(table);
+  free(next);
+  free(col);
+  errno = errsave;
+  return success;
+}
+
+// Order of subimages in ImageLocateMany (by area)
+static _Thread_local Image* areaSubs;
+
+static int byArea(const void* a, const void* b) {
+  Image ia = areaSubs[*(const int*)a];
+  Image ib = areaSubs[*(const int*)b];
+  long d = (long)ia->width * ia->height - (long)ib->width * ib->height;
+  return (d > 0) - (d < 0);
+}
+
+// Order of matches in ImageLocateMany
+static int byPosition(const void* a, const void* b) {
+  const ImageMatch* ma = (const ImageMatch*)a;
+  const ImageMatch* mb = (const ImageMatch*)b;
+  if (ma->y != mb->y) return ma->y < mb->y ? -1 : 1;
+  if (ma->x != mb->x) return ma->x < mb->x ? -1 : 1;
+  return (ma->index > mb->index) - (ma->index < mb->index);
+}
+
+/// Locate many subimages at once.
+/// Searches for all occurrences of each of the n subimages sub[0..n-1]
+/// inside img, in a single pass for subimages of similar sizes.
+/// Returns the number of occurrences found, and sets (*matches) to a new
+/// array with them, sorted by position (y, then x), then index.
+/// (The caller is responsible for freeing the array!)
+/// Requires: the subimages are not empty (unlike ImageLocateSubImage,
+/// where an empty subimage matches at the origin).
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLocateMany(Image img, Image sub[], int n, ImageMatch** matches) { ///
+  assert (img != NULL);
+  assert (n >= 0);
+  assert (n == 0 || sub != NULL);
+  assert (matches != NULL);
+  struct locateMany s = { NULL, NULL, NULL, NULL, 0, 0 };
+  Image imgCopy = NULL;
+  Image* copies = (Image*)calloc(n + 1, sizeof(Image));
+  s.sub = (Image*)malloc((n + 1) * sizeof(Image));
+  s.order = (int*)malloc((n + 1) * sizeof(int));
+  int success = check(copies != NULL && s.sub != NULL && s.order != NULL,
+                      "Memory allocation error for search tables") &&
+                (s.img = rasterOf(img, &imgCopy)) != NULL;
+  // Subimages that fit in img, not tiled, by increasing area
+  int m = 0;
+  for (int k = 0; success && k < n; k++) {
+    assert (sub[k] != NULL);
+    assert (sub[k]->width > 0 && sub[k]->height > 0);
+    s.sub[k] = sub[k];
+    if (sub[k]->width > img->width || sub[k]->height > img->height) continue;
+    success = (s.sub[k] = rasterOf(sub[k], &copies[k])) != NULL;
+    s.order[m++] = k;
+  }
+  if (success) {
+    areaSubs = s.sub;
+    qsort(s.order, m, sizeof(int), byArea);
+  }
+
+  // Buckets: subimages whose common key window covers at least 1/4 of
+  // each of them
+  int b0 = 0;
+  while (success && b0 < m) {
+    Image first = s.sub[s.order[b0]];
+    int kw = first->width;
+    int kh = first->height;
+    int b1 = b0 + 1;
+    while (b1 < m) {
+      Image next = s.sub[s.order[b1]];
+      int w = next->width < kw ? next->width : kw;
+      int h = next->height < kh ? next->height : kh;
+      if (4L * w * h < (long)next->width * next->height) break;
+      kw = w;
+      kh = h;
+      b1++;
+    }
+    success = locateBucket(&s, b0, b1, kw, kh);
+    b0 = b1;
+  }
+  if (success) qsort(s.found, s.nfound, sizeof(ImageMatch), byPosition);
+
+  // Cleanup
+  errsave = errno;
+  for (int k = 0; copies != NULL && k < n; k++) ImageDestroy(&copies[k]);
+  ImageDestroy(&imgCopy);
+  free(copies);
+  free(s.sub);
+  free(s.order);
+  if (!success) {
+    free(s.found);
+    s.found = NULL;
+  }
+  errno = errsave;
+  *matches = s.found;
+  return success ? s.nfound : -1;
+}
+
+
+
+/// Filtering
+
+// Running-sum box filter, used by ImageBlur and ImageGaussianBlur.
+//
+// Each output pixel is the mean of the (2rx+1)x(2ry+1) window around it,
+// clipped to the image, rounded to the nearest level.
+// The window sums of each row are computed with a running sum, and a row
+// of column sums is kept, to which whole rows of window sums are added and
+// subtracted as the window slides down.  So all columns advance together,
+// every memory access is sequential, and the cost per pixel does not
+// depend on the radii.
+//
+// Division by the window area d is replaced by a multiplication by
+// ceil(2^BOXSHIFT / d), which gives the exact quotient for every sum of
+// d levels when d < BOXEXACT.  Larger windows are divided directly.
+#define BOXSHIFT 40
+#define BOXEXACT (1 << 16)
+
+static inline uint64_t boxRecip(uint64_t area) {
+  return area < BOXEXACT ? ((1ull << BOXSHIFT) + area - 1) / area : 0;
+}
+
+// Mean of sum over area, rounded, with recip = boxRecip(area).
+static inline uint8 boxMean(uint64_t sum, uint64_t area, uint64_t recip) {
+  uint64_t n = sum + area / 2;
+  return (uint8)(recip != 0 ? (n * recip) >> BOXSHIFT : n / area);
+}
+
+// Number of pixels in [x-r, x+r] clipped to [0, w).
+static inline int boxCount(int x, int r, int w) {
+  int lo = x - r > 0 ? x - r : 0;
+  int hi = x + r < w ? x + r : w - 1;
+  return hi - lo + 1;
+}
+
+// Window sums of row s (width w) for radius r, into sum.
+static void boxRowSums(const uint8* s, int w, int r, uint64_t* sum) {
+  uint64_t acc = 0;
+  // Window for x = 0 is [0, r]
+  for (int x = 0; x <= r && x < w; x++) acc += s[x];
+  for (int x = 0; x < w; x++) {
+    sum[x] = acc;
+    // Slide window from [x-r, x+r] to [x+1-r, x+1+r]
+    if (x + r + 1 < w) acc += s[x + r + 1];
+    if (x - r >= 0) acc -= s[x - r];
+  }
+  IMAGEBLUR += 2 * (unsigned long)w;
+  PIXMEM += 2 * (unsigned long)w;
+}
+
+// Number of rows of window sums kept by boxFilter for radius ry.
+static inline int boxRows(int ry, int h) {
+  return 2 * (int64_t)ry + 1 < h ? 2 * ry + 1 : h;
+}
+
+// Mean of row d of the window sums in colSum, for column radius rx.
+// cy is the number of rows in the window.
+static void boxMeanRow(const uint64_t* colSum, uint8* d, int w, int rx,
+                       uint64_t cy) {
+  // Full windows in [x0, x1), clipped ones outside
+  int x0 = rx < w ? rx : w;
+  int x1 = w - rx > x0 ? w - rx : x0;
+  for (int x = 0; x < x0; x++) {
+    uint64_t area = cy * boxCount(x, rx, w);
+    d[x] = boxMean(colSum[x], area, boxRecip(area));
+  }
+  for (int x = x1; x < w; x++) {
+    uint64_t area = cy * boxCount(x, rx, w);
+    d[x] = boxMean(colSum[x], area, boxRecip(area));
+  }
+  uint64_t area = cy * (2 * (uint64_t)rx + 1);
+  uint64_t recip = boxRecip(area);
+  for (int x = x0; x < x1; x++) d[x] = boxMean(colSum[x], area, recip);
+  PIXMEM += (unsigned long)w;
+}
+
+// Box filter src (w x h, rows stride apart) into dst (likewise), with
+// radii rx and ry.  colSum is a work row of w elements, and ring holds the window sums of
+// the last boxRows(ry, h) rows, w elements each, so each row is summed
+// only once.
+static void boxFilter(const uint8* src, uint8* dst, int w, int h,
+                      size_t stride, int rx, int ry,
+                      uint64_t* colSum, uint64_t* ring) {
+  int rows = boxRows(ry, h);
+  for (int x = 0; x < w; x++) colSum[x] = 0;
+  // Window for y = 0 is [0, ry]
+  for (int y = 0; y <= ry && y < h; y++) {
+    uint64_t* r = ring + (size_t)(y % rows) * w;
+    boxRowSums(src + y * stride, w, rx, r);
+    for (int x = 0; x < w; x++) colSum[x] += r[x];
+  }
+  for (int y = 0; y < h; y++) {
+    boxMeanRow(colSum, dst + y * stride, w, rx, boxCount(y, ry, h));
+    // Slide window from [y-ry, y+ry] to [y+1-ry, y+1+ry]
+    // (the row leaving is subtracted before its slot is reused)
+    if (y - ry >= 0) {
+      const uint64_t* r = ring + (size_t)((y - ry) % rows) * w;
+      for (int x = 0; x < w; x++) colSum[x] -= r[x];
+    }
+    if (y + ry + 1 < h) {
+      uint64_t* r = ring + (size_t)((y + ry + 1) % rows) * w;
+      boxRowSums(src + (y + ry + 1) * stride, w, rx, r);
+      for (int x = 0; x < w; x++) colSum[x] += r[x];
+    }
+    IMAGEBLUR += 2 * (unsigned long)w;
+  }
+}
+
+// Allocate the buffers for boxFilter on img, with radii up to ry: an
+// output pixel array like that of img, and the work rows (colSum, then
+// ring, in one block, *sums).
+// Returns 0 (with errno/errCause set) on failure.
+static int boxAlloc(Image img, int ry, uint8** tmp, uint64_t** sums) {
+  int w = img->width;
+  int h = img->height;
+  *tmp = (uint8*)malloc(sizeof(uint8) * (img->stride * h + 1));
+  *sums = (uint64_t*)malloc(sizeof(uint64_t) *
+                            ((size_t)w * (1 + boxRows(ry, h)) + 1));
+  if (*tmp == NULL || *sums == NULL) {
+    errsave = errno;
+    free(*tmp);
+    free(*sums);
+    errno = errsave;
+    errCause = "Memory allocation error for blur buffers";
+    return 0;
+  }
+  return 1;
+}
+
+// ImageBlur on a raster or aligned image.
+static int blurRaster(Image img, int dx, int dy) {
+  int w = img->width;
+  int h = img->height;
+  uint8* tmp;
+  uint64_t* sums;
+  if (!boxAlloc(img, dy, &tmp, &sums)) return 0;
+  boxFilter(img->pixel, tmp, w, h, img->stride, dx, dy, sums, sums + w);
+  memcpy(img->pixel, tmp, img->stride * h);
+  PIXMEM += 2 * (unsigned long)w * h;
+  free(tmp);
+  free(sums);
+  return 1;
+}
+
+/// Blur an image by applying a (2dx+1)x(2dy+1) mean filter.
+/// Each pixel is substituted by the mean of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image).
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img is not modified.
+int ImageBlur(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0);
+  assert (dy >= 0);
+  // Insert your code here!
+  int layout = img->layout;
+  if (!makeWritable(img)) return 0;
+  if (!rowsOf(img)) return 0;  // works on raster scans
+  int success = blurRaster(img, dx, dy);
+  toLayout(img, layout);
+  return success;
+}
+
+
+/// Incremental blur
+
+/// Mark all pixels of img as clean.
+/// Later changes to img are tracked: in-place operations add the area they
+/// modify (the pasted rectangle, for ImagePaste / ImageBlend, the pixel,
+/// for ImageSetPixel, or else the whole image) to the dirty area of img.
+/// (New images start all dirty.)
+void ImageMarkClean(Image img) { ///
+  assert (img != NULL);
+  img->dirty = (struct rect){ 0, 0, 0, 0 };
+}
+
+/// Get the bounding rectangle of the dirty area of img.
+/// Returns 0 if img is clean, or else nonzero, with the rectangle in
+/// (*x, *y, *w, *h).
+int ImageDirtyRect(Image img, int* x, int* y, int* w, int* h) { ///
+  assert (img != NULL);
+  assert (x != NULL && y != NULL && w != NULL && h != NULL);
+  struct rect d = img->dirty;
+  if (d.x0 >= d.x1 || d.y0 >= d.y1) return 0;
+  *x = d.x0;
+  *y = d.y0;
+  *w = d.x1 - d.x0;
+  *h = d.y1 - d.y0;
+  return 1;
+}
+
+/// Start blurring img incrementally.
+/// Returns a copy of img blurred like ImageBlur(copy, dx, dy), and marks
+/// img clean, so that the copy can be kept up to date with ImageBlurUpdate
+/// as img is changed.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageBlurred(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0);
+  assert (dy >= 0);
+  Image blurred = ImageClone(img);
+  if (blurred == NULL) return NULL;
+  if (!ImageBlur(blurred, dx, dy)) {
+    errsave = errno;
+    ImageDestroy(&blurred);
+    errno = errsave;
+    return NULL;
+  }
+  ImageMarkClean(img);
+  return blurred;
+}
+
+/// Update blurred after changes to img.
+/// Requires: blurred is img blurred with (dx, dy), as it was when it was
+/// last marked clean (see ImageBlurred).
+/// Only the dirty area of img, expanded by (dx, dy), is blurred again, so
+/// the cost depends on the size of the changes, not of the image.
+/// Ensures: blurred is the blur of img, and img is marked clean.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img and blurred are not modified.
+int ImageBlurUpdate(Image img, Image blurred, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (blurred != NULL);
+  assert (blurred->width == img->width && blurred->height == img->height);
+  assert (dx >= 0);
+  assert (dy >= 0);
+  int x, y, w, h;
+  if (!ImageDirtyRect(img, &x, &y, &w, &h)) return 1;
+
+  // Output pixels affected by the dirty area (r), and input pixels they
+  // depend on (s).  Windows are clipped to the image both in s and in img,
+  // so blurring a crop of s gives the same result inside r.
+  struct rect r = { x - dx, y - dy, x + w + dx, y + h + dy };
+  if (r.x0 < 0) r.x0 = 0;
+  if (r.y0 < 0) r.y0 = 0;
+  if (r.x1 > img->width) r.x1 = img->width;
+  if (r.y1 > img->height) r.y1 = img->height;
+  struct rect s = { r.x0 - dx, r.y0 - dy, r.x1 + dx, r.y1 + dy };
+  if (s.x0 < 0) s.x0 = 0;
+  if (s.y0 < 0) s.y0 = 0;
+  if (s.x1 > img->width) s.x1 = img->width;
+  if (s.y1 > img->height) s.y1 = img->height;
+
+  Image part = ImageCrop(img, s.x0, s.y0, s.x1 - s.x0, s.y1 - s.y0);
+  int success = part != NULL &&
+                ImageBlur(part, dx, dy) &&
+                makeWritableRect(blurred, r.x0, r.y0, r.x1 - r.x0, r.y1 - r.y0);
+  if (success) {
+    struct rectArg a = { blurred, part, r.x0, r.y0, r.x0 - s.x0, r.y0 - s.y0, r.x1 - r.x0, 0.0 };
+    int rows = r.y1 - r.y0;
+    parallelFor(rows, (size_t)a.w * rows, copyRows, &a);
+    PIXMEM += 2 * (unsigned long)a.w * rows;
+    blurred->maxval = img->maxval;
+    ImageMarkClean(img);
+  }
+  errsave = errno;
+  ImageDestroy(&part);
+  errno = errsave;
+  return success;
+}
+
+
+// Compute the radii of n successive box filters whose combined effect
+// approximates a Gaussian of standard deviation sigma.
+// (Ideal box width from the variance of n uniform distributions,
+// split between the nearest odd widths wl and wl+2.)
+static void gaussBoxRadii(double sigma, int n, int radius[]) {
+  double wIdeal = sqrt(12.0 * sigma * sigma / n + 1.0);
+  int wl = (int)floor(wIdeal);
+  if (wl % 2 == 0) wl--;
+  int wu = wl + 2;
+  double mIdeal = (12.0 * sigma * sigma - n * wl * wl - 4.0 * n * wl - 3.0 * n)
+                  / (-4.0 * wl - 4.0);
+  int m = (int)floor(mIdeal + 0.5);
+  for (int i = 0; i < n; i++) {
+    radius[i] = ((i < m ? wl : wu) - 1) / 2;
+  }
+}
+
+// ImageGaussianBlur on a raster or aligned image.
+static int gaussianBlurRaster(Image img, double sigma) {
+  int w = img->width;
+  int h = img->height;
+  if (sigma == 0.0 || w == 0 || h == 0) return 1;
+
+  int radius[3];
+  gaussBoxRadii(sigma, 3, radius);
+
+  uint8* tmp;
+  uint64_t* sums;
+  if (!boxAlloc(img, radius[2], &tmp, &sums)) return 0;  // the largest
+
+  // Passes alternate between img->pixel and tmp
+  uint8* src = img->pixel;
+  uint8* dst = tmp;
+  for (int i = 0; i < 3; i++) {
+    boxFilter(src, dst, w, h, img->stride, radius[i], radius[i],
+              sums, sums + w);
+    uint8* t = src;
+    src = dst;
+    dst = t;
+  }
+  memcpy(img->pixel, src, img->stride * h);
+  PIXMEM += 2 * (unsigned long)w * h;
+
+  free(tmp);
+  free(sums);
+  return 1;
+}
+
+/// Blur an image with an approximately Gaussian filter.
+/// The Gaussian of standard deviation sigma is approximated by three
+/// successive box filters, each applied separably in O(1) per pixel.
+/// Requires: sigma >= 0.0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img is not modified.
+int ImageGaussianBlur(Image img, double sigma) { ///
+  assert (img != NULL);
+  assert (sigma >= 0.0);
+  int layout = img->layout;
+  if (!makeWritable(img)) return 0;
+  if (!rowsOf(img)) return 0;
+  int success = gaussianBlurRaster(img, sigma);
+  toLayout(img, layout);
+  return success;
+}
+
+// Histograms used by ImageMedian.
+//
+// Levels are split into 16 coarse bins of 16 fine bins each.
+// MEDCOARSE(v) is the coarse bin of level v.
+#define MEDCOARSE(v) ((v) >> 4)
+
+// Bring the fine histogram for coarse bin b, kept in kFine, up to date for
+// the window of column x.  *luc is the column for which it was last valid.
+// Column histograms cover columns [0, w); the window of column x covers
+// [x-dx, x+dx] clipped to that range.
+static void medUpdateFine(uint32_t* kFine, int* luc, int b, int x,
+                          int w, int dx, const uint16_t* colFine) {
+  uint32_t* k = kFine + 16 * b;
+  if (x - *luc > 2 * dx + 1) {
+    // Cheaper to rebuild from scratch than to slide
+    for (int i = 0; i < 16; i++) k[i] = 0;
+    int lo = x - dx > 0 ? x - dx : 0;
+    int hi = x + dx < w ? x + dx : w - 1;
+    for (int c = lo; c <= hi; c++) {
+      const uint16_t* h = colFine + 256 * (size_t)c + 16 * b;
+      for (int i = 0; i < 16; i++) k[i] += h[i];
+    }
+  } else {
+    for (int xx = *luc + 1; xx <= x; xx++) {
+      int out = xx - dx - 1;
+      int in = xx + dx;
+      if (out >= 0) {
+        const uint16_t* h = colFine + 256 * (size_t)out + 16 * b;
+        for (int i = 0; i < 16; i++) k[i] -= h[i];
+      }
+      if (in < w) {
+        const uint16_t* h = colFine + 256 * (size_t)in + 16 * b;
+        for (int i = 0; i < 16; i++) k[i] += h[i];
+      }
+    }
+  }
+  *luc = x;
+}
+
+// ImageMedian on a raster or aligned image.
+static int medianRaster(Image img, int dx, int dy) {
+  int w = img->width;
+  int h = img->height;
+  size_t stride = img->stride;
+  if (w == 0 || h == 0) return 1;
+
+  // Per-column histograms of the rows in the current vertical window:
+  // colFine has 256 bins per column, colCoarse 16 bins per column.
+  uint16_t* colFine = (uint16_t*)calloc((size_t)w * 256, sizeof(uint16_t));
+  uint16_t* colCoarse = (uint16_t*)calloc((size_t)w * 16, sizeof(uint16_t));
+  uint8* out = (uint8*)malloc(sizeof(uint8) * stride * h);
+  if (colFine == NULL || colCoarse == NULL || out == NULL) {
+    errsave = errno;
+    free(colFine);
+    free(colCoarse);
+    free(out);
+    errno = errsave;
+    errCause = "Memory allocation error for median histograms";
+    return 0;
+  }
+
+  // Window for y = 0 is [0, dy]
+  int rows = 0;
+  for (int y = 0; y <= dy && y < h; y++) {
+    const uint8* s = img->pixel + y * stride;
+    for (int x = 0; x < w; x++) {
+      colFine[256 * (size_t)x + s[x]]++;
+      colCoarse[16 * (size_t)x + MEDCOARSE(s[x])]++;
+    }
+    rows++;
+  }
+
+  uint32_t kCoarse[16];
+  uint32_t kFine[256];
+  int luc[16];
+  for (int y = 0; y < h; y++) {
+    // Kernel histograms for the window of column 0: columns [0, dx]
+    for (int b = 0; b < 16; b++) {
+      kCoarse[b] = 0;
+      luc[b] = -2 * dx - 2;  // forces a rebuild on first use
+    }
+    for (int c = 0; c <= dx && c < w; c++) {
+      for (int b = 0; b < 16; b++) kCoarse[b] += colCoarse[16 * (size_t)c + b];
+    }
+    int cols = dx < w - 1 ? dx + 1 : w;
+
+    uint8* d = out + y * stride;
+    for (int x = 0; x < w; x++) {
+      // Find the median: first the coarse bin, then the level inside it
+      uint32_t rank = ((uint32_t)cols * rows - 1) / 2;
+      int b = 0;
+      while (kCoarse[b] <= rank) {
+        rank -= kCoarse[b];
+        b++;
+      }
+      medUpdateFine(kFine, &luc[b], b, x, w, dx, colFine);
+      int v = 16 * b;
+      while (kFine[v] <= rank) {
+        rank -= kFine[v];
+        v++;
+      }
+      d[x] = (uint8)v;
+
+      // Slide the coarse kernel from column x to x+1
+      int outCol = x - dx;
+      int inCol = x + dx + 1;
+      if (outCol >= 0) {
+        for (int i = 0; i < 16; i++) kCoarse[i] -= colCoarse[16 * (size_t)outCol + i];
+        cols--;
+      }
+      if (inCol < w) {
+        for (int i = 0; i < 16; i++) kCoarse[i] += colCoarse[16 * (size_t)inCol + i];
+        cols++;
+      }
+    }
+    IMAGEMEDIAN += (unsigned long)w;
+
+    // Slide the column histograms from [y-dy, y+dy] to [y+1-dy, y+1+dy]
+    if (y + dy + 1 < h) {
+      const uint8* s = img->pixel + (y + dy + 1) * stride;
+      for (int x = 0; x < w; x++) {
+        colFine[256 * (size_t)x + s[x]]++;
+        colCoarse[16 * (size_t)x + MEDCOARSE(s[x])]++;
+      }
+      rows++;
+    }
+    if (y - dy >= 0) {
+      const uint8* s = img->pixel + (y - dy) * stride;
+      for (int x = 0; x < w; x++) {
+        colFine[256 * (size_t)x + s[x]]--;
+        colCoarse[16 * (size_t)x + MEDCOARSE(s[x])]--;
+      }
+      rows--;
+    }
+  }
+  PIXMEM += 3 * (unsigned long)w * h;  // each row added, removed and written
+
+  for (int y = 0; y < h; y++) {
+    memcpy(img->pixel + y * stride, out + y * stride, w);
+  }
+
+  free(colFine);
+  free(colCoarse);
+  free(out);
+  return 1;
+}
+
+/// Apply a (2dx+1)x(2dy+1) median filter to an image.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image; for an even number
+/// of pixels, the lower median is used).
+/// The running time per pixel does not depend on dx and dy.
+/// Requires: dx >= 0, 0 <= dy < 32768.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img is not modified.
+int ImageMedian(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0);
+  assert (dy >= 0 && dy < 32768);
+  int layout = img->layout;
+  if (!makeWritable(img)) return 0;
+  if (!rowsOf(img)) return 0;
+  int success = medianRaster(img, dx, dy);
+  toLayout(img, layout);
+  return success;
+}
+
+// Grayscale morphology (min/max filters)
+//
+// Erosion and dilation by a (2dx+1)x(2dy+1) rectangle are separable into a
+// horizontal and a vertical 1D min (or max) filter.  Each 1D filter uses the
+// van Herk/Gil-Werman algorithm: the (padded) line is split into blocks of
+// k = 2r+1 elements, prefix (g) and suffix (h) running min/max are computed
+// inside each block, and every window [i, i+k-1] then spans at most two
+// blocks, so its min/max is op(h[i], g[i+k-1]).  This takes 3 comparisons
+// per pixel whatever the window size.
+// Pixels outside the image are treated as the identity of the operation
+// (PixMax for min, 0 for max), which amounts to clipping the window.
+//
+// The vertical pass applies the same recurrences to whole rows at a time,
+// so its inner loops are element-wise min/max of two rows, done with SIMD.
+
+// d[i] = min(a[i], b[i]) (or max, if isMax) for i in [0, n).
+// (The vector versions use aligned loads and stores if d, a and b are all
+// aligned, as the rows of aligned images are.)
+static void rowMinMaxScalar(uint8* d, const uint8* a, const uint8* b, int n,
+                            int isMax) {
+  if (isMax) {
+    for (int i = 0; i < n; i++) d[i] = a[i] > b[i] ? a[i] : b[i];
+  } else {
+    for (int i = 0; i < n; i++) d[i] = a[i] < b[i] ? a[i] : b[i];
+  }
+}
+
+#if defined(__SSE2__)
+static void rowMinMaxSSE2(uint8* d, const uint8* a, const uint8* b, int n,
+                          int isMax) {
+  int i = 0;
+  if ((((uintptr_t)d | (uintptr_t)a | (uintptr_t)b) & 15) == 0) {
+    for (; i + 16 <= n; i += 16) {
+      __m128i va = _mm_load_si128((const __m128i*)(a + i));
+      __m128i vb = _mm_load_si128((const __m128i*)(b + i));
+      __m128i vd = isMax ? _mm_max_epu8(va, vb) : _mm_min_epu8(va, vb);
+      _mm_store_si128((__m128i*)(d + i), vd);
+    }
+  } else if (isMax) {
+    for (; i + 16 <= n; i += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+      _mm_storeu_si128((__m128i*)(d + i), _mm_max_epu8(va, vb));
+    }
+  } else {
+    for (; i + 16 <= n; i += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+      _mm_storeu_si128((__m128i*)(d + i), _mm_min_epu8(va, vb));
+    }
+  }
+  rowMinMaxScalar(d + i, a + i, b + i, n - i, isMax);
+}
+#endif
+
+#if defined(KERNELS_X86)
+TARGET("avx2")
+static void rowMinMaxAVX2(uint8* d, const uint8* a, const uint8* b, int n,
+                          int isMax) {
+  int i = 0;
+  if ((((uintptr_t)d | (uintptr_t)a | (uintptr_t)b) & 31) == 0) {
+    for (; i + 32 <= n; i += 32) {
+      __m256i va = _mm256_load_si256((const __m256i*)(a + i));
+      __m256i vb = _mm256_load_si256((const __m256i*)(b + i));
+      __m256i vd = isMax ? _mm256_max_epu8(va, vb) : _mm256_min_epu8(va, vb);
+      _mm256_store_si256((__m256i*)(d + i), vd);
+    }
+  }
+  for (; i + 32 <= n; i += 32) {
+    __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+    __m256i vd = isMax ? _mm256_max_epu8(va, vb) : _mm256_min_epu8(va, vb);
+    _mm256_storeu_si256((__m256i*)(d + i), vd);
+  }
+  rowMinMaxScalar(d + i, a + i, b + i, n - i, isMax);
+}
+
+// (The tail is done with masked loads and stores.)
+TARGET("avx512f,avx512bw")
+static void rowMinMaxAVX512(uint8* d, const uint8* a, const uint8* b, int n,
+                            int isMax) {
+  int i = 0;
+  if ((((uintptr_t)d | (uintptr_t)a | (uintptr_t)b) & 63) == 0) {
+    for (; i + 64 <= n; i += 64) {
+      __m512i va = _mm512_load_si512(a + i);
+      __m512i vb = _mm512_load_si512(b + i);
+      __m512i vd = isMax ? _mm512_max_epu8(va, vb) : _mm512_min_epu8(va, vb);
+      _mm512_store_si512(d + i, vd);
+    }
+  }
+  for (; i < n; i += 64) {
+    __mmask64 m = n - i >= 64 ? ~(__mmask64)0 : ((__mmask64)1 << (n - i)) - 1;
+    __m512i va = _mm512_maskz_loadu_epi8(m, a + i);
+    __m512i vb = _mm512_maskz_loadu_epi8(m, b + i);
+    __m512i vd = isMax ? _mm512_max_epu8(va, vb) : _mm512_min_epu8(va, vb);
+    _mm512_mask_storeu_epi8(d + i, m, vd);
+  }
+}
+#endif
+
+// Number of elements of a line of n pixels padded by r on each side and
+// rounded up to whole blocks of 2r+1.
+static inline int morphPadded(int n, int r) {
+  int k = 2 * r + 1;
+  return (n + 2 * r + k - 1) / k * k;
+}
+
+// Horizontal pass: filter each row of img->pixel in-place.
+// g, hb and ext are scratch lines with morphPadded(w, r) elements.
+static void morphRows(Image img, int r, int isMax,
+                      uint8* ext, uint8* g, uint8* hb) {
+  int w = img->width;
+  int k = 2 * r + 1;
+  int m = morphPadded(w, r);
+  uint8 ident = isMax ? 0 : PixMax;
+  for (int y = 0; y < img->height; y++) {
+    uint8* row = img->pixel + y * img->stride;
+    for (int i = 0; i < m; i++) {
+      ext[i] = (r <= i && i < r + w) ? row[i - r] : ident;
+    }
+    for (int i = 0; i < m; i++) {
+      if (i % k == 0) g[i] = ext[i];
+      else g[i] = isMax ? (g[i-1] > ext[i] ? g[i-1] : ext[i])
+                        : (g[i-1] < ext[i] ? g[i-1] : ext[i]);
+    }
+    for (int i = m - 1; i >= 0; i--) {
+      if (i % k == k - 1) hb[i] = ext[i];
+      else hb[i] = isMax ? (hb[i+1] > ext[i] ? hb[i+1] : ext[i])
+                         : (hb[i+1] < ext[i] ? hb[i+1] : ext[i]);
+    }
+    K()->rowMinMax(row, hb, g + 2 * r, w, isMax);
+  }
+}
+
+// Vertical pass: filter the columns of img->pixel in-place.
+// g and hb are scratch buffers of morphPadded(h, r) rows img->stride
+// apart, ident is a row filled with the identity of the operation.
+// Rows of aligned images are filtered whole, padding included, so that
+// they take whole vectors.
+static void morphCols(Image img, int r, int isMax,
+                      uint8* g, uint8* hb, const uint8* ident) {
+  size_t s = img->stride;
+  int n = img->layout == IMAGE_ALIGNED ? (int)s : img->width;
+  int h = img->height;
+  int k = 2 * r + 1;
+  int m = morphPadded(h, r);
+  // Row i of the padded column is image row i-r, or ident outside.
+  #define EXTROW(i) ((r <= (i) && (i) < r + h) \
+                     ? img->pixel + ((i) - r) * s : ident)
+  for (int i = 0; i < m; i++) {
+    uint8* gi = g + i * s;
+    if (i % k == 0) memcpy(gi, EXTROW(i), n);
+    else K()->rowMinMax(gi, gi - s, EXTROW(i), n, isMax);
+  }
+  for (int i = m - 1; i >= 0; i--) {
+    uint8* hi = hb + i * s;
+    if (i % k == k - 1) memcpy(hi, EXTROW(i), n);
+    else K()->rowMinMax(hi, hi + s, EXTROW(i), n, isMax);
+  }
+  #undef EXTROW
+  for (int y = 0; y < h; y++) {
+    K()->rowMinMax(img->pixel + y * s, hb + y * s, g + (y + 2 * r) * s, n,
+                   isMax);
+  }
+}
+
+// morphFilter on a raster or aligned image.
+static int morphFilterRaster(Image img, int dx, int dy, int isMax) {
+  int w = img->width;
+  int h = img->height;
+  if (w == 0 || h == 0) return 1;
+  // Windows are clipped to the image, so wider ones give the same result
+  if (dx > w - 1) dx = w - 1;
+  if (dy > h - 1) dy = h - 1;
+  int mx = morphPadded(w, dx);
+  int my = morphPadded(h, dy);
+  size_t s = img->stride;
+  size_t lineSize = (size_t)mx > s ? (size_t)mx : s;
+  uint8* line = (uint8*)malloc(3 * lineSize);
+  // (Rows aligned like those of img, for the vector kernels)
+  size_t size = (my * s + ROWALIGN - 1) & ~(size_t)(ROWALIGN - 1);
+  uint8* g = (uint8*)aligned_alloc(ROWALIGN, size);
+  uint8* hb = (uint8*)aligned_alloc(ROWALIGN, size);
+  if (line == NULL || g == NULL || hb == NULL) {
+    errsave = errno;
+    free(line);
+    free(g);
+    free(hb);
+    errno = errsave;
+    errCause = "Memory allocation error for morphology buffers";
+    return 0;
+  }
+
+  if (dx > 0) {
+    morphRows(img, dx, isMax, line, line + lineSize, line + 2 * lineSize);
+  }
+  if (dy > 0) {
+    memset(line, isMax ? 0 : PixMax, s);
+    morphCols(img, dy, isMax, g, hb, line);
+  }
+  PIXMEM += 6 * (unsigned long)w * h;  // g, h and output, in each pass
+
+  free(line);
+  free(g);
+  free(hb);
+  return 1;
+}
+
+// Apply a (2dx+1)x(2dy+1) min (or max) filter to img in-place.
+// Returns nonzero on success, 0 on allocation failure (img unchanged).
+static int morphFilter(Image img, int dx, int dy, int isMax) {
+  int layout = img->layout;
+  if (!makeWritable(img)) return 0;
+  if (!rowsOf(img)) return 0;
+  int success = morphFilterRaster(img, dx, dy, isMax);
+  toLayout(img, layout);
+  return success;
+}
+
+/// Erode an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the minimum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image).
+/// The running time per pixel does not depend on dx and dy.
+/// Requires: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img is not modified.
+int ImageErode(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0);
+  assert (dy >= 0);
+  return morphFilter(img, dx, dy, 0);
+}
+
+/// Dilate an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the maximum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image).
+/// Requires, ensures and failure as in ImageErode.
+int ImageDilate(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0);
+  assert (dy >= 0);
+  return morphFilter(img, dx, dy, 1);
+}
+
+/// Morphological opening: erosion followed by dilation.
+/// Removes bright details smaller than the (2dx+1)x(2dy+1) rectangle.
+/// Requires, ensures and failure as in ImageErode.
+/// (On failure, img may have been eroded but not dilated.)
+int ImageOpen(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0);
+  assert (dy >= 0);
+  return morphFilter(img, dx, dy, 0) && morphFilter(img, dx, dy, 1);
+}
+
+/// Morphological closing: dilation followed by erosion.
+/// Fills dark details smaller than the (2dx+1)x(2dy+1) rectangle.
+/// Requires, ensures and failure as in ImageErode.
+/// (On failure, img may have been dilated but not eroded.)
+int ImageClose(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0);
+  assert (dy >= 0);
+  return morphFilter(img, dx, dy, 1) && morphFilter(img, dx, dy, 0);
+}
+
+
+/// Convolution
+
+// ImageConvolve computes each output row from the kh source rows around
+// it, each padded with kw/2 pixels on both sides.  Positions outside the
+// image are mapped to pixels inside it by the border mode (or are zero).
+// Those padded rows are kept in a ring of kh rows indexed by position
+// modulo kh, so each source row is padded once per range of output rows.
+// Taps with a zero coefficient are skipped.
+//
+// A kernel of rank 1 is the outer product of a column u (kh coefficients)
+// and a row v (kw coefficients).  Then each padded row is filtered with v
+// once, into a ring of kh 32-bit rows, and each output row is the
+// combination of those rows with u: kw+kh taps per pixel instead of kw*kh.
+//
+// Sums are exact in 32 bits (see the requirements of ImageConvolve), so
+// both ways, and all kernels, give identical results.
+
+// Max sum of the absolute values of the coefficients of a kernel
+#define CONVMAXSUM ((1 << 23) - 1)
+
+// acc[x] = sum of coef[t] * src[t][x] for t in [0, taps), for x in [x0, n).
+static void convRowFrom(int32_t* acc, const uint8* const* src,
+                        const int16_t* coef, int taps, int x0, int n) {
+  for (int x = x0; x < n; x++) acc[x] = 0;
+  for (int t = 0; t < taps; t++) {
+    const uint8* s = src[t];
+    int32_t c = coef[t];
+    for (int x = x0; x < n; x++) acc[x] += c * s[x];
+  }
+}
+
+// acc[x] = sum of coef[t] * src[t][x] for t in [0, taps), for x in [0, n).
+static void convRowScalar(int32_t* acc, const uint8* const* src,
+                          const int16_t* coef, int taps, int n) {
+  convRowFrom(acc, src, coef, taps, 0, n);
+}
+
+// Same, for rows of 32-bit sums.
+static void convColFrom(int32_t* acc, const int32_t* const* src,
+                        const int16_t* coef, int taps, int x0, int n) {
+  for (int x = x0; x < n; x++) acc[x] = 0;
+  for (int t = 0; t < taps; t++) {
+    const int32_t* s = src[t];
+    int32_t c = coef[t];
+    for (int x = x0; x < n; x++) acc[x] += c * s[x];
+  }
+}
+
+static void convColScalar(int32_t* acc, const int32_t* const* src,
+                          const int16_t* coef, int taps, int n) {
+  convColFrom(acc, src, coef, taps, 0, n);
+}
+
+// Coefficients of taps t and t+1 (0 if t+1 == taps), as the pair of 16-bit
+// multipliers of pmaddwd.
+static inline int convPair(const int16_t* coef, int t, int taps) {
+  uint16_t c0 = (uint16_t)coef[t];
+  uint16_t c1 = t + 1 < taps ? (uint16_t)coef[t + 1] : 0;
+  return (int)((uint32_t)c1 << 16 | c0);
+}
+
+#if defined(__SSE2__)
+// (Taps are taken in pairs: the pixels of both are interleaved, and
+// pmaddwd multiplies and adds each pair into 32 bits.)
+static void convRowSSE2(int32_t* acc, const uint8* const* src,
+                        const int16_t* coef, int taps, int n) {
+  __m128i zero = _mm_setzero_si128();
+  int x = 0;
+  for (; x + 8 <= n; x += 8) {
+    __m128i lo = zero;
+    __m128i hi = zero;
+    for (int t = 0; t < taps; t += 2) {
+      __m128i a = _mm_loadl_epi64((const __m128i*)(src[t] + x));
+      __m128i b = t + 1 < taps ?
+                  _mm_loadl_epi64((const __m128i*)(src[t + 1] + x)) : zero;
+      a = _mm_unpacklo_epi8(a, zero);
+      b = _mm_unpacklo_epi8(b, zero);
+      __m128i c = _mm_set1_epi32(convPair(coef, t, taps));
+      lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), c));
+      hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), c));
+    }
+    _mm_storeu_si128((__m128i*)(acc + x), lo);
+    _mm_storeu_si128((__m128i*)(acc + x + 4), hi);
+  }
+  convRowFrom(acc, src, coef, taps, x, n);
+}
+#endif
+
+#if defined(KERNELS_X86)
+TARGET("avx2")
+static void convRowAVX2(int32_t* acc, const uint8* const* src,
+                        const int16_t* coef, int taps, int n) {
+  __m256i zero = _mm256_setzero_si256();
+  int x = 0;
+  for (; x + 16 <= n; x += 16) {
+    // lo has sums 0-3 and 8-11, hi has sums 4-7 and 12-15
+    __m256i lo = zero;
+    __m256i hi = zero;
+    for (int t = 0; t < taps; t += 2) {
+      __m256i a = _mm256_cvtepu8_epi16(
+          _mm_loadu_si128((const __m128i*)(src[t] + x)));
+      __m256i b = t + 1 < taps ? _mm256_cvtepu8_epi16(
+          _mm_loadu_si128((const __m128i*)(src[t + 1] + x))) : zero;
+      __m256i c = _mm256_set1_epi32(convPair(coef, t, taps));
+      __m256i ablo = _mm256_unpacklo_epi16(a, b);
+      __m256i abhi = _mm256_unpackhi_epi16(a, b);
+      lo = _mm256_add_epi32(lo, _mm256_madd_epi16(ablo, c));
+      hi = _mm256_add_epi32(hi, _mm256_madd_epi16(abhi, c));
+    }
+    __m256i s0 = _mm256_permute2x128_si256(lo, hi, 0x20);
+    __m256i s1 = _mm256_permute2x128_si256(lo, hi, 0x31);
+    _mm256_storeu_si256((__m256i*)(acc + x), s0);
+    _mm256_storeu_si256((__m256i*)(acc + x + 8), s1);
+  }
+  convRowFrom(acc, src, coef, taps, x, n);
+}
+
+// (SSE2 has no 32-bit multiply, so the SSE2 set uses the scalar version.)
+TARGET("avx2")
+static void convColAVX2(int32_t* acc, const int32_t* const* src,
+                        const int16_t* coef, int taps, int n) {
+  int x = 0;
+  for (; x + 8 <= n; x += 8) {
+    __m256i s = _mm256_setzero_si256();
+    for (int t = 0; t < taps; t++) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(src[t] + x));
+      __m256i c = _mm256_set1_epi32(coef[t]);
+      s = _mm256_add_epi32(s, _mm256_mullo_epi32(v, c));
+    }
+    _mm256_storeu_si256((__m256i*)(acc + x), s);
+  }
+  convColFrom(acc, src, coef, taps, x, n);
+}
+#endif
+
+// Position in [0, n) of the pixel used for position i, in border mode
+// border, or -1 if it is zero.
+static int borderIndex(int i, int n, int border) {
+  if (0 <= i && i < n) return i;
+  switch (border) {
+  case IMAGE_BORDER_CLAMP:
+    return i < 0 ? 0 : n - 1;
+  case IMAGE_BORDER_MIRROR: {
+    if (n == 1) return 0;
+    int p = 2 * (n - 1);   // period of the reflected image
+    i %= p;
+    if (i < 0) i += p;
+    return i < n ? i : p - i;
+  }
+  case IMAGE_BORDER_WRAP:
+    i %= n;
+    return i < 0 ? i + n : i;
+  default:
+    return -1;
+  }
+}
+
+// Taps of a kernel: coefficient c[t] applies at offset (x[t], y[t]).
+struct convTaps {
+  int n;
+  int* x;
+  int* y;
+  int16_t* c;
+};
+
+struct convArg {
+  const uint8* src;   // source pixels (rows stride apart)
+  uint8* dst;         // output pixels (likewise)
+  size_t stride;
+  int w, h, maxval;
+  int rx, ry;         // kernel radii (kw/2, kh/2)
+  int divisor, bias, border;
+  uint64_t mul;        // division as a multiplication, if mul != 0:
+  int shift;           // (see convFinish)
+  int32_t off;
+  int64_t base;
+  int separable;      // use the factors instead of the kernel?
+  struct convTaps k;  // kernel taps (offsets in [0, kw) x [0, kh))
+  struct convTaps v;  // row factor taps (y == 0)
+  struct convTaps u;  // column factor taps (x == 0)
+  atomic_int failed;  // could a thread not allocate its buffers?
+};
+
+// Copy row src (of w pixels) to dst, padded with r pixels on each side.
+static void padRow(uint8* dst, const uint8* src, int w, int r, int border) {
+  memcpy(dst + r, src, w);
+  for (int i = 0; i < r; i++) {
+    int a = borderIndex(i - r, w, border);
+    int b = borderIndex(w + i, w, border);
+    dst[i] = a < 0 ? 0 : src[a];
+    dst[r + w + i] = b < 0 ? 0 : src[b];
+  }
+}
+
+// Set up the division of sums up to maxAcc in magnitude by a->divisor as
+// a multiplication, if they are small enough: for 0 <= s < 2^31,
+// floor(s / d) == s * m >> (31 + l), with 2^(l-1) < d <= 2^l and
+// m = ceil(2^(31+l) / d).  Sums are first offset by a multiple of d to
+// make them non-negative (and by d/2, to round).
+static void convDivision(struct convArg* a, int64_t maxAcc) {
+  int d = a->divisor;
+  a->mul = 0;
+  if (maxAcc + d >= (1 << 30)) return;
+  int l = 0;
+  while ((1 << l) < d) l++;
+  int64_t k = (maxAcc + d / 2 + d - 1) / d;
+  a->off = (int32_t)(d / 2 + k * d);
+  a->base = a->bias - k;
+  a->shift = 31 + l;
+  a->mul = (((uint64_t)1 << a->shift) + d - 1) / d;
+}
+
+// Output levels d[x] of the sums acc[x], for x in [0, n): acc/divisor
+// rounded to nearest (halves up), plus bias, saturated to [0, maxval].
+static void convFinish(uint8* d, const int32_t* acc, int n,
+                       const struct convArg* a) {
+  if (a->mul != 0) {
+    for (int x = 0; x < n; x++) {
+      uint64_t s = (uint32_t)(acc[x] + a->off);
+      int64_t q = (int64_t)(s * a->mul >> a->shift) + a->base;
+      q = q > 0 ? q : 0;
+      d[x] = (uint8)(q < a->maxval ? q : a->maxval);
+    }
+    return;
+  }
+  int64_t div = a->divisor;
+  for (int x = 0; x < n; x++) {
+    int64_t s = acc[x] + div / 2;
+    int64_t q = (s >= 0 ? s / div : -((-s + div - 1) / div)) + a->bias;
+    d[x] = (uint8)(q < 0 ? 0 : q > a->maxval ? a->maxval : q);
+  }
+}
+
+// Slot of the ring of kh rows for position p.
+static inline int convSlot(int p, int kh) {
+  p %= kh;
+  return p < 0 ? p + kh : p;
+}
+
+// Convolve rows [y0, y1) of a->src into a->dst.
+static void convRows(void* arg, int y0, int y1) {
+  struct convArg* a = (struct convArg*)arg;
+  const struct kernels* kern = K();
+  int w = a->w;
+  int kh = 2 * a->ry + 1;
+  size_t pw = (size_t)w + 2 * a->rx;   // padded row width
+  // Ring of padded rows, or one padded row and a ring of filtered rows
+  size_t npix = a->separable ? pw : pw * kh;
+  size_t nsum = (size_t)w * (a->separable ? kh + 1 : 1);
+  uint8* pix = (uint8*)malloc(npix);
+  int32_t* sum = (int32_t*)malloc(sizeof(int32_t) * nsum);
+  const uint8** rows = (const uint8**)malloc(sizeof(uint8*) * (a->k.n + 1));
+  const int32_t** sums = (const int32_t**)malloc(sizeof(int32_t*) * kh);
+  if (pix == NULL || sum == NULL || rows == NULL || sums == NULL) {
+    atomic_store(&a->failed, 1);
+    free(pix);
+    free(sum);
+    free(rows);
+    free(sums);
+    return;
+  }
+  int32_t* acc = sum + nsum - w;
+
+  for (int y = y0; y < y1; y++) {
+    // Bring the ring up to date with positions [y-ry, y+ry]
+    for (int p = y == y0 ? y - a->ry : y + a->ry; p <= y + a->ry; p++) {
+      int s = convSlot(p, kh);
+      int sy = borderIndex(p, a->h, a->border);
+      uint8* row = a->separable ? pix : pix + pw * s;
+      if (sy < 0) {
+        if (a->separable) memset(sum + (size_t)w * s, 0, sizeof(int32_t) * w);
+        else memset(row, 0, pw);
+        continue;
+      }
+      padRow(row, a->src + sy * a->stride, w, a->rx, a->border);
+      if (a->separable) {
+        for (int t = 0; t < a->v.n; t++) rows[t] = row + a->v.x[t];
+        kern->convRow(sum + (size_t)w * s, rows, a->v.c, a->v.n, w);
+      }
+    }
+    // Combine them
+    if (a->separable) {
+      for (int t = 0; t < a->u.n; t++) {
+        sums[t] = sum + (size_t)w * convSlot(y - a->ry + a->u.y[t], kh);
+      }
+      kern->convCol(acc, sums, a->u.c, a->u.n, w);
+    } else {
+      for (int t = 0; t < a->k.n; t++) {
+        rows[t] = pix + pw * convSlot(y - a->ry + a->k.y[t], kh) + a->k.x[t];
+      }
+      kern->convRow(acc, rows, a->k.c, a->k.n, w);
+    }
+    convFinish(a->dst + y * a->stride, acc, w, a);
+  }
+
+  free(pix);
+  free(sum);
+  free(rows);
+  free(sums);
+}
+
+static int gcd(int a, int b) {
+  while (b != 0) {
+    int r = a % b;
+    a = b;
+    b = r;
+  }
+  return a;
+}
+
+// Find integer factors of the kw x kh kernel k, such that
+// k[j*kw+i] == u[j] * v[i].  Returns 0 if there are none (rank > 1) or
+// the kernel is zero.
+static int convFactor(const int* k, int kw, int kh, int* u, int* v) {
+  int r = 0;
+  int c = -1;
+  for (size_t i = 0; c < 0 && i < (size_t)kw * kh; i++) {
+    if (k[i] != 0) {
+      r = (int)(i / kw);
+      c = (int)(i % kw);
+    }
+  }
+  if (c < 0) return 0;
+  // v is row r divided by the gcd of its elements
+  int g = 0;
+  for (int i = 0; i < kw; i++) g = gcd(g, abs(k[r * kw + i]));
+  for (int i = 0; i < kw; i++) v[i] = k[r * kw + i] / g;
+  for (int j = 0; j < kh; j++) {
+    if (k[j * kw + c] % v[c] != 0) return 0;
+    u[j] = k[j * kw + c] / v[c];
+    for (int i = 0; i < kw; i++) {
+      if (u[j] * v[i] != k[j * kw + i]) return 0;
+    }
+  }
+  return 1;
+}
+
+// Set taps t to the nonzero coefficients of the kw x kh kernel k.
+static void convSetTaps(struct convTaps* t, const int* k, int kw, int kh) {
+  t->n = 0;
+  for (int j = 0; j < kh; j++) {
+    for (int i = 0; i < kw; i++) {
+      if (k[j * kw + i] == 0) continue;
+      t->x[t->n] = i;
+      t->y[t->n] = j;
+      t->c[t->n] = (int16_t)k[j * kw + i];
+      t->n++;
+    }
+  }
+}
+
+// ImageConvolve on a raster or aligned image.
+static int convolveRaster(Image img, const int* kernel, int kw, int kh,
+                          int divisor, int bias, int border) {
+  int w = img->width;
+  int h = img->height;
+  if (w == 0 || h == 0) return 1;
+
+  size_t nk = (size_t)kw * kh;
+  int* factors = (int*)malloc(sizeof(int) * (kw + kh));
+  int* offsets = (int*)malloc(sizeof(int) * 2 * (nk + kw + kh));
+  int16_t* coefs = (int16_t*)malloc(sizeof(int16_t) * (nk + kw + kh));
+  uint8* out = (uint8*)malloc(sizeof(uint8) * img->stride * h);
+  if (factors == NULL || offsets == NULL || coefs == NULL || out == NULL) {
+    errsave = errno;
+    free(factors);
+    free(offsets);
+    free(coefs);
+    free(out);
+    errno = errsave;
+    errCause = "Memory allocation error for convolution buffers";
+    return 0;
+  }
+
+  struct convArg a = {
+    .src = img->pixel, .dst = out, .stride = img->stride,
+    .w = w, .h = h, .maxval = img->maxval,
+    .rx = kw / 2, .ry = kh / 2,
+    .divisor = divisor, .bias = bias, .border = border,
+    .k = { 0, offsets, offsets + nk, coefs },
+    .v = { 0, offsets + 2 * nk, offsets + 2 * nk + kw, coefs + nk },
+    .u = { 0, offsets + 2 * (nk + kw), offsets + 2 * (nk + kw) + kh,
+           coefs + nk + kw },
+  };
+  convSetTaps(&a.k, kernel, kw, kh);
+  int* u = factors;
+  int* v = factors + kh;
+  if (convFactor(kernel, kw, kh, u, v)) {
+    convSetTaps(&a.v, v, kw, 1);
+    convSetTaps(&a.u, u, 1, kh);
+    a.separable = a.v.n + a.u.n < a.k.n;
+  }
+  int64_t total = 0;
+  for (size_t i = 0; i < nk; i++) total += abs(kernel[i]);
+  convDivision(&a, total * img->maxval);
+  atomic_init(&a.failed, 0);
+  int taps = a.separable ? a.v.n + a.u.n : a.k.n;
+  parallelFor(h, (size_t)w * h * (taps + 1), convRows, &a);
+
+  int success = !atomic_load(&a.failed);
+  if (success) {
+    memcpy(img->pixel, out, img->stride * h);
+    PIXMEM += (unsigned long)(taps + 2) * w * h;  // taps read, one written
+  } else {
+    errno = ENOMEM;
+    errCause = "Memory allocation error for convolution buffers";
+  }
+  free(factors);
+  free(offsets);
+  free(coefs);
+  free(out);
+  return success;
+}
+
+/// Convolve an image with a kw x kh integer kernel.
+/// Each pixel (x, y) is substituted by
+///   sum(kernel[j*kw+i] * pixel(x+i-kw/2, y+j-kh/2)) / divisor + bias
+/// over i in [0, kw), j in [0, kh), rounded to nearest (halves up) and
+/// saturated to [0, maxval].  (As usual for image filters, the kernel is
+/// not flipped.)
+/// Pixels outside the image are taken as given by border:
+/// IMAGE_BORDER_CLAMP, IMAGE_BORDER_MIRROR, IMAGE_BORDER_WRAP or
+/// IMAGE_BORDER_ZERO.
+/// Kernels of rank 1 (the product of a column and a row, like most
+/// smoothing kernels) are detected, and applied as a horizontal and a
+/// vertical pass, with kw+kh instead of kw*kh operations per pixel.
+/// Requires: kw and kh odd and positive, divisor > 0,
+/// |kernel[i]| <= 32767 and the sum of all |kernel[i]| below 2^23.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img is not modified.
+int ImageConvolve(Image img, const int* kernel, int kw, int kh,
+                  int divisor, int bias, int border) { ///
+  assert (img != NULL);
+  assert (kernel != NULL);
+  assert (kw > 0 && kw % 2 == 1);
+  assert (kh > 0 && kh % 2 == 1);
+  assert (divisor > 0);
+  assert (IMAGE_BORDER_CLAMP <= border && border <= IMAGE_BORDER_ZERO);
+  long total = 0;
+  for (size_t i = 0; i < (size_t)kw * kh; i++) {
+    assert (-32767 <= kernel[i] && kernel[i] <= 32767);
+    total += abs(kernel[i]);
+  }
+  assert (total <= CONVMAXSUM);
+  (void)total;   // (if NDEBUG)
+  int layout = img->layout;
+  if (!makeWritable(img)) return 0;
+  if (!rowsOf(img)) return 0;
+  int success = convolveRaster(img, kernel, kw, kh, divisor, bias, border);
+  toLayout(img, layout);
+  return success;
+}
+
+
+/// Edge detection
+
+// Sobel gradient of the 3x3 neighbourhood of column x, given the rows
+// above (r0), at (r1) and below (r2), and the columns xl = x-1 and
+// xr = x+1 (clamped to the image).
+static inline void sobelAt(const uint8* r0, const uint8* r1, const uint8* r2,
+                           int xl, int x, int xr, int* gx, int* gy) {
+  *gx = (r0[xr] + 2 * r1[xr] + r2[xr]) - (r0[xl] + 2 * r1[xl] + r2[xl]);
+  *gy = (r2[xl] + 2 * r2[x] + r2[xr]) - (r0[xl] + 2 * r0[x] + r0[xr]);
+}
+
+// Gradient magnitude, L1 norm scaled so that a full-range step edge
+// (gx = 4*PixMax) maps to PixMax, saturated at maxval.
+static inline uint8 sobelMag(int gx, int gy, int maxval) {
+  int m = ((gx < 0 ? -gx : gx) + (gy < 0 ? -gy : gy) + 2) >> 2;
+  return (uint8)(m < maxval ? m : maxval);
+}
+
+// Sobel magnitudes d[0..n-1] of the pixels of row r1, between rows r0 and
+// r2, which are read from index -1 to n.
+static void sobelSpanScalar(const uint8* r0, const uint8* r1, const uint8* r2,
+                            uint8* d, int n, int maxval) {
+  for (int x = 0; x < n; x++) {
+    int gx, gy;
+    sobelAt(r0, r1, r2, x - 1, x, x + 1, &gx, &gy);
+    d[x] = sobelMag(gx, gy, maxval);
+  }
+}
+
+#if defined(__SSE2__)
+// 16 pixels at a time: the three rows are read once per block, and
+// vertical sums (r0+2r1+r2) and differences (r2-r0) at x-1, x, x+1 are
+// kept in 16-bit registers.
+static void sobelSpanSSE2(const uint8* r0, const uint8* r1, const uint8* r2,
+                          uint8* d, int n, int maxval) {
+  int x = 0;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i two = _mm_set1_epi16(2);
+  const __m128i vmax = _mm_set1_epi8((char)maxval);
+  for (; x + 16 <= n; x += 16) {
+    __m128i out[2];
+    for (int half = 0; half < 2; half++) {
+      __m128i vs[3], vd[3];  // at x-1, x, x+1
+      for (int o = 0; o < 3; o++) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(r0 + x - 1 + o));
+        __m128i b = _mm_loadu_si128((const __m128i*)(r1 + x - 1 + o));
+        __m128i c = _mm_loadu_si128((const __m128i*)(r2 + x - 1 + o));
+        if (half == 0) {
+          a = _mm_unpacklo_epi8(a, zero);
+          b = _mm_unpacklo_epi8(b, zero);
+          c = _mm_unpacklo_epi8(c, zero);
+        } else {
+          a = _mm_unpackhi_epi8(a, zero);
+          b = _mm_unpackhi_epi8(b, zero);
+          c = _mm_unpackhi_epi8(c, zero);
+        }
+        vs[o] = _mm_add_epi16(_mm_add_epi16(a, c), _mm_add_epi16(b, b));
+        vd[o] = _mm_sub_epi16(c, a);
+      }
+      __m128i vgx = _mm_sub_epi16(vs[2], vs[0]);
+      __m128i vgy = _mm_add_epi16(_mm_add_epi16(vd[0], vd[2]),
+                                  _mm_add_epi16(vd[1], vd[1]));
+      vgx = _mm_max_epi16(vgx, _mm_sub_epi16(zero, vgx));  // abs
+      vgy = _mm_max_epi16(vgy, _mm_sub_epi16(zero, vgy));
+      out[half] = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(vgx, vgy), two), 2);
+    }
+    __m128i m = _mm_min_epu8(_mm_packus_epi16(out[0], out[1]), vmax);
+    _mm_storeu_si128((__m128i*)(d + x), m);
+  }
+  sobelSpanScalar(r0 + x, r1 + x, r2 + x, d + x, n - x, maxval);
+}
+#endif
+
+// Sobel magnitude of one output row, given the three input rows.
+// (Border pixels are replicated.)
+static void sobelRow(const uint8* r0, const uint8* r1, const uint8* r2,
+                     uint8* d, int w, int maxval) {
+  int gx, gy;
+  if (w == 1) {
+    sobelAt(r0, r1, r2, 0, 0, 0, &gx, &gy);
+    d[0] = sobelMag(gx, gy, maxval);
+    return;
+  }
+  sobelAt(r0, r1, r2, 0, 0, 1, &gx, &gy);
+  d[0] = sobelMag(gx, gy, maxval);
+  K()->sobelSpan(r0 + 1, r1 + 1, r2 + 1, d + 1, w - 2, maxval);
+  sobelAt(r0, r1, r2, w - 2, w - 1, w - 1, &gx, &gy);
+  d[w - 1] = sobelMag(gx, gy, maxval);
+}
+
+// ImageSobel on a raster or aligned image, producing images in the same
+// layout.
+static Image sobelRaster(Image img, Image* dir) {
+  int w = img->width;
+  int h = img->height;
+  size_t s = img->stride;
+  Image mag = ImageCreateLayout(w, h, img->maxval, img->layout);
+  if (mag == NULL) return NULL;
+  if (dir != NULL) {
+    *dir = ImageCreateLayout(w, h, img->maxval, img->layout);
+    if (*dir == NULL) {
+      errsave = errno;
+      ImageDestroy(&mag);
+      errno = errsave;
+      return NULL;
+    }
+  }
+  if (w == 0 || h == 0) return mag;
+
+  for (int y = 0; y < h; y++) {
+    const uint8* r0 = img->pixel + (y > 0 ? y - 1 : 0) * s;
+    const uint8* r1 = img->pixel + y * s;
+    const uint8* r2 = img->pixel + (y < h - 1 ? y + 1 : h - 1) * s;
+    sobelRow(r0, r1, r2, mag->pixel + y * s, w, img->maxval);
+    if (dir != NULL) {
+      uint8* d = (*dir)->pixel + y * s;
+      for (int x = 0; x < w; x++) {
+        int gx, gy;
+        sobelAt(r0, r1, r2, x > 0 ? x - 1 : 0, x, x < w - 1 ? x + 1 : w - 1,
+                &gx, &gy);
+        double a = (atan2(gy, gx) + M_PI) / (2.0 * M_PI);  // in [0, 1]
+        d[x] = roundPixel(a * img->maxval);
+      }
+    }
+  }
+  PIXMEM += 4 * (unsigned long)w * h;  // 3 rows read per output row written
+
+  return mag;
+}
+
+/// Compute the Sobel gradient magnitude of an image.
+/// Returns a new image where each pixel is |gx|+|gy| of the 3x3 Sobel
+/// operator at that position, scaled so that a step from 0 to PixMax gives
+/// PixMax, and saturated at maxval.  Border pixels are replicated.
+/// If dir != NULL, a second new image is created in (*dir) with the
+/// gradient direction atan2(gy, gx) mapped from [-pi, pi) to [0, maxval].
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image(s)!)
+/// On failure, returns NULL (and sets *dir to NULL, if dir != NULL), and
+/// errno/errCause are set accordingly.
+Image ImageSobel(Image img, Image* dir) { ///
+  assert (img != NULL);
+  if (dir != NULL) *dir = NULL;
+  Image copy;
+  Image src = rasterOf(img, &copy);
+  if (src == NULL) return NULL;
+  Image mag = sobelRaster(src, dir);
+  ImageDestroy(&copy);
+  if (mag != NULL && dir != NULL) toLayout(*dir, img->layout);
+  return toLayout(mag, img->layout);
+}
+
+
+/// Resampling
+
+// ImageResize is separable: a horizontal pass filters each row into a
+// 16-bit intermediate image (RSBITS fractional bits), and a vertical pass
+// combines rows of the intermediate into the output.
+// Each output column (or row) is a weighted sum of a few consecutive
+// source columns (rows); weights are fixed-point with RSWBITS fractional
+// bits and always add up to exactly 1.
+#define RSWBITS 14
+#define RSBITS 7
+
+// Filter taps for one axis: output i uses source indices
+// first[i] .. first[i]+count[i]-1, with weights weight[start[i]...].
+struct resampleAxis {
+  int* first;
+  int* count;
+  int* start;
+  int16_t* weight;
+};
+
+static void resampleAxisFree(struct resampleAxis* ax) {
+  free(ax->first);
+  free(ax->count);
+  free(ax->start);
+  free(ax->weight);
+}
+
+// Build the taps to resample n source pixels into m output pixels:
+// area averaging if m < n, bilinear interpolation otherwise.
+// Returns 0 on allocation failure.
+static int resampleAxisInit(struct resampleAxis* ax, int n, int m) {
+  int maxTaps = m < n ? n / m + 2 : 2;
+  ax->first = (int*)malloc(sizeof(int) * m);
+  ax->count = (int*)malloc(sizeof(int) * m);
+  ax->start = (int*)malloc(sizeof(int) * m);
+  ax->weight = (int16_t*)malloc(sizeof(int16_t) * (size_t)m * maxTaps);
+  if (ax->first == NULL || ax->count == NULL || ax->start == NULL ||
+      ax->weight == NULL) {
+    resampleAxisFree(ax);
+    return 0;
+  }
+  int next = 0;
+  for (int i = 0; i < m; i++) {
+    int16_t* wt = ax->weight + next;
+    ax->start[i] = next;
+    if (m < n) {
+      // Output i covers [i*n, (i+1)*n) and source j covers [j*m, (j+1)*m),
+      // both in units of 1/m source pixel.
+      long lo = (long)i * n;
+      long hi = lo + n;
+      int j0 = (int)(lo / m);
+      int j1 = (int)((hi - 1) / m);
+      // Each weight is the difference of the rounded cumulative weights at
+      // the ends of its overlap, so rounding errors do not accumulate, and
+      // weights add up exactly, even when each is less than 1/2 unit.
+      int prev = 0;
+      for (int j = j0; j <= j1; j++) {
+        long b = hi < (long)(j + 1) * m ? hi : (long)(j + 1) * m;
+        int cum = (int)((((b - lo) << RSWBITS) + n / 2) / n);
+        wt[j - j0] = (int16_t)(cum - prev);
+        prev = cum;
+      }
+      ax->first[i] = j0;
+      ax->count[i] = j1 - j0 + 1;
+    } else {
+      // Align pixel centers: output i samples source at (i+0.5)*n/m - 0.5
+      double s = (i + 0.5) * n / m - 0.5;
+      if (s < 0.0) s = 0.0;
+      int j0 = (int)s;
+      if (j0 >= n - 1) {
+        ax->first[i] = n - 1;
+        ax->count[i] = 1;
+        wt[0] = 1 << RSWBITS;
+      } else {
+        int f = (int)((s - j0) * (1 << RSWBITS) + 0.5);
+        ax->first[i] = j0;
+        ax->count[i] = 2;
+        wt[0] = (int16_t)((1 << RSWBITS) - f);
+        wt[1] = (int16_t)f;
+      }
+    }
+    next += ax->count[i];
+  }
+  return 1;
+}
+
+// acc[x] += wgt * t[x] for x in [0, n).
+static void accumulateScalar(uint32_t* acc, const uint16_t* t, int wgt,
+                             int n) {
+  for (int x = 0; x < n; x++) acc[x] += (uint32_t)wgt * t[x];
+}
+
+#if defined(__SSE2__)
+static void accumulateSSE2(uint32_t* acc, const uint16_t* t, int wgt,
+                           int n) {
+  int x = 0;
+  const __m128i vw = _mm_set1_epi16((short)wgt);
+  for (; x + 8 <= n; x += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(t + x));
+    __m128i lo = _mm_mullo_epi16(v, vw);
+    __m128i hi = _mm_mulhi_epu16(v, vw);
+    __m128i p0 = _mm_unpacklo_epi16(lo, hi);
+    __m128i p1 = _mm_unpackhi_epi16(lo, hi);
+    __m128i a0 = _mm_loadu_si128((const __m128i*)(acc + x));
+    __m128i a1 = _mm_loadu_si128((const __m128i*)(acc + x + 4));
+    _mm_storeu_si128((__m128i*)(acc + x), _mm_add_epi32(a0, p0));
+    _mm_storeu_si128((__m128i*)(acc + x + 4), _mm_add_epi32(a1, p1));
+  }
+  accumulateScalar(acc + x, t + x, wgt, n - x);
+}
+#endif
+
+#if defined(KERNELS_X86)
+TARGET("avx2")
+static void accumulateAVX2(uint32_t* acc, const uint16_t* t, int wgt,
+                           int n) {
+  int x = 0;
+  const __m256i vw = _mm256_set1_epi32(wgt);
+  for (; x + 8 <= n; x += 8) {
+    __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(t + x)));
+    __m256i a = _mm256_loadu_si256((const __m256i*)(acc + x));
+    _mm256_storeu_si256((__m256i*)(acc + x),
+                        _mm256_add_epi32(a, _mm256_mullo_epi32(v, vw)));
+  }
+  accumulateScalar(acc + x, t + x, wgt, n - x);
+}
+#endif
+
+// ImageResize on a raster or aligned image, producing an image in the
+// same layout.
+static Image resizeRaster(Image img, int w, int h) {
+  int w1 = img->width;
+  int h1 = img->height;
+  struct resampleAxis ax = {NULL, NULL, NULL, NULL};
+  struct resampleAxis ay = {NULL, NULL, NULL, NULL};
+  uint16_t* tmp = NULL;
+  uint32_t* acc = NULL;
+  Image out = NULL;
+
+  int success =
+  check( resampleAxisInit(&ax, w1, w), "Memory allocation error for resize" ) &&
+  check( resampleAxisInit(&ay, h1, h), "Memory allocation error for resize" ) &&
+  check( (tmp = (uint16_t*)malloc(sizeof(uint16_t) * (size_t)w * h1)) != NULL,
+         "Memory allocation error for resize" ) &&
+  check( (acc = (uint32_t*)malloc(sizeof(uint32_t) * w)) != NULL,
+         "Memory allocation error for resize" ) &&
+  (out = ImageCreateLayout(w, h, img->maxval, img->layout)) != NULL;
+
+  if (success) {
+    // Horizontal pass: rows of img -> rows of tmp
+    // (scalar: the number and position of the taps differ per column)
+    for (int y = 0; y < h1; y++) {
+      const uint8* s = img->pixel + y * img->stride;
+      uint16_t* t = tmp + (size_t)y * w;
+      for (int x = 0; x < w; x++) {
+        const uint8* p = s + ax.first[x];
+        const int16_t* wt = ax.weight + ax.start[x];
+        uint32_t sum = 0;
+        for (int k = 0; k < ax.count[x]; k++) sum += (uint32_t)wt[k] * p[k];
+        t[x] = (uint16_t)((sum + (1u << (RSWBITS - RSBITS - 1))) >> (RSWBITS - RSBITS));
+      }
+    }
+    // Vertical pass: whole rows of tmp are accumulated into each output row
+    for (int y = 0; y < h; y++) {
+      const int16_t* wt = ay.weight + ay.start[y];
+      for (int x = 0; x < w; x++) acc[x] = 0;
+      for (int k = 0; k < ay.count[y]; k++) {
+        K()->accumulate(acc, tmp + (size_t)(ay.first[y] + k) * w, wt[k], w);
+      }
+      uint8* d = out->pixel + y * out->stride;
+      for (int x = 0; x < w; x++) {
+        uint32_t v = (acc[x] + (1u << (RSWBITS + RSBITS - 1))) >> (RSWBITS + RSBITS);
+        d[x] = (uint8)(v < (uint32_t)img->maxval ? v : (uint32_t)img->maxval);
+      }
+    }
+    PIXMEM += (unsigned long)w1 * h1 + (unsigned long)w * h;
+  } else {
+    errsave = errno;
+    ImageDestroy(&out);
+    errno = errsave;
+  }
+
+  resampleAxisFree(&ax);
+  resampleAxisFree(&ay);
+  free(tmp);
+  free(acc);
+  return out;
+}
+
+/// Resize an image.
+/// Returns a new image with width w and height h.
+/// Each axis is reduced by area averaging (each output pixel is the mean of
+/// the source area it covers) or enlarged by bilinear interpolation.
+/// Requires: w > 0, h > 0, and img must not be empty.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h) { ///
+  assert (img != NULL);
+  assert (w > 0 && h > 0);
+  assert (img->width > 0 && img->height > 0);
+  Image copy;
+  Image src = rasterOf(img, &copy);
+  if (src == NULL) return NULL;
+  Image out = resizeRaster(src, w, h);
+  ImageDestroy(&copy);
+  return toLayout(out, img->layout);
+}
+
+// Halve rows r0 and r1, of w pixels, into the n = (w+1)/2 pixels of d,
+// by averaging 2x2 blocks.  The last column of odd-sized rows is averaged
+// with itself.
+static void halveRowScalar(uint8* d, const uint8* r0, const uint8* r1,
+                           int w, int n) {
+  for (int x = 0; x < n; x++) {
+    int x0 = 2 * x;
+    int x1 = 2 * x + 1 < w ? 2 * x + 1 : w - 1;
+    d[x] = (uint8)((r0[x0] + r0[x1] + r1[x0] + r1[x1] + 2) >> 2);
+  }
+}
+
+#if defined(__SSE2__)
+static void halveRowSSE2(uint8* d, const uint8* r0, const uint8* r1,
+                         int w, int n) {
+  int x = 0;
+  // 16 output pixels from 32 input pixels of each row per iteration
+  const __m128i lowByte = _mm_set1_epi16(0x00FF);
+  const __m128i two = _mm_set1_epi16(2);
+  for (; 2 * x + 32 <= w; x += 16) {
+    __m128i s[2];
+    for (int half = 0; half < 2; half++) {
+      __m128i a = _mm_loadu_si128((const __m128i*)(r0 + 2 * x + 16 * half));
+      __m128i b = _mm_loadu_si128((const __m128i*)(r1 + 2 * x + 16 * half));
+      // sum of even and odd bytes of both rows, in 16-bit lanes
+      __m128i sa = _mm_add_epi16(_mm_and_si128(a, lowByte), _mm_srli_epi16(a, 8));
+      __m128i sb = _mm_add_epi16(_mm_and_si128(b, lowByte), _mm_srli_epi16(b, 8));
+      s[half] = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(sa, sb), two), 2);
+    }
+    _mm_storeu_si128((__m128i*)(d + x), _mm_packus_epi16(s[0], s[1]));
+  }
+  halveRowScalar(d + x, r0 + 2 * x, r1 + 2 * x, w - 2 * x, n - x);
+}
+#endif
+
+#if defined(KERNELS_X86)
+TARGET("avx2")
+static void halveRowAVX2(uint8* d, const uint8* r0, const uint8* r1,
+                         int w, int n) {
+  int x = 0;
+  // 32 output pixels from 64 input pixels of each row per iteration
+  const __m256i lowByte = _mm256_set1_epi16(0x00FF);
+  const __m256i two = _mm256_set1_epi16(2);
+  for (; 2 * x + 64 <= w; x += 32) {
+    __m256i s[2];
+    for (int half = 0; half < 2; half++) {
+      __m256i a = _mm256_loadu_si256((const __m256i*)(r0 + 2 * x + 32 * half));
+      __m256i b = _mm256_loadu_si256((const __m256i*)(r1 + 2 * x + 32 * half));
+      __m256i sa = _mm256_add_epi16(_mm256_and_si256(a, lowByte), _mm256_srli_epi16(a, 8));
+      __m256i sb = _mm256_add_epi16(_mm256_and_si256(b, lowByte), _mm256_srli_epi16(b, 8));
+      s[half] = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(sa, sb), two), 2);
+    }
+    // (packus works within 128-bit lanes: put the quarters back in order)
+    __m256i p = _mm256_packus_epi16(s[0], s[1]);
+    _mm256_storeu_si256((__m256i*)(d + x), _mm256_permute4x64_epi64(p, 0xD8));
+  }
+  halveRowScalar(d + x, r0 + 2 * x, r1 + 2 * x, w - 2 * x, n - x);
+}
+#endif
+
+// Halve src into dst (of size (w+1)/2 x (h+1)/2) by averaging 2x2 blocks.
+// The last column/row of odd-sized images is averaged with itself.
+// (Both are raster or aligned.)
+static void halveImage(Image src, Image dst) {
+  int w = src->width;
+  int h = src->height;
+  int w2 = dst->width;
+  size_t s = src->stride;
+  for (int y = 0; y < dst->height; y++) {
+    const uint8* r0 = src->pixel + (2 * y) * s;
+    const uint8* r1 = src->pixel + (2 * y + 1 < h ? 2 * y + 1 : h - 1) * s;
+    K()->halveRow(dst->pixel + y * dst->stride, r0, r1, w, w2);
+  }
+  PIXMEM += (unsigned long)w * h + (unsigned long)w2 * dst->height;
+}
+
+/// Build an image pyramid.
+/// Fills pyramid[0], pyramid[1], ... with successively halved versions of
+/// img: pyramid[0] is img halved, pyramid[1] is pyramid[0] halved, etc.
+/// Each level has dimensions ((w+1)/2, (h+1)/2) of the previous one and
+/// each pixel is the mean of a 2x2 block.  Stops after levels images or
+/// after producing a 1x1 image, whichever comes first.
+/// Requires: levels >= 0, img must not be empty, and pyramid must have
+/// room for levels images.
+/// Ensures: The original img is not modified.
+///
+/// On success, returns the number of levels created.
+/// (The caller is responsible for destroying the returned images!)
+/// On failure, returns -1, no images are left allocated, and
+/// errno/errCause are set accordingly.
+int ImageBuildPyramid(Image img, int levels, Image pyramid[]) { ///
+  assert (img != NULL);
+  assert (levels >= 0);
+  assert (img->width > 0 && img->height > 0);
+  assert (pyramid != NULL || levels == 0);
+  Image copy;
+  Image prev = rasterOf(img, &copy);
+  if (prev == NULL) return -1;
+  int n = 0;
+  while (n < levels && (prev->width > 1 || prev->height > 1)) {
+    pyramid[n] = ImageCreateLayout((prev->width + 1) / 2,
+                                   (prev->height + 1) / 2, img->maxval,
+                                   prev->layout);
+    if (pyramid[n] == NULL) {
+      errsave = errno;
+      while (n > 0) ImageDestroy(&pyramid[--n]);
+      ImageDestroy(&copy);
+      errno = errsave;
+      return -1;
+    }
+    halveImage(prev, pyramid[n]);
+    prev = pyramid[n];
+    n++;
+  }
+  ImageDestroy(&copy);
+  for (int i = 0; i < n; i++) toLayout(pyramid[i], img->layout);
+  return n;
+}
+
+
+/// Affine transformations
+
+// ImageAffine maps each output pixel center back to the source image.
+// Source coordinates are stepped incrementally along each output row in
+// 48.16 fixed point; they are recomputed exactly at the start of each row
+// of each WARPTILE x WARPTILE output tile, which bounds the accumulated
+// rounding error and keeps the source footprint of consecutive rows close
+// together (rotations otherwise walk across many source rows per row).
+#define WARPTILE 64
+#define WARPFRAC 16
+
+// Bilinear interpolation of n pixels, given their 4 neighbours
+// (p00 p01 / p10 p11) and 8-bit fractional offsets fx, fy.
+// The horizontal interpolation is rounded to 8 bits before the vertical
+// one, so that everything fits in 16-bit lanes.
+static void bilinearScalar(uint8* d, const uint8* p00, const uint8* p01,
+                           const uint8* p10, const uint8* p11,
+                           const uint8* fx, const uint8* fy, int n) {
+  for (int i = 0; i < n; i++) {
+    int top = (p00[i] * (256 - fx[i]) + p01[i] * fx[i] + 128) >> 8;
+    int bot = (p10[i] * (256 - fx[i]) + p11[i] * fx[i] + 128) >> 8;
+    d[i] = (uint8)((top * (256 - fy[i]) + bot * fy[i] + 128) >> 8);
+  }
+}
+
+#if defined(__SSE2__)
+static void bilinearSSE2(uint8* d, const uint8* p00, const uint8* p01,
+                         const uint8* p10, const uint8* p11,
+                         const uint8* fx, const uint8* fy, int n) {
+  int i = 0;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i v256 = _mm_set1_epi16(256);
+  const __m128i v128 = _mm_set1_epi16(128);
+  for (; i + 8 <= n; i += 8) {
+    #define LOAD8(p) _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)((p) + i)), zero)
+    __m128i a = LOAD8(p00), b = LOAD8(p01), c = LOAD8(p10), e = LOAD8(p11);
+    __m128i wx = LOAD8(fx), wy = LOAD8(fy);
+    #undef LOAD8
+    __m128i ix = _mm_sub_epi16(v256, wx);
+    __m128i top = _mm_add_epi16(_mm_mullo_epi16(a, ix), _mm_mullo_epi16(b, wx));
+    __m128i bot = _mm_add_epi16(_mm_mullo_epi16(c, ix), _mm_mullo_epi16(e, wx));
+    top = _mm_srli_epi16(_mm_add_epi16(top, v128), 8);
+    bot = _mm_srli_epi16(_mm_add_epi16(bot, v128), 8);
+    __m128i r = _mm_add_epi16(_mm_mullo_epi16(top, _mm_sub_epi16(v256, wy)),
+                              _mm_mullo_epi16(bot, wy));
+    r = _mm_srli_epi16(_mm_add_epi16(r, v128), 8);
+    _mm_storel_epi64((__m128i*)(d + i), _mm_packus_epi16(r, zero));
+  }
+  bilinearScalar(d + i, p00 + i, p01 + i, p10 + i, p11 + i, fx + i, fy + i,
+                 n - i);
+}
+#endif
+
+#if defined(KERNELS_X86)
+TARGET("avx2")
+static void bilinearAVX2(uint8* d, const uint8* p00, const uint8* p01,
+                         const uint8* p10, const uint8* p11,
+                         const uint8* fx, const uint8* fy, int n) {
+  int i = 0;
+  const __m256i v256 = _mm256_set1_epi16(256);
+  const __m256i v128 = _mm256_set1_epi16(128);
+  for (; i + 16 <= n; i += 16) {
+    #define LOAD16(p) _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)((p) + i)))
+    __m256i a = LOAD16(p00), b = LOAD16(p01), c = LOAD16(p10), e = LOAD16(p11);
+    __m256i wx = LOAD16(fx), wy = LOAD16(fy);
+    #undef LOAD16
+    __m256i ix = _mm256_sub_epi16(v256, wx);
+    __m256i top = _mm256_add_epi16(_mm256_mullo_epi16(a, ix), _mm256_mullo_epi16(b, wx));
+    __m256i bot = _mm256_add_epi16(_mm256_mullo_epi16(c, ix), _mm256_mullo_epi16(e, wx));
+    top = _mm256_srli_epi16(_mm256_add_epi16(top, v128), 8);
+    bot = _mm256_srli_epi16(_mm256_add_epi16(bot, v128), 8);
+    __m256i r = _mm256_add_epi16(_mm256_mullo_epi16(top, _mm256_sub_epi16(v256, wy)),
+                                 _mm256_mullo_epi16(bot, wy));
+    r = _mm256_srli_epi16(_mm256_add_epi16(r, v128), 8);
+    // (packus works within 128-bit lanes: gather the low halves)
+    __m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi16(r, r), 0xD8);
+    _mm_storeu_si128((__m128i*)(d + i), _mm256_castsi256_si128(p));
+  }
+  bilinearScalar(d + i, p00 + i, p01 + i, p10 + i, p11 + i, fx + i, fy + i,
+                 n - i);
+}
+#endif
+
+// ImageAffine on a raster or aligned image, producing an image in the
+// same layout.
+static Image affineRaster(Image img, const double m[6], int w, int h,
+                          int bilinear) {
+  double det = m[0] * m[4] - m[1] * m[3];
+  Image out = ImageCreateLayout(w, h, img->maxval, img->layout);
+  if (out == NULL) return NULL;
+  int sw = img->width;
+  int sh = img->height;
+  size_t ss = img->stride;
+  if (sw == 0 || sh == 0) return out;
+
+  // Inverse mapping: output (X, Y) -> source (ia*X + ib*Y + ic, ...)
+  double ia = m[4] / det, ib = -m[1] / det;
+  double id = -m[3] / det, ie = m[0] / det;
+  double ic = -(ia * m[2] + ib * m[5]);
+  double iff = -(id * m[2] + ie * m[5]);
+  // Bilinear interpolation works in pixel-center coordinates
+  double shift = bilinear ? 0.5 : 0.0;
+  const double one = (double)(1 << WARPFRAC);
+  int64_t du = (int64_t)llround(ia * one);
+  int64_t dv = (int64_t)llround(id * one);
+  int64_t uMin = bilinear ? -(1 << (WARPFRAC - 1)) : 0;
+  int64_t vMin = uMin;
+  int64_t uEnd = ((int64_t)sw << WARPFRAC) + uMin;
+  int64_t vEnd = ((int64_t)sh << WARPFRAC) + vMin;
+
+  uint8 p00[WARPTILE], p01[WARPTILE], p10[WARPTILE], p11[WARPTILE];
+  uint8 fx[WARPTILE], fy[WARPTILE];
+  for (int ty = 0; ty < h; ty += WARPTILE) {
+    for (int tx = 0; tx < w; tx += WARPTILE) {
+      int tw = w - tx < WARPTILE ? w - tx : WARPTILE;
+      int th = h - ty < WARPTILE ? h - ty : WARPTILE;
+      for (int y = ty; y < ty + th; y++) {
+        double X = tx + 0.5, Y = y + 0.5;
+        int64_t u = (int64_t)llround((ia * X + ib * Y + ic - shift) * one);
+        int64_t v = (int64_t)llround((id * X + ie * Y + iff - shift) * one);
+        uint8* d = out->pixel + y * out->stride + tx;
+        if (!bilinear) {
+          for (int i = 0; i < tw; i++, u += du, v += dv) {
+            if (u >= 0 && u < uEnd && v >= 0 && v < vEnd) {
+              d[i] = img->pixel[(size_t)(v >> WARPFRAC) * ss + (size_t)(u >> WARPFRAC)];
+            }
+          }
+          continue;
+        }
+        // Gather the 4 neighbours of every sample, then interpolate all
+        // of them at once.  Samples outside img get all-black neighbours.
+        for (int i = 0; i < tw; i++, u += du, v += dv) {
+          if (u >= uMin && u < uEnd && v >= vMin && v < vEnd) {
+            int64_t x0 = u >> WARPFRAC;   // floor, in [-1, sw-1]
+            int64_t y0 = v >> WARPFRAC;
+            int64_t x1 = x0 + 1 < sw ? x0 + 1 : sw - 1;
+            int64_t y1 = y0 + 1 < sh ? y0 + 1 : sh - 1;
+            if (x0 < 0) x0 = 0;
+            if (y0 < 0) y0 = 0;
+            const uint8* r0 = img->pixel + (size_t)y0 * ss;
+            const uint8* r1 = img->pixel + (size_t)y1 * ss;
+            p00[i] = r0[x0]; p01[i] = r0[x1];
+            p10[i] = r1[x0]; p11[i] = r1[x1];
+            fx[i] = (uint8)((u >> (WARPFRAC - 8)) & 0xFF);
+            fy[i] = (uint8)((v >> (WARPFRAC - 8)) & 0xFF);
+          } else {
+            p00[i] = p01[i] = p10[i] = p11[i] = 0;
+            fx[i] = fy[i] = 0;
+          }
+        }
+        K()->bilinear(d, p00, p01, p10, p11, fx, fy, tw);
+      }
+    }
+  }
+  PIXMEM += (unsigned long)w * h * (bilinear ? 5 : 2);
+
+  return out;
+}
+
+/// Apply an affine transformation to an image.
+/// Returns a new image with width w and height h, where the point (x, y)
+/// of img is moved to
+///   (m[0]*x + m[1]*y + m[2], m[3]*x + m[4]*y + m[5]).
+/// Coordinates are continuous: pixel (i, j) covers [i, i+1)x[j, j+1).
+/// Each output pixel is sampled from img with nearest neighbour or, if
+/// bilinear is nonzero, bilinear interpolation.  Output pixels that come
+/// from outside img are black (0).
+/// Requires: w >= 0, h >= 0, and the matrix must be invertible.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageAffine(Image img, const double m[6], int w, int h, int bilinear) { ///
+  assert (img != NULL);
+  assert (m != NULL);
+  assert (w >= 0 && h >= 0);
+  assert (m[0] * m[4] - m[1] * m[3] != 0.0);
+  Image copy;
+  Image src = rasterOf(img, &copy);
+  if (src == NULL) return NULL;
+  Image out = affineRaster(src, m, w, h, bilinear);
+  ImageDestroy(&copy);
+  return toLayout(out, img->layout);
+}
+
+/// Rotate an image by an arbitrary angle.
+/// Returns a version of the image rotated counter-clockwise (as displayed)
+/// by the given angle in degrees around its center, so that
+/// ImageRotateAngle(img, 90.0, 0) equals ImageRotate(img).
+/// The new image is just large enough to hold the whole rotated image;
+/// uncovered areas are black (0).
+/// Sampling is nearest neighbour or, if bilinear is nonzero, bilinear.
+/// Ensures: The original img is not modified.
+///
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageRotate(Image img) { ///
+Image ImageRotateAngle(Image img, double degrees, int bilinear) { ///
   assert (img != NULL);
-  int width = img->width;
-  int height = img->height;
-  uint8 maxval = img->maxval;
+  double t = degrees * M_PI / 180.0;
+  double c = cos(t);
+  double s = sin(t);
+  int w = img->width;
+  int h = img->height;
+  // Bounding box of the rotated image (tolerating rounding errors)
+  int w2 = (int)ceil(fabs(w * c) + fabs(h * s) - 1e-6);
+  int h2 = (int)ceil(fabs(w * s) + fabs(h * c) - 1e-6);
+  if (w2 < 0) w2 = 0;
+  if (h2 < 0) h2 = 0;
+  // Rotate about the center: (x,y) -> (c*dx + s*dy, -s*dx + c*dy) + center2
+  double cx = w / 2.0, cy = h / 2.0;
+  double cx2 = w2 / 2.0, cy2 = h2 / 2.0;
+  double m[6] = {
+     c, s, cx2 - c * cx - s * cy,
+    -s, c, cy2 + s * cx - c * cy,
+  };
+  return ImageAffine(img, m, w2, h2, bilinear);
+}
 
-  // Criar uma nova imagem com dimensões trocadas para a rotação
-  Image rotatedImage = ImageCreate(height, width, maxval);
-  if (rotatedImage == NULL) {
-    errCause = "Memory allocation error for rotated image";
-	return NULL;
+
+/// Binary images
+
+// A binary image stores one bit per pixel: 1 for white, 0 for black.
+// Rows are packed in 64-bit words, pixel x of a row in bit x%64 of word
+// x/64 (so that shifts along a row are shifts across words), and padded
+// to whole words with 0 bits.
+// (In PBM files, 1 means black, and the leftmost pixel is the most
+// significant bit of each byte: BitImageLoad/Save convert.)
+
+struct bitimage {
+  int width;
+  int height;
+  int stride;       // words per row
+  uint64_t* bits;   // height * stride words
+};
+
+// Words needed for n bits
+static inline int bitWords(int n) {
+  return (n + 63) >> 6;
+}
+
+// Mask of the valid bits of the last word of a row of width w
+static inline uint64_t lastWordMask(int w) {
+  return (w & 63) == 0 ? ~(uint64_t)0 : ((uint64_t)1 << (w & 63)) - 1;
+}
+
+// Pointer to row y of img
+static inline uint64_t* bitRow(BitImage img, int y) {
+  return img->bits + (size_t)y * img->stride;
+}
+
+/// Create a new binary image, all black (0).
+/// Requires: width and height must be non-negative.
+///
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying it with BitImageDestroy!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageCreate(int width, int height) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  BitImage img = (BitImage)malloc(sizeof(struct bitimage));
+  if (img == NULL) {
+    errCause = "Memory allocation error";
+    return NULL;
   }
-  for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            // Obter o valor do pixel da imagem original
-            uint8 currentPixel = ImageGetPixel(img, j, i);
-            // Preencher a nova imagem com os valores rotacionados
-            ImageSetPixel(rotatedImage, i, width - j - 1, currentPixel);
-        }
+  img->width = width;
+  img->height = height;
+  img->stride = bitWords(width);
+  img->bits = (uint64_t*)calloc((size_t)height * img->stride + 1, sizeof(uint64_t));
+  if (img->bits == NULL) {
+    free(img);
+    errCause = "Memory allocation error for pixel data";
+    return NULL;
+  }
+  return img;
+}
+
+/// Destroy the binary image pointed to by (*imgp).
+/// If (*imgp)==NULL, no operation is performed.
+/// Ensures: (*imgp)==NULL.
+void BitImageDestroy(BitImage* imgp) { ///
+  assert (imgp != NULL);
+  if (*imgp != NULL) {
+    free((*imgp)->bits);
+    free(*imgp);
+    *imgp = NULL;
+  }
+}
+
+/// Width of a binary image.
+int BitImageWidth(BitImage img) { ///
+  assert (img != NULL);
+  return img->width;
+}
+
+/// Height of a binary image.
+int BitImageHeight(BitImage img) { ///
+  assert (img != NULL);
+  return img->height;
+}
+
+/// Get the pixel (0 or 1) at position (x,y).
+int BitImageGetPixel(BitImage img, int x, int y) { ///
+  assert (img != NULL);
+  assert (0 <= x && x < img->width && 0 <= y && y < img->height);
+  return (int)(bitRow(img, y)[x >> 6] >> (x & 63)) & 1;
+}
+
+/// Set the pixel at position (x,y) to bit (0 or nonzero for 1).
+void BitImageSetPixel(BitImage img, int x, int y, int bit) { ///
+  assert (img != NULL);
+  assert (0 <= x && x < img->width && 0 <= y && y < img->height);
+  uint64_t* w = bitRow(img, y) + (x >> 6);
+  uint64_t m = (uint64_t)1 << (x & 63);
+  *w = bit ? *w | m : *w & ~m;
+}
+
+// Pack blocks of 64 pixels p[0..64*blocks-1] into the bits of row[0..
+// blocks-1]: bit i of a word is set if the pixel is >= thr.
+static void packBlocksScalar(uint64_t* row, const uint8* p, int blocks,
+                             uint8 thr) {
+  for (int b = 0; b < blocks; b++, p += 64) {
+    uint64_t word = 0;
+    for (int i = 0; i < 64; i++) word |= (uint64_t)(p[i] >= thr) << i;
+    row[b] = word;
+  }
+}
+
+#if defined(__SSE2__)
+static void packBlocksSSE2(uint64_t* row, const uint8* p, int blocks,
+                           uint8 thr) {
+  // p >= thr  <=>  max(p, thr) == p, for 16 pixels; movemask packs them
+  __m128i t = _mm_set1_epi8((char)thr);
+  for (int b = 0; b < blocks; b++, p += 64) {
+    uint64_t word = 0;
+    for (int k = 0; k < 4; k++) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(p + 16 * k));
+      __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(v, t), v);
+      word |= (uint64_t)(uint16_t)_mm_movemask_epi8(ge) << (16 * k);
     }
+    row[b] = word;
+  }
+}
+#endif
 
-    return rotatedImage;
+#if defined(KERNELS_X86)
+TARGET("avx2")
+static void packBlocksAVX2(uint64_t* row, const uint8* p, int blocks,
+                           uint8 thr) {
+  __m256i t = _mm256_set1_epi8((char)thr);
+  for (int b = 0; b < blocks; b++, p += 64) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i*)p);
+    __m256i v1 = _mm256_loadu_si256((const __m256i*)(p + 32));
+    __m256i ge0 = _mm256_cmpeq_epi8(_mm256_max_epu8(v0, t), v0);
+    __m256i ge1 = _mm256_cmpeq_epi8(_mm256_max_epu8(v1, t), v1);
+    row[b] = (uint64_t)(uint32_t)_mm256_movemask_epi8(ge0) |
+             (uint64_t)(uint32_t)_mm256_movemask_epi8(ge1) << 32;
+  }
+}
+
+// (A whole block is a single compare into a 64-bit mask.)
+TARGET("avx512f,avx512bw")
+static void packBlocksAVX512(uint64_t* row, const uint8* p, int blocks,
+                             uint8 thr) {
+  __m512i t = _mm512_set1_epi8((char)thr);
+  for (int b = 0; b < blocks; b++, p += 64) {
+    row[b] = _mm512_cmpge_epu8_mask(_mm512_loadu_si512(p), t);
+  }
+}
+#endif
+
+// Threshold-and-pack rows of a raster or aligned image
+// (see ImageThresholdBits)
+struct packArg {
+  Image img;
+  BitImage bin;
+  uint8 thr;
+};
 
+static void packRows(void* arg, int y0, int y1) {
+  struct packArg* a = (struct packArg*)arg;
+  int w = a->img->width;
+  // Aligned rows are padded to whole blocks: the padded tail is packed as
+  // a block, and its extra bits are cleared.
+  int aligned = a->img->layout == IMAGE_ALIGNED;
+  int blocks = aligned ? (w + 63) / 64 : w / 64;
+  for (int y = y0; y < y1; y++) {
+    const uint8* p = a->img->pixel + (size_t)y * a->img->stride;
+    uint64_t* row = bitRow(a->bin, y);
+    K()->packBlocks(row, p, blocks, a->thr);
+    if (aligned) {
+      if (w > 0) row[(w - 1) >> 6] &= lastWordMask(w);
+    } else if (w % 64 != 0) {
+      uint64_t word = 0;
+      for (int x = 64 * blocks; x < w; x++) {
+        word |= (uint64_t)(p[x] >= a->thr) << (x & 63);
+      }
+      row[blocks] = word;
+    }
+  }
 }
 
-/// Mirror an image = flip left-right.
-/// Returns a mirrored version of the image.
+/// Threshold an image into a new binary image.
+/// Pixels with level>=thr become white (1), and the others black (0),
+/// as in ImageThreshold.
 /// Ensures: The original img is not modified.
-/// 
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
+///
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying it with BitImageDestroy!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageMirror(Image img) { ///
+BitImage ImageThresholdBits(Image img, uint8 thr) { ///
   assert (img != NULL);
-  int width = img->width;
-    int height = img->height;
-    uint8 maxval = img->maxval;
+  Image copy = NULL;
+  Image src = rasterOf(img, &copy);
+  if (src == NULL) return NULL;
+  BitImage bin = BitImageCreate(img->width, img->height);
+  if (bin != NULL) {
+    struct packArg a = { src, bin, thr };
+    parallelFor(img->height, (size_t)img->width * img->height, packRows, &a);
+    PIXMEM += (unsigned long)img->width * img->height;
+  }
+  errsave = errno;
+  ImageDestroy(&copy);
+  errno = errsave;
+  return bin;
+}
 
-    // Cria uma nova imagem
-    Image mirroredImage = ImageCreate(width, height, maxval);
-    if (mirroredImage == NULL) {
-        errCause = "Memory allocation error for mirrored image";
-        return NULL;
-    }
+// Unpack rows of a binary image (see BitImageToImage)
+struct unpackArg {
+  BitImage bin;
+  Image img;
+  uint64_t expand[256];   // byte b -> 8 pixel bytes (maxval for its 1 bits)
+};
 
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            // Obtém o valor do pixel da imagem original
-            uint8 currentPixel = ImageGetPixel(img, j, i);
-            // Preenche a nova imagem com os valores refletidos horizontalmente
-            ImageSetPixel(mirroredImage, width - j - 1, i, currentPixel);
-        }
+static void unpackRows(void* arg, int y0, int y1) {
+  struct unpackArg* a = (struct unpackArg*)arg;
+  int w = a->bin->width;
+  for (int y = y0; y < y1; y++) {
+    const uint64_t* row = bitRow(a->bin, y);
+    uint8* p = a->img->pixel + (size_t)y * w;
+    int x = 0;
+    for (; x + 8 <= w; x += 8) {
+      memcpy(p + x, &a->expand[(row[x >> 6] >> (x & 63)) & 0xFF], 8);
     }
-
-    return mirroredImage;
+    for (; x < w; x++) p[x] = (row[x >> 6] >> (x & 63) & 1) ? a->img->maxval : 0;
+  }
 }
 
-/// Crop a rectangular subimage from img.
-/// The rectangle is specified by the top left corner coords (x, y) and
-/// width w and height h.
-/// Requires:
-///   The rectangle must be inside the original image.
-/// Ensures:
-///   The original img is not modified.
-///   The returned image has width w and height h.
-/// 
+/// Convert a binary image to a new 8-bit image, with white (1) pixels set
+/// to maxval and black (0) pixels set to 0.
+/// Requires: maxval > 0.
+///
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCrop(Image img, int x, int y, int w, int h) { ///
-  assert (img != NULL);
-  assert (ImageValidRect(img, x, y, w, h));
-  uint8 maxval = img->maxval;
-    // Cria uma nova imagem com as dimensões do recorte
-    Image croppedImage = ImageCreate(w, h, maxval);
-    if (croppedImage == NULL) {
-        errCause = "Memory allocation error for cropped image";
-        return NULL;
-    }
-
-    for (int i = 0; i < h; i++) {
-        for (int j = 0; j < w; j++) {
-            // Obtém o valor do pixel da imagem original na área recortada
-            uint8 currentPixel = ImageGetPixel(img, x + j, y + i);
-            // Preenche a nova imagem com os valores da área recortada
-            ImageSetPixel(croppedImage, j, i, currentPixel);
-        }
-    }
+Image BitImageToImage(BitImage bin, uint8 maxval) { ///
+  assert (bin != NULL);
+  assert (maxval > 0);
+  Image img = ImageCreate(bin->width, bin->height, maxval);
+  if (img == NULL) return NULL;
+  struct unpackArg a;
+  a.bin = bin;
+  a.img = img;
+  for (int b = 0; b < 256; b++) {
+    uint8 v[8];   // (in memory order, for any byte order)
+    for (int i = 0; i < 8; i++) v[i] = (b >> i & 1) ? maxval : 0;
+    memcpy(&a.expand[b], v, 8);
+  }
+  parallelFor(bin->height, (size_t)bin->width * bin->height, unpackRows, &a);
+  PIXMEM += (unsigned long)bin->width * bin->height;
+  return img;
+}
 
-    return croppedImage;
+// Logical operations on whole binary images
+enum { BIT_AND, BIT_OR, BIT_XOR };
+
+static void bitOp(BitImage a, BitImage b, int op) {
+  assert (a != NULL);
+  assert (b != NULL);
+  assert (a->width == b->width && a->height == b->height);
+  size_t n = (size_t)a->height * a->stride;
+  uint64_t* p = a->bits;
+  const uint64_t* q = b->bits;
+  switch (op) {
+  case BIT_AND: for (size_t i = 0; i < n; i++) p[i] &= q[i]; break;
+  case BIT_OR:  for (size_t i = 0; i < n; i++) p[i] |= q[i]; break;
+  default:      for (size_t i = 0; i < n; i++) p[i] ^= q[i]; break;
+  }
 }
 
+/// Bitwise operations
+/// These modify img1 in-place, combining it with img2, of the same size.
+/// Requires: img1 and img2 have the same size.
 
-/// Operations on two images
+/// img1 = img1 AND img2.
+void BitImageAnd(BitImage img1, BitImage img2) { ///
+  bitOp(img1, img2, BIT_AND);
+}
 
-/// Paste an image into a larger image.
-/// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
-/// Requires: img2 must fit inside img1 at position (x, y).
-void ImagePaste(Image img1, int x, int y, Image img2) { ///
-  assert (img1 != NULL);
-  assert (img2 != NULL);
-  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
-  int width2 = img2->width;
-    int height2 = img2->height;
-	img1->maxval = img1->maxval > img2->maxval ? img1->maxval : img2->maxval; // O valor máximo da imagem maior será o maior entre os valores máximos das duas imagens
-    for (int i = 0; i < height2; i++) {
-        for (int j = 0; j < width2; j++) {
-            // Obtém o valor do pixel da imagem a ser colada
-            uint8 currentPixel = ImageGetPixel(img2, j, i);
-            // Preenche a imagem maior na posição correta com os valores da imagem a ser colada
-            ImageSetPixel(img1, x + j, y + i, currentPixel);
-        }
+/// img1 = img1 OR img2.
+void BitImageOr(BitImage img1, BitImage img2) { ///
+  bitOp(img1, img2, BIT_OR);
+}
+
+/// img1 = img1 XOR img2.
+void BitImageXor(BitImage img1, BitImage img2) { ///
+  bitOp(img1, img2, BIT_XOR);
+}
+
+/// Invert all pixels of img.
+void BitImageNot(BitImage img) { ///
+  assert (img != NULL);
+  if (img->stride == 0) return;
+  uint64_t last = lastWordMask(img->width);
+  for (int y = 0; y < img->height; y++) {
+    uint64_t* row = bitRow(img, y);
+    for (int i = 0; i < img->stride; i++) row[i] = ~row[i];
+    row[img->stride - 1] &= last;   // keep padding bits 0
+  }
+}
+
+/// Count the white (1) pixels of img.
+size_t BitImageCount(BitImage img) { ///
+  assert (img != NULL);
+  size_t n = (size_t)img->height * img->stride;
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) count += (size_t)__builtin_popcountll(img->bits[i]);
+  return count;
+}
+
+// Copy n bits from src (starting at bit 0) to dst, starting at bit pos.
+// Other bits of dst are not changed.
+static void copyBits(uint64_t* dst, int pos, const uint64_t* src, int n) {
+  int s = pos & 63;
+  uint64_t* d = dst + (pos >> 6);
+  for (int k = 0; n > 0; k++, n -= 64) {
+    uint64_t m = n >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+    uint64_t v = src[k] & m;
+    d[k] = (d[k] & ~(m << s)) | (v << s);
+    if (s != 0 && (m >> (64 - s)) != 0) {
+      d[k+1] = (d[k+1] & ~(m >> (64 - s))) | (v >> (64 - s));
     }
+  }
 }
 
-/// Blend an image into a larger image.
-/// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// Paste binary image img2 into position (x, y) of img1.
 /// Requires: img2 must fit inside img1 at position (x, y).
-/// alpha usually is in [0.0, 1.0], but values outside that interval
-/// may provide interesting effects.  Over/underflows should saturate.
-void ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
+void BitImagePaste(BitImage img1, int x, int y, BitImage img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
-  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
-
-  int width2 = img2->width;
-    int height2 = img2->height;
-	img1->maxval = img1->maxval > img2->maxval ? img1->maxval : img2->maxval; // O valor máximo da imagem maior será o maior entre os valores máximos das duas imagens
+  assert (0 <= x && x + img2->width <= img1->width);
+  assert (0 <= y && y + img2->height <= img1->height);
+  for (int i = 0; i < img2->height; i++) {
+    copyBits(bitRow(img1, y + i), x, bitRow(img2, i), img2->width);
+  }
+}
 
-    for (int i = 0; i < height2; i++) {
-        for (int j = 0; j < width2; j++) {
-            // Obtém o valor do pixel das duas imagens
-            uint8 pixel1 = ImageGetPixel(img1, x + j, y + i);
-            uint8 pixel2 = ImageGetPixel(img2, j, i);
+// Binary morphology
+//
+// A (2r+1) window min (erosion: AND) or max (dilation: OR) along a row is
+// computed on a copy of the row padded by r bits of identity (1 for AND,
+// 0 for OR) on each side, by doubling: after combining the line with
+// itself shifted by 1, 2, 4, ... bits, bit i covers bits [i, i+len), so
+// log2(2r+1) shifts of whole words suffice.  Columns are done the same way,
+// combining whole rows.
 
-            // Calcula o novo valor do pixel após a mesclagem
-            double _blendedPixel = alpha * pixel2 + (1.0 - alpha) * pixel1;
-			uint8 blendedPixel = roundPixel(_blendedPixel); // Arredondamento (saturação
+// a[i] = a[i] op a[i+k], for bit arrays of n words (bits past the end
+// count as 0: only results that do not depend on them are used).
+static void bitShiftOp(uint64_t* a, int n, int k, int isOr) {
+  int q = k >> 6;
+  int s = k & 63;
+  for (int j = 0; j < n; j++) {
+    uint64_t lo = j + q < n ? a[j + q] : 0;
+    uint64_t hi = j + q + 1 < n ? a[j + q + 1] : 0;
+    uint64_t v = s == 0 ? lo : (lo >> s) | (hi << (64 - s));
+    a[j] = isOr ? a[j] | v : a[j] & v;
+  }
+}
 
-            // Satura o valor resultante para o intervalo [0, maxval]
-            uint8 finalPixel = (blendedPixel > img1->maxval) ? img1->maxval : (uint8)blendedPixel;
+// Combine the len-bit (or len-row) windows of line a of n words (or of
+// rows, each of stride words) by doubling.
+static void bitWindow(uint64_t* a, int n, int len, int isOr) {
+  int have = 1;
+  while (2 * have <= len) {
+    bitShiftOp(a, n, have, isOr);
+    have *= 2;
+  }
+  if (have < len) bitShiftOp(a, n, len - have, isOr);
+}
 
-            // Atualiza o pixel na imagem maior (img1)
-            ImageSetPixel(img1, x + j, y + i, finalPixel);
-        }
+// Same along columns: rows of stride words, row i+k combined into row i.
+static void rowWindow(uint64_t* a, int rows, int stride, int len, int isOr) {
+  int have = 1;
+  while (have < len) {
+    int k = 2 * have <= len ? have : len - have;
+    for (int i = 0; i + k < rows; i++) {
+      uint64_t* r = a + (size_t)i * stride;
+      const uint64_t* r2 = r + (size_t)k * stride;
+      if (isOr) for (int j = 0; j < stride; j++) r[j] |= r2[j];
+      else for (int j = 0; j < stride; j++) r[j] &= r2[j];
     }
+    have += k;
+  }
 }
 
-/// Compare an image to a subimage of a larger image.
-/// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
-/// Returns 0, otherwise.
-int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
-  assert (img1 != NULL);
-  assert (img2 != NULL);
-  assert (ImageValidPos(img1, x, y));
-  
-  int width2 = img2->width;
-    int height2 = img2->height;
-
-    // Verifica se a subimagem cabe dentro da imagem maior
-    if (!ImageValidRect(img1, x, y, width2, height2)) {
-        return 0;
-    }
-
-    for (int i = 0; i < height2; i++) {
-        for (int j = 0; j < width2; j++) {
-            // Obtém o valor do pixel das duas imagens
-            uint8 pixel1 = ImageGetPixel(img1, x + j, y + i);
-            uint8 pixel2 = ImageGetPixel(img2, j, i);
-            //Contador imagelocatesubimage
-            IMAGELOCATESUBIMAGE += 1;
-            // Se um único pixel não corresponder, retorna 0 (falso)
-            if (pixel1 != pixel2) {
-                return 0;
-            }
-        }
+// Apply a (2dx+1)x(2dy+1) AND (or OR) filter to img in-place.
+// Returns nonzero on success, 0 on allocation failure (img unchanged).
+static int bitMorph(BitImage img, int dx, int dy, int isOr) {
+  int w = img->width;
+  int h = img->height;
+  if (w == 0 || h == 0) return 1;
+  // Windows are clipped to the image, so wider ones give the same result
+  if (dx > w - 1) dx = w - 1;
+  if (dy > h - 1) dy = h - 1;
+  int ew = bitWords(w + 2 * dx);    // words of a padded row
+  int rows = h + 2 * dy;            // rows of the padded image
+  uint64_t* line = (uint64_t*)malloc((size_t)(ew + 1) * sizeof(uint64_t));
+  uint64_t* ext = (uint64_t*)malloc((size_t)rows * img->stride * sizeof(uint64_t));
+  if (line == NULL || ext == NULL) {
+    errsave = errno;
+    free(line);
+    free(ext);
+    errno = errsave;
+    errCause = "Memory allocation error for morphology buffers";
+    return 0;
+  }
+  uint64_t ident = isOr ? 0 : ~(uint64_t)0;
+  uint64_t last = lastWordMask(w);
+
+  // Rows: padded copy, windowed, into the middle rows of ext
+  for (int y = 0; y < h; y++) {
+    uint64_t* out = ext + (size_t)(y + dy) * img->stride;
+    if (dx == 0) {
+      memcpy(out, bitRow(img, y), img->stride * sizeof(uint64_t));
+      continue;
+    }
+    for (int j = 0; j <= ew; j++) line[j] = ident;
+    copyBits(line, dx, bitRow(img, y), w);
+    bitWindow(line, ew, 2 * dx + 1, isOr);
+    memcpy(out, line, img->stride * sizeof(uint64_t));
+    out[img->stride - 1] &= last;
+  }
+  // Columns: identity rows above and below, windowed
+  for (int i = 0; i < dy; i++) {
+    for (int j = 0; j < img->stride; j++) {
+      ext[(size_t)i * img->stride + j] = ident;
+      ext[(size_t)(h + dy + i) * img->stride + j] = ident;
     }
+  }
+  rowWindow(ext, rows, img->stride, 2 * dy + 1, isOr);
+  for (int y = 0; y < h; y++) {
+    uint64_t* row = bitRow(img, y);
+    memcpy(row, ext + (size_t)y * img->stride, img->stride * sizeof(uint64_t));
+    row[img->stride - 1] &= last;
+  }
 
-    // Se todos os pixels corresponderem, retorna 1 (verdadeiro)
-    return 1;
+  free(line);
+  free(ext);
+  return 1;
 }
 
-/// Locate a subimage inside another image.
-/// Searches for img2 inside img1.
-/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
-/// If no match is found, returns 0 and (*px, *py) are left untouched.
-int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
-  assert (img1 != NULL);
-  assert (img2 != NULL);
+/// Erode a binary image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel becomes white (1) only if all pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image) are white, as in
+/// ImageErode.
+/// Requires: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img is not modified.
+int BitImageErode(BitImage img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0);
+  assert (dy >= 0);
+  return bitMorph(img, dx, dy, 0);
+}
 
-  int width1 = img1->width;
-  int height1 = img1->height;
-  int width2 = img2->width;
-  int height2 = img2->height;
+/// Dilate a binary image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel becomes white (1) if any pixel in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image) is white, as in
+/// ImageDilate.
+/// Requires, ensures and failure as in BitImageErode.
+int BitImageDilate(BitImage img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0);
+  assert (dy >= 0);
+  return bitMorph(img, dx, dy, 1);
+}
 
-  // Verifica se as dimensões da subimagem são menores ou iguais às dimensões da imagem maior
-    if (width2 > width1 || height2 > height1) {
-        return 0;
-    }
+// Reverse the bits of a byte (PBM stores the leftmost pixel in the MSB).
+static inline uint8 reverseByte(uint8 b) {
+  b = (uint8)((b & 0xF0) >> 4 | (b & 0x0F) << 4);
+  b = (uint8)((b & 0xCC) >> 2 | (b & 0x33) << 2);
+  return (uint8)((b & 0xAA) >> 1 | (b & 0x55) << 1);
+}
 
-    for (int i = 0; i < height1 - height2; i++) {
-        for (int j = 0; j < width1 - width2; j++) {
-            // Verifica se há correspondência da subimagem na posição atual
-            if (ImageMatchSubImage(img1, j, i, img2)) {
-                *px = j; // Define a posição x onde a subimagem foi localizada
-                *py = i; // Define a posição y onde a subimagem foi localizada
+/// Load a binary image from a raw PBM (P4) file.
+/// Only raw (P4) PBM files are accepted.
+/// (PBM black (1) pixels become black (0), and white become white (1).)
+///
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying it with BitImageDestroy!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageLoad(const char* filename) { ///
+  assert (filename != NULL);
+  int w, h;
+  char c;
+  FILE* f = NULL;
+  BitImage img = NULL;
+  uint8* buf = NULL;
+  size_t rowBytes = 0;
 
-                return 1; // Retorna 1 (verdadeiro) indicando uma correspondência
-            }
-        }
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL , "Open failed" ) &&
+  // Parse PBM header
+  check( fscanf(f, "P%c ", &c) == 1 && c == '4' , "Invalid file format" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d", &h) == 1 && h >= 0 , "Invalid height" ) &&
+  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" );
+  if (success) {
+    rowBytes = ((size_t)w + 7) / 8;
+    success =
+    check( (buf = (uint8*)malloc(rowBytes + 1)) != NULL , "Memory allocation error" ) &&
+    (img = BitImageCreate(w, h)) != NULL;
+  }
+
+  for (int y = 0; success && y < h; y++) {
+    success = check( fread(buf, 1, rowBytes, f) == rowBytes , "Reading pixels" );
+    if (!success) break;
+    // Byte i of the row goes to bits 8*(i%8).. of word i/8
+    uint64_t* row = bitRow(img, y);
+    for (size_t i = 0; i < rowBytes; i++) {
+      uint64_t b = reverseByte((uint8)~buf[i]);
+      row[i / 8] = (i % 8 == 0 ? 0 : row[i / 8]) | b << (8 * (i % 8));
     }
+    if (img->stride > 0) bitRow(img, y)[img->stride - 1] &= lastWordMask(w);
+  }
+  PIXMEM += (unsigned long)w * h;
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    BitImageDestroy(&img);
+    errno = errsave;
+  }
+  free(buf);
+  if (f != NULL) fclose(f);
+  return img;
+}
 
-    // Se nenhuma correspondência for encontrada, retorna 0 (falso)
+/// Save a binary image to a raw PBM (P4) file.
+/// (White (1) pixels are saved as PBM white (0), black as black (1).)
+/// The file is replaced as in ImageSave.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// the file (if it was a regular file) is left untouched.
+int BitImageSave(BitImage img, const char* filename) { ///
+  assert (img != NULL);
+  assert (filename != NULL);
+  size_t rowBytes = ((size_t)img->width + 7) / 8;
+  uint8* data = (uint8*)malloc(rowBytes * img->height + 1);
+  if (data == NULL) {
+    errCause = "Memory allocation error";
     return 0;
+  }
+  uint8 lastMask = (uint8)(0xFF00 >> (img->width % 8 == 0 ? 8 : img->width % 8));
+  for (int y = 0; y < img->height; y++) {
+    const uint64_t* row = bitRow(img, y);
+    uint8* out = data + rowBytes * y;
+    for (size_t i = 0; i < rowBytes; i++) {
+      out[i] = (uint8)~reverseByte((uint8)(row[i / 8] >> (8 * (i % 8))));
+    }
+    if (rowBytes > 0) out[rowBytes - 1] &= lastMask;   // padding bits 0
+  }
+  PIXMEM += (unsigned long)img->width * img->height;
+
+  char header[64];
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = snprintf(header, sizeof(header), "P4\n%d %d\n", img->width, img->height);
+  iov[1].iov_base = data;
+  iov[1].iov_len = rowBytes * img->height;
+  const char* cause = "Open failed";
+  struct tempFile t;
+  int success = tempCreate(filename, &t) >= 0;
+  if (success) {
+    cause = "Writing pixels failed";
+    success = tempCommit(&t, writevAll(t.fd, iov, 2), &cause);
+  }
+  errsave = errno;
+  free(data);
+  errno = errsave;
+  errCause = (char*)(success ? "" : cause);
+  return success;
 }
 
 
+/// Kernel sets
 
-/// Filtering
+// (See CPU dispatch.)
+static const struct kernels kernelSets[IMAGE_SIMD_AVX512 + 1] = {
+  [IMAGE_SIMD_SCALAR] = {
+    .adler32 = adler32Scalar, .rowDelta = rowDeltaScalar,
+    .rowMinMax = rowMinMaxScalar, .sobelSpan = sobelSpanScalar,
+    .accumulate = accumulateScalar, .halveRow = halveRowScalar,
+    .bilinear = bilinearScalar, .packBlocks = packBlocksScalar,
+    .convRow = convRowScalar, .convCol = convColScalar,
+    .findPair = findPairScalar,
+  },
+#if defined(__SSE2__)
+  [IMAGE_SIMD_SSE2] = {
+    .adler32 = adler32SSE2, .rowDelta = rowDeltaSSE2,
+    .rowMinMax = rowMinMaxSSE2, .sobelSpan = sobelSpanSSE2,
+    .accumulate = accumulateSSE2, .halveRow = halveRowSSE2,
+    .bilinear = bilinearSSE2, .packBlocks = packBlocksSSE2,
+    .convRow = convRowSSE2, .convCol = convColScalar,
+    .findPair = findPairSSE2,
+  },
+#endif
+#if defined(KERNELS_X86)
+  [IMAGE_SIMD_AVX2] = {
+    .adler32 = adler32SSE2, .rowDelta = rowDeltaAVX2,
+    .rowMinMax = rowMinMaxAVX2, .sobelSpan = sobelSpanSSE2,
+    .accumulate = accumulateAVX2, .halveRow = halveRowAVX2,
+    .bilinear = bilinearAVX2, .packBlocks = packBlocksAVX2,
+    .convRow = convRowAVX2, .convCol = convColAVX2,
+    .findPair = findPairAVX2,
+  },
+  [IMAGE_SIMD_AVX512] = {
+    .adler32 = adler32SSE2, .rowDelta = rowDeltaAVX512,
+    .rowMinMax = rowMinMaxAVX512, .sobelSpan = sobelSpanSSE2,
+    .accumulate = accumulateAVX2, .halveRow = halveRowAVX2,
+    .bilinear = bilinearAVX2, .packBlocks = packBlocksAVX512,
+    .convRow = convRowAVX2, .convCol = convColAVX2,
+    .findPair = findPairAVX2,
+  },
+#endif
+};
 
-/// Blur an image by applying a (2dx+1)x(2dy+1) mean filter.
-/// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
-/// The image is changed in-place.
-void _ImageBlur_1(Image img, int dx, int dy) { ///
-  // Insert your code here!
-  	int width = img->width;
-    int height = img->height;
-	int totalPixels = width * height;
-	
-
-    Image tempImg = ImageCreate(width, height, img->maxval); // Criar uma imagem temporária
-
-	int hSum = 0;
-	// For first pixel
-	for (int px = 0; px <= dx /* as px < dx+1 */; px++) {
-		for (int py = 0; py <= dy; py++) {
-			hSum += ImageGetPixel(img, px, py);
-			IMAGEBLUR++;
-		}
-	}
-
-	int previous_y1 = 0;
-	int previous_y2 = dy;
-	int y1 = 0;
-	int y2 = dy;
-    for (int y = 0; y < height; ) {
-		ImageSetPixel(tempImg, 0, y, roundPixel((double) hSum / ((dx + 1) * (y2 - y1 + 1))));
-
-		// For remaining pixels in each row
-		int wSum = hSum;
-		int previous_x1 = 0;
-		int previous_x2 = dx;
-		for (int x = 1; x < width; x++) {
-			int x1 = x - dx > 0 ? x - dx : 0;
-			int x2 = x + dx < height ? x + dx : width - 1;
-
-			
-			// Subtract the leftmost pixel from the sum
-			// except if the leftmost pixel is the same
-			if (x1 != previous_x1) {
-				for (int py = y1; py <= y2; py++) {
-					wSum -= ImageGetPixel(img, previous_x1, py);
-					IMAGEBLUR++;
-				}
-			}
-			if (x2 != previous_x2) {
-				for (int py = y1; py <= y2; py++) {
-					wSum += ImageGetPixel(img, x2, py);
-					IMAGEBLUR++;
-				}
-			}
-			
-			previous_x1 = x1;
-			previous_x2 = x2;
-			ImageSetPixel(tempImg, x, y, roundPixel((double) wSum / ((x2 - x1 + 1) * (y2 - y1 + 1))));
-		}
-		
-		y++; // Next row
-		previous_y1 = y1;
-		previous_y2 = y2;
-		y1 = y - dy > 0 ? y - dy : 0;
-		y2 = y + dy < height ? y + dy : height - 1;
-
-		// For first pixel in next row
-		if (y1 != previous_y1) {
-			for (int px = 0; px <= dx; px++) {
-				hSum -= ImageGetPixel(img, px, previous_y1);
-				IMAGEBLUR++;
-			}
-		}
-
-		if (y2 != previous_y2) {
-			for (int px = 0; px <= dx; px++) {
-				hSum += ImageGetPixel(img, px, y2);
-				IMAGEBLUR++;
-			}
-		}
-		
-
-    }
-
-    // Copiar a imagem temporária de volta para a imagem original
-    for (int i = 0; i < totalPixels; i++) {
-        img->pixel[i] = tempImg->pixel[i];
-    }
-
-    // Destruir a imagem temporária
-    ImageDestroy(&tempImg);
-}
-
-void _ImageBlur_2(Image img, int dx, int dy) {
-	long *summed_table = (long *) malloc(sizeof(long) * img->width * img->height);
-	
-	uint8 *firstPixel = img->pixel;
-	uint8 *last_currentRow_Pixel = firstPixel + img->width;
-	uint8 *lastPixel = firstPixel + img->width * img->height;
-	uint8 *currentPixel = firstPixel;
-	
-	long *firstSum = summed_table;
-	long *currentSum = firstSum;
-	
-	// For first row
-	// For first pixel of first row
-	*currentSum = *currentPixel;
-	currentPixel++;
-	currentSum++;
-	IMAGEBLUR++;
-	PIXMEM++;
-	// For remaining pixels of first row
-	while(currentPixel < last_currentRow_Pixel) {
-		*currentSum = *currentPixel + *(currentSum - 1);
-		currentPixel++;
-		currentSum++;
-		IMAGEBLUR += 2;
-		PIXMEM++;
-	}
-	last_currentRow_Pixel += img->width;
-
-	// For remaining rows
-	while(currentPixel < lastPixel) {
-		// For first pixel of remaining rows
-		*currentSum = *currentPixel + *(currentSum - img->width);
-		currentPixel++;
-		currentSum++;
-		IMAGEBLUR += 2;
-		PIXMEM++;
-
-		// For remaining pixels of remaining rows
-		while (currentPixel < last_currentRow_Pixel) {
-			*currentSum = *currentPixel + *(currentSum - img->width) + *(currentSum - 1) - *(currentSum - img->width - 1);
-			currentPixel++;
-			currentSum++;
-			IMAGEBLUR += 4;
-			PIXMEM++;
-		}
-		last_currentRow_Pixel += img->width;
-	}
-
-
-	
-	// Finaly, summed table is ready to use
-	for(int y = 0; y < img->height; y++) {
-		for (int x = 0; x < img->width; x++) {
-			int x1 = x - dx - 1;
-			int x2 = x + dx < img->width ? x + dx : img->width - 1;
-			int y1 = y - dy - 1;
-			int y2 = y + dy < img->height ? y + dy : img->height - 1;
-
-			int area = (1+x2-(x1>=0 ? x1 + 1 : 0)) * (1+y2-(y1>=0 ? y1 + 1 : 0));
-
-			IMAGEBLUR++;
-			if (x1 >= 0) IMAGEBLUR++;
-			if (y1 >= 0) IMAGEBLUR++;
-			if (x1 >= 0 && y1 >= 0) IMAGEBLUR++;
-			ImageSetPixel(img, x, y,
-					roundPixel((double) (
-							*(summed_table + G(img, x2, y2))
-							- (x1 >= 0 ? *(summed_table + G(img, x1, y2)) : 0)
-							- (y1 >= 0 ? *(summed_table + G(img, x2, y1)) : 0)
-							+ (x1 >= 0 && y1 >= 0 ? *(summed_table + G(img, x1, y1)) : 0) 
-							)
-						/ area)
-					);
-		}
-	}
-
-}
-
-void ImageBlur(Image img, int dx, int dy) { ///
-  assert (img != NULL);
-  assert (dx >= 0);
-  assert (dy >= 0);
-  // Insert your code here!
-  _ImageBlur_2(img, dx, dy);
+static const char* const simdNames[IMAGE_SIMD_AVX512 + 1] = {
+  "scalar", "sse2", "avx2", "avx512"
+};
+
+// Is instruction set simd supported by this build and this CPU?
+static int simdSupported(int simd) {
+  if (kernelSets[simd].adler32 == NULL) return 0;
+#if defined(KERNELS_X86)
+  __builtin_cpu_init();
+  if (simd >= IMAGE_SIMD_AVX2 && !__builtin_cpu_supports("avx2")) return 0;
+  if (simd >= IMAGE_SIMD_AVX512 && !(__builtin_cpu_supports("avx512f") &&
+                                     __builtin_cpu_supports("avx512bw"))) {
+    return 0;
+  }
+#endif
+  return 1;
 }
 
+// Select the best supported kernels, up to those named by IMAGE_SIMD.
+static void kernelsInit(void) {
+  int simd = IMAGE_SIMD_AVX512;
+  const char* env = getenv("IMAGE_SIMD");
+  for (int i = 0; env != NULL && i <= IMAGE_SIMD_AVX512; i++) {
+    if (strcmp(env, simdNames[i]) == 0) simd = i;
+  }
+  while (!simdSupported(simd)) simd--;
+  atomic_store(&kernelsUsed, &kernelSets[simd]);
+}
+
+/// Get the instruction set used by the kernels of image operations.
+int ImageSimd(void) { ///
+  return (int)(K() - kernelSets);
+}
+
+/// Select the instruction set used by the kernels of image operations.
+/// Returns nonzero on success, or 0 if simd is not supported.
+int ImageSetSimd(int simd) { ///
+  assert (IMAGE_SIMD_SCALAR <= simd && simd <= IMAGE_SIMD_AVX512);
+  pthread_once(&kernelsOnce, kernelsInit);
+  if (!simdSupported(simd)) return 0;
+  atomic_store(&kernelsUsed, &kernelSets[simd]);
+  return 1;
+}
+
+/// Get the name of instruction set simd.
+const char* ImageSimdName(int simd) { ///
+  assert (IMAGE_SIMD_SCALAR <= simd && simd <= IMAGE_SIMD_AVX512);
+  return simdNames[simd];
+}
@@ -13,6 +13,8 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -23,6 +25,36 @@ extern const uint8 PixMax;
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Type ImageSaveJob is a handle to an asynchronous save (see ImageSaveAsync)
+typedef struct saveJob *ImageSaveJob;
+
+// Type BitImage is a pointer to binary image objects (see BitImageCreate)
+typedef struct bitimage *BitImage;
+
+// Type ImageMatch is an occurrence of a subimage (see ImageLocateMany)
+typedef struct {
+  int index;  // index of the subimage
+  int x, y;   // position where it was found
+} ImageMatch;
+
+// Pixel storage layouts
+// IMAGE_RASTER stores pixels row by row (the default).
+// IMAGE_TILED stores pixels in 64x64 tiles, so that pixels that are close
+// in 2D are close in memory whatever the image width.  This benefits
+// column-wise and 2D access patterns (such as ImageRotate) on wide images.
+// IMAGE_ALIGNED stores pixels row by row, each row starting on a 64-byte
+// boundary and padded to a multiple of 64 pixels, for vector kernels.
+// (Saved files never include the padding.)
+// All operations work on images in any layout.
+enum { IMAGE_RASTER = 0, IMAGE_TILED = 1, IMAGE_ALIGNED = 2 };
+
+// Image file formats
+// IMAGE_PGM is raw 8 bit PGM.
+// IMAGE_I8Z is a compressed format (see ImageSaveCompressed).
+// IMAGE_I8T is a compressed format stored in tiles, for partial reads
+// (see ImageSaveTiled and ImageLoadRegion).
+enum { IMAGE_PGM = 0, IMAGE_I8Z = 1, IMAGE_I8T = 2 };
+
 /// Error handling functions
 
 /// Error cause.
@@ -36,21 +68,68 @@ typedef struct image *Image;
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply set names of instrumentation counters.
+/// (Instrumentation is calibrated lazily, on the first InstrPrint.)
 void ImageInit(void) ;
 
+/// Set the number of threads used by image operations.
+/// Operations on large images split their rows among up to n threads
+/// (the caller and n-1 workers); n == 1 makes them serial, and n == 0
+/// selects one thread per CPU (the default).
+/// Requires: n >= 0.
+void ImageSetThreads(int n) ;
+
+// Instruction sets for the vector kernels of image operations
+enum { IMAGE_SIMD_SCALAR = 0, IMAGE_SIMD_SSE2 = 1, IMAGE_SIMD_AVX2 = 2,
+       IMAGE_SIMD_AVX512 = 3 };
+
+/// Get the instruction set used by the kernels of image operations.
+/// By default, the best one supported by the CPU is used, unless the
+/// environment variable IMAGE_SIMD names another one (scalar, sse2, avx2
+/// or avx512): then the best supported one up to that is used.
+/// All instruction sets give exactly the same results.
+int ImageSimd(void) ;
+
+/// Select the instruction set used by the kernels of image operations.
+/// Call before starting operations in other threads.
+/// Returns nonzero on success, or 0 if simd is not supported by this CPU
+/// (or build), leaving the selection unchanged.
+int ImageSetSimd(int simd) ;
+
+/// Get the name of instruction set simd ("scalar", "sse2", "avx2" or
+/// "avx512").
+const char* ImageSimdName(int simd) ;
+
 /// Image management functions
 
 /// Create a new black image.
 ///   width, height : the dimensions of the new image.
 ///   maxval: the maximum gray level (corresponding to white).
 /// Requires: width and height must be non-negative, maxval > 0.
+/// (The number of pixels, width*height, may exceed INT_MAX.)
 /// 
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
+/// On failure, returns NULL and errno/errCause are set accordingly
+/// (errCause is "Image too large" if it could never fit in memory).
 Image ImageCreate(int width, int height, uint8 maxval) ;
 
+/// Create a new black image with the given pixel storage layout.
+/// Like ImageCreate, but layout may be IMAGE_RASTER, IMAGE_TILED or
+/// IMAGE_ALIGNED.
+Image ImageCreateLayout(int width, int height, uint8 maxval, int layout) ;
+
+/// Create a copy of an image.
+/// The copy shares the pixel data with img until either of them is
+/// modified, so this takes constant time and no pixel memory.
+/// (Operations that modify an image in-place copy its pixels first if they
+/// are shared.  This is the only case where they may fail.)
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageClone(Image img) ;
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -58,21 +137,159 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Get the pixel storage layout of an image
+/// (IMAGE_RASTER, IMAGE_TILED or IMAGE_ALIGNED).
+int ImageLayout(Image img) ;
+
+/// Change the pixel storage layout of an image.
+/// Pixel values are not changed.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img is not modified.
+int ImageSetLayout(Image img, int layout) ;
+
 /// PGM file operations
 
 /// Load a raw PGM file.
 /// Only 8 bit PGM files are accepted.
+/// Files in the compressed (I8Z) and tiled (I8T) formats of this module
+/// are also accepted: they are recognized by their signature.
+/// The image is loaded in IMAGE_RASTER layout.
+/// If filename is "-", the next image of the standard input is read
+/// (as ImageRead(stdin)).
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Load an image file (as ImageLoad) into an image with the given pixel
+/// storage layout (IMAGE_RASTER, IMAGE_TILED or IMAGE_ALIGNED).
+/// Raster and aligned images are read in place: the padding of aligned
+/// rows is handled while reading.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadLayout(const char* filename, int layout) ;
+
+/// Load a rectangular region of an image file.
+/// Loads the same image as ImageCrop(ImageLoad(filename), x, y, w, h),
+/// but only reads the parts of the file needed:
+/// the rows of the region for PGM files, the bands of rows up to the region
+/// (decoding only those that intersect it) for compressed files, and just
+/// the tiles that intersect the region for tiled files (see ImageSaveTiled).
+/// Except for whole images, the file must be seekable.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure (including if the region is not inside the image),
+/// returns NULL and errno/errCause are set accordingly.
+Image ImageLoadRegion(const char* filename, int x, int y, int w, int h) ;
+
 /// Save image to PGM file.
+/// The file is replaced only when it has been completely written and
+/// synced to disk, and keeps its permissions.  Symbolic links are followed.
+/// Files that are not regular files, such as FIFOs, are written directly.
+/// If filename is "-", the image is written to the standard output
+/// instead (as ImageWrite(img, stdout)).
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
-/// a partial and invalid file may be left in the system.
+/// the file (if it was a regular file) is left untouched.
 int ImageSave(Image img, const char* filename) ;
 
+/// Read the next image from stream f, in IMAGE_RASTER layout.
+/// The image may be in any format accepted by ImageLoad (but I8T needs a
+/// seekable f).  f may hold several images one after the other, like
+/// the frames of a video piped between programs: each call reads the
+/// next one, leaving f just after it.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// At the end of f, returns NULL with errno == 0 and errCause
+/// "End of file".
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRead(FILE* f) ;
+
+/// Write image to stream f in PGM format, after flushing f.
+/// Images written one after the other form a multi-image PGM stream,
+/// which ImageRead reads back one by one.
+/// The pixels are written straight from the image to the file descriptor
+/// of f.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately (part
+/// of the image may have been written).
+int ImageWrite(Image img, FILE* f) ;
+
+/// Load an image file in the compressed (I8Z) format.
+/// (ImageLoad also loads these files.)
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadCompressed(const char* filename) ;
+
+/// Save image to a file in the compressed (I8Z) format.
+/// This is a lossless format, usually much smaller than PGM for images with
+/// flat areas (such as scanned documents), and fast to load.
+/// The file is replaced as in ImageSave.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// the file (if it was a regular file) is left untouched.
+int ImageSaveCompressed(Image img, const char* filename) ;
+
+/// Save image to a file in the tiled (I8T) format.
+/// This format stores the image compressed (as ImageSaveCompressed) in
+/// square tiles, with an index, so that ImageLoadRegion can read any
+/// region of it by reading just the tiles that intersect the region.
+/// The file is replaced as in ImageSave.
+/// If filename is "-", the file is written to the standard output, after
+/// anything already written there.  When that (or the file) is not
+/// seekable, such as a pipe, all tiles are kept in memory until the index,
+/// which precedes them, has been written.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// the file (if it was a regular file) is left untouched.
+int ImageSaveTiled(Image img, const char* filename) ;
+
+/// Convert an image file to the tiled (I8T) format.
+/// src may be in any format accepted by ImageLoad, but must be seekable.
+/// The image is read and converted one row of tiles at a time, so images
+/// much larger than the available memory may be converted (unless dst is
+/// not seekable: see ImageSaveTiled).
+/// The file dst is replaced as in ImageSave.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// dst (if it was a regular file) is left untouched.
+int ImageConvertToTiled(const char* src, const char* dst) ;
+
+/// Save image to PGM file, asynchronously.
+/// The save is queued for a background writer thread, and this returns
+/// immediately.  The caller may modify or destroy img right away: the file
+/// gets the pixels img had at the time of this call.
+/// Otherwise, the file is written as in ImageSave, ImageSaveCompressed or
+/// ImageSaveTiled, for format IMAGE_PGM, IMAGE_I8Z or IMAGE_I8T.
+/// If jobp is not NULL, (*jobp) is set to a handle that must later be
+/// passed to ImageSaveWait, to get the outcome of the save.
+/// If jobp is NULL, the outcome is reported by ImageSaveFlush.
+/// Saves still queued when the program exits are completed.
+/// On success (the save was queued), returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageSaveAsync(Image img, const char* filename, int format,
+                   ImageSaveJob* jobp) ;
+
+/// Wait for the asynchronous save (*jobp) to complete.
+///   jobp : address of a handle set by ImageSaveAsync.
+/// Ensures: (*jobp)==NULL.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// the file (if it was a regular file) is left untouched.
+int ImageSaveWait(ImageSaveJob* jobp) ;
+
+/// Wait for all asynchronous saves queued so far to complete.
+/// (The outcome of saves with a handle must still be collected with
+/// ImageSaveWait.)
+/// Returns nonzero if all saves without a handle succeeded since the
+/// previous ImageSaveFlush.
+/// Otherwise, returns 0, and errno/errCause are set as for the first that
+/// failed.
+int ImageSaveFlush(void) ;
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -91,8 +308,17 @@ int ImageMaxval(Image img) ;
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
+/// (Statistics are cached in the image, and kept up to date by the
+/// operations that can do so cheaply, so repeated calls are fast.)
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
+/// Get the histogram of img: hist[v] is set to the number of pixels with
+/// level v, for v = 0..255.
+void ImageHistogram(Image img, size_t hist[256]) ;
+
+/// Get the sum of the levels of all pixels of img.
+uint64_t ImageSum(Image img) ;
+
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) ;
 
@@ -110,30 +336,38 @@ int ImageValidRect(Image img, int x, int y, int w, int h) ;
 uint8 ImageGetPixel(Image img, int x, int y) ;
 
 /// Set the pixel at position (x,y) to new level.
-void ImageSetPixel(Image img, int x, int y, uint8 level) ;
+/// On success, returns nonzero.
+/// Fails (returns 0, errno/errCause are set appropriately, and img is not
+/// modified) only if img shares its pixels with a clone and there is no
+/// memory to copy them.
+int ImageSetPixel(Image img, int x, int y, uint8 level) ;
 
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
 /// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
-/// They never fail.
+/// All of these functions modify the image in-place: no allocation involved,
+/// unless img shares its pixels with a clone (see ImageClone).
+/// On success, they return nonzero.
+/// They only fail if img shares its pixels and there is no memory to copy
+/// them: then they return 0, errno/errCause are set appropriately, and
+/// img is not modified.
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
-void ImageNegative(Image img) ;
+int ImageNegative(Image img) ;
 
 /// Apply threshold to image.
 /// Transform all pixels with level<thr to black (0) and
 /// all pixels with level>=thr to white (maxval).
-void ImageThreshold(Image img, uint8 thr) ;
+int ImageThreshold(Image img, uint8 thr) ;
 
 /// Brighten image by a factor.
 /// Multiply each pixel level by a factor, but saturate at maxval.
 /// This will brighten the image if factor>1.0 and
 /// darken the image if factor<1.0.
-void ImageBrighten(Image img, double factor) ;
+int ImageBrighten(Image img, double factor) ;
 
 /// Geometric transformations
 
@@ -178,21 +412,85 @@ Image ImageMirror(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Apply an affine transformation to an image.
+/// Returns a new image with width w and height h, where the point (x, y)
+/// of img is moved to
+///   (m[0]*x + m[1]*y + m[2], m[3]*x + m[4]*y + m[5]).
+/// Coordinates are continuous: pixel (i, j) covers [i, i+1)x[j, j+1).
+/// Each output pixel is sampled from img with nearest neighbour or, if
+/// bilinear is nonzero, bilinear interpolation.  Output pixels that come
+/// from outside img are black (0).
+/// Requires: w >= 0, h >= 0, and the matrix must be invertible.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageAffine(Image img, const double m[6], int w, int h, int bilinear) ;
+
+/// Rotate an image by an arbitrary angle.
+/// Returns a version of the image rotated counter-clockwise (as displayed)
+/// by the given angle in degrees around its center, so that
+/// ImageRotateAngle(img, 90.0, 0) equals ImageRotate(img).
+/// The new image is just large enough to hold the whole rotated image;
+/// uncovered areas are black (0).
+/// Sampling is nearest neighbour or, if bilinear is nonzero, bilinear.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateAngle(Image img, double degrees, int bilinear) ;
+
+/// Resize an image.
+/// Returns a new image with width w and height h.
+/// Each axis is reduced by area averaging (each output pixel is the mean of
+/// the source area it covers) or enlarged by bilinear interpolation.
+/// Requires: w > 0, h > 0, and img must not be empty.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h) ;
+
+/// Build an image pyramid.
+/// Fills pyramid[0], pyramid[1], ... with successively halved versions of
+/// img: pyramid[0] is img halved, pyramid[1] is pyramid[0] halved, etc.
+/// Each level has dimensions ((w+1)/2, (h+1)/2) of the previous one and
+/// each pixel is the mean of a 2x2 block.  Stops after levels images or
+/// after producing a 1x1 image, whichever comes first.
+/// Requires: levels >= 0, img must not be empty, and pyramid must have
+/// room for levels images.
+/// Ensures: The original img is not modified.
+///
+/// On success, returns the number of levels created.
+/// (The caller is responsible for destroying the returned images!)
+/// On failure, returns -1, no images are left allocated, and
+/// errno/errCause are set accordingly.
+int ImageBuildPyramid(Image img, int levels, Image pyramid[]) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place: no allocation involved (unless img1 shares
+/// its pixels, see ImageClone).
 /// Requires: img2 must fit inside img1 at position (x, y).
-void ImagePaste(Image img1, int x, int y, Image img2) ;
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img1 is not modified.
+int ImagePaste(Image img1, int x, int y, Image img2) ;
 
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place: no allocation involved (unless img1 shares
+/// its pixels, see ImageClone).
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
-void ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
+/// Success and failure as in ImagePaste.
+int ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
 
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
@@ -205,12 +503,264 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Locate many subimages at once.
+/// Searches for all occurrences of each of the n subimages sub[0..n-1]
+/// inside img, in a single pass for subimages of similar sizes.
+/// Returns the number of occurrences found, and sets (*matches) to a new
+/// array with them, sorted by position (y, then x), then index.
+/// (The caller is responsible for freeing the array!)
+/// Requires: the subimages are not empty (unlike ImageLocateSubImage,
+/// where an empty subimage matches at the origin).
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLocateMany(Image img, Image sub[], int n, ImageMatch** matches) ;
+
 /// Filtering
 
-/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
+/// Blur an image by applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image).
 /// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) ;
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img is not modified.
+int ImageBlur(Image img, int dx, int dy) ;
+
+/// Incremental blur
+
+/// Mark all pixels of img as clean.
+/// Later changes to img are tracked: in-place operations add the area they
+/// modify (the pasted rectangle, for ImagePaste / ImageBlend, the pixel,
+/// for ImageSetPixel, or else the whole image) to the dirty area of img.
+/// (New images start all dirty.)
+void ImageMarkClean(Image img) ;
+
+/// Get the bounding rectangle of the dirty area of img.
+/// Returns 0 if img is clean, or else nonzero, with the rectangle in
+/// (*x, *y, *w, *h).
+int ImageDirtyRect(Image img, int* x, int* y, int* w, int* h) ;
+
+/// Start blurring img incrementally.
+/// Returns a copy of img blurred like ImageBlur(copy, dx, dy), and marks
+/// img clean, so that the copy can be kept up to date with ImageBlurUpdate
+/// as img is changed.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageBlurred(Image img, int dx, int dy) ;
+
+/// Update blurred after changes to img.
+/// Requires: blurred is img blurred with (dx, dy), as it was when it was
+/// last marked clean (see ImageBlurred).
+/// Only the dirty area of img, expanded by (dx, dy), is blurred again, so
+/// the cost depends on the size of the changes, not of the image.
+/// Ensures: blurred is the blur of img, and img is marked clean.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img and blurred are not modified.
+int ImageBlurUpdate(Image img, Image blurred, int dx, int dy) ;
+
+/// Blur an image with an approximately Gaussian filter.
+/// The Gaussian of standard deviation sigma is approximated by three
+/// successive box filters, so the cost does not depend on sigma.
+/// Requires: sigma >= 0.0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img is not modified.
+int ImageGaussianBlur(Image img, double sigma) ;
+
+/// Apply a (2dx+1)x(2dy+1) median filter to an image.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image; for an even number
+/// of pixels, the lower median is used).
+/// The running time per pixel does not depend on dx and dy.
+/// Requires: dx >= 0, 0 <= dy < 32768.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img is not modified.
+int ImageMedian(Image img, int dx, int dy) ;
+
+/// Morphology
+
+/// These functions apply min/max filters with a (2dx+1)x(2dy+1)
+/// rectangular structuring element, clipped to the image.
+/// The running time per pixel does not depend on dx and dy.
+/// Requires: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// On success, they return nonzero.
+/// On failure, they return 0 and errno/errCause are set appropriately.
+
+/// Erode an image: each pixel is substituted by the minimum of the pixels
+/// in the rectangle [x-dx, x+dx]x[y-dy, y+dy].
+int ImageErode(Image img, int dx, int dy) ;
+
+/// Dilate an image: each pixel is substituted by the maximum of the pixels
+/// in the rectangle [x-dx, x+dx]x[y-dy, y+dy].
+int ImageDilate(Image img, int dx, int dy) ;
+
+/// Open an image: erosion followed by dilation.
+/// Removes bright details smaller than the structuring element.
+int ImageOpen(Image img, int dx, int dy) ;
+
+/// Close an image: dilation followed by erosion.
+/// Fills dark details smaller than the structuring element.
+int ImageClose(Image img, int dx, int dy) ;
+
+/// Convolution
+
+// Border modes of ImageConvolve: pixels outside the image are
+// IMAGE_BORDER_CLAMP: those of the nearest edge (replicated);
+// IMAGE_BORDER_MIRROR: those reflected about the edge pixels
+// (..., p[2], p[1], p[0], p[1], p[2], ...);
+// IMAGE_BORDER_WRAP: those of the opposite side (the image tiles the plane);
+// IMAGE_BORDER_ZERO: black (0).
+enum { IMAGE_BORDER_CLAMP = 0, IMAGE_BORDER_MIRROR = 1, IMAGE_BORDER_WRAP = 2,
+       IMAGE_BORDER_ZERO = 3 };
+
+/// Convolve an image with a kw x kh integer kernel.
+/// Each pixel (x, y) is substituted by
+///   sum(kernel[j*kw+i] * pixel(x+i-kw/2, y+j-kh/2)) / divisor + bias
+/// over i in [0, kw), j in [0, kh), rounded to nearest (halves up) and
+/// saturated to [0, maxval].  (As usual for image filters, the kernel is
+/// not flipped.)
+/// Pixels outside the image are taken as given by border (IMAGE_BORDER_*).
+/// Kernels of rank 1 (the product of a column and a row, like most
+/// smoothing kernels) are detected, and applied as a horizontal and a
+/// vertical pass, with kw+kh instead of kw*kh operations per pixel.
+/// Requires: kw and kh odd and positive, divisor > 0,
+/// |kernel[i]| <= 32767 and the sum of all |kernel[i]| below 2^23.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img is not modified.
+int ImageConvolve(Image img, const int* kernel, int kw, int kh,
+                  int divisor, int bias, int border) ;
+
+/// Edge detection
+
+/// Compute the Sobel gradient magnitude of an image.
+/// Returns a new image where each pixel is |gx|+|gy| of the 3x3 Sobel
+/// operator at that position, scaled so that a step from 0 to PixMax gives
+/// PixMax, and saturated at maxval.  Border pixels are replicated.
+/// If dir != NULL, a second new image is created in (*dir) with the
+/// gradient direction atan2(gy, gx) mapped from [-pi, pi) to [0, maxval].
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image(s)!)
+/// On failure, returns NULL (and sets *dir to NULL, if dir != NULL), and
+/// errno/errCause are set accordingly.
+Image ImageSobel(Image img, Image* dir) ;
+
+
+/// Binary images
+
+/// A binary image stores one bit per pixel: 1 (white) or 0 (black), packed
+/// 64 pixels per word, so it takes 8 times less memory than an 8-bit image.
+/// Binary images are used only through variables of type BitImage.
+
+/// Create a new binary image, all black (0).
+/// Requires: width and height must be non-negative.
+///
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying it with BitImageDestroy!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageCreate(int width, int height) ;
+
+/// Destroy the binary image pointed to by (*imgp).
+/// If (*imgp)==NULL, no operation is performed.
+/// Ensures: (*imgp)==NULL.
+void BitImageDestroy(BitImage* imgp) ;
+
+/// Width of a binary image.
+int BitImageWidth(BitImage img) ;
+
+/// Height of a binary image.
+int BitImageHeight(BitImage img) ;
+
+/// Get the pixel (0 or 1) at position (x,y).
+int BitImageGetPixel(BitImage img, int x, int y) ;
+
+/// Set the pixel at position (x,y) to bit (0 or nonzero for 1).
+void BitImageSetPixel(BitImage img, int x, int y, int bit) ;
+
+/// Threshold an image into a new binary image.
+/// Pixels with level>=thr become white (1), and the others black (0),
+/// as in ImageThreshold.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying it with BitImageDestroy!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage ImageThresholdBits(Image img, uint8 thr) ;
+
+/// Convert a binary image to a new 8-bit image, with white (1) pixels set
+/// to maxval and black (0) pixels set to 0.
+/// Requires: maxval > 0.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image BitImageToImage(BitImage bin, uint8 maxval) ;
+
+/// Bitwise operations
+/// These modify img1 in-place, combining it with img2, of the same size.
+/// Requires: img1 and img2 have the same size.
+
+/// img1 = img1 AND img2.
+void BitImageAnd(BitImage img1, BitImage img2) ;
+
+/// img1 = img1 OR img2.
+void BitImageOr(BitImage img1, BitImage img2) ;
+
+/// img1 = img1 XOR img2.
+void BitImageXor(BitImage img1, BitImage img2) ;
+
+/// Invert all pixels of img.
+void BitImageNot(BitImage img) ;
+
+/// Count the white (1) pixels of img.
+size_t BitImageCount(BitImage img) ;
+
+/// Paste binary image img2 into position (x, y) of img1.
+/// Requires: img2 must fit inside img1 at position (x, y).
+void BitImagePaste(BitImage img1, int x, int y, BitImage img2) ;
+
+/// Erode a binary image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel becomes white (1) only if all pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image) are white, as in
+/// ImageErode.
+/// Requires: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// img is not modified.
+int BitImageErode(BitImage img, int dx, int dy) ;
+
+/// Dilate a binary image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel becomes white (1) if any pixel in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image) is white, as in
+/// ImageDilate.
+/// Requires, ensures and failure as in BitImageErode.
+int BitImageDilate(BitImage img, int dx, int dy) ;
+
+/// Load a binary image from a raw PBM (P4) file.
+/// Only raw (P4) PBM files are accepted.
+/// (PBM black (1) pixels become black (0), and white become white (1).)
+///
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying it with BitImageDestroy!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageLoad(const char* filename) ;
+
+/// Save a binary image to a raw PBM (P4) file.
+/// (White (1) pixels are saved as PBM white (0), black as black (1).)
+/// The file is replaced as in ImageSave.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// the file (if it was a regular file) is left untouched.
+int BitImageSave(BitImage img, const char* filename) ;
 
 #endif
@@ -14,13 +14,22 @@
 #include <string.h>
 #include <errno.h>
 #include <error.h>
+#include <limits.h>
 #include <assert.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
 
 static const char* USAGE =
     "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "       imageTool -s [SOCKET [WORKERS]]\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -29,26 +38,61 @@ static const char* USAGE =
     "  The last image in the buffer is called the current image CURR and its\n"
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
+    "  Operations are only executed if their result is eventually used by\n"
+    "  save, info, locate or store, and images are freed as soon as they are\n"
+    "  no longer needed.\n"
+    "\n"
+    "  With -s, runs as a server: reads requests from stdin, or from clients\n"
+    "  connecting to Unix socket SOCKET, which are served concurrently by\n"
+    "  WORKERS threads (default: one per CPU).  Each request is a line with\n"
+    "  a pipeline, as above.  Its output is followed by a line with OK, or\n"
+    "  with ERROR and a message.  Images stored by name stay resident for\n"
+    "  later requests.  FILE - (see below) is not allowed.\n"
     "\n"
     "FILES:\n"
-    "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
+    "  Image files may be in 8-bit raw PGM format, or in the compressed (I8Z)\n"
+    "  or tiled (I8T) formats of image8bit (detected automatically).\n"
+    "  Files are saved in those formats if their names end in .i8z or .i8t.\n"
+    "  Files whose names end in .pbm are raw PBM (P4) bitmaps: images are\n"
+    "  saved thresholded at half their maxval (as after thr), and loaded\n"
+    "  with levels 0 and 255.\n"
+    "  A FILE that is only cropped is read partially (only the tiles needed,\n"
+    "  for I8T files), and a FILE that is only saved to an .i8t file is\n"
+    "  converted a row of tiles at a time.\n"
     "  Input file names must be distinct from operation names.\n"
+    "  FILE - is the standard input, and save - writes to the standard\n"
+    "  output (right away, in order with the output of info, etc.).  The\n"
+    "  input may hold many images (such as video frames) one after the\n"
+    "  other: then the pipeline is run for each one, writing its results\n"
+    "  out as they complete, until the input ends.  (Progress is only\n"
+    "  reported for the first image.)\n"
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
-    "  save FILE       Save CURR to PGM file\n"
+    "  save FILE       Save CURR to PGM file (in the background)\n"
     "  info            Show information on CURR (size and range)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "  layout LAYOUT   Change pixel storage of CURR to LAYOUT\n"
+    "\n"
+    "  store NAME      Store CURR as resident image NAME (replacing any other)\n"
+    "  @NAME           Use resident image NAME, creating new image\n"
+    "  drop NAME       Remove resident image NAME\n"
+    "  list            List resident images\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
+    "  dup             Duplicate CURR, creating new image (the pixels are\n"
+    "                  only copied when one of them is modified)\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  rotangle DEG    Rotate CURR DEG degrees counter-clockwise (bilinear),\n"
+    "                  creating new image\n"
+    "  resize W,H      Resize CURR to WxH pixels, creating new image\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
@@ -56,12 +100,35 @@ static const char* USAGE =
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  median DX,DY    filter CURR using (2DX+1)x(2Dy+1) median filter\n"
+    "  gblur SIGMA     blur CURR using Gaussian filter with std. deviation SIGMA\n"
+    "  conv KFILE      convolve CURR with the integer kernel in KFILE\n"
+    "\n"
+    "  erode DX,DY     erode CURR with (2DX+1)x(2DY+1) rectangle (min filter)\n"
+    "  dilate DX,DY    dilate CURR with (2DX+1)x(2DY+1) rectangle (max filter)\n"
+    "  open DX,DY      open CURR (erode then dilate)\n"
+    "  close DX,DY     close CURR (dilate then erode)\n"
+    "\n"
+    "  edges           Sobel gradient magnitude of CURR, creating new image\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
     "  DX,DY           Displacement\n"
+    "  SIGMA           Standard deviation (in pixels)\n"
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
+    "  LAYOUT          raster, tiled or aligned (rows padded for SIMD)\n"
+    "  DEG             Angle in degrees\n"
+    "  KFILE           Text file with a kernel: its width and height (odd), its\n"
+    "                  coefficients row by row, and optionally: divisor D\n"
+    "                  (default: sum of coefficients, or 1 if not positive),\n"
+    "                  bias B (default 0), border clamp|mirror|wrap|zero\n"
+    "                  (pixels outside CURR, default clamp).  # starts a\n"
+    "                  comment.  E.g. sharpen: 3 3  0 -1 0  -1 5 -1  0 -1 0\n"
+    "\n"
+    "ENVIRONMENT:\n"
+    "  IMAGE_SIMD      Best instruction set to use: scalar, sse2, avx2 or\n"
+    "                  avx512 (default: the best one this CPU supports)\n"
     "\n"
     ;
 
@@ -69,11 +136,15 @@ static char* errors[] = {
   "Success",
   "Insufficient operands",
   "Insufficient images",
-  "Image buffer is full",
+  "Image buffer is full",   // (no longer used: the buffer grows as needed)
   "Image8bit failure: %s",
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "No resident image with that name",
+  "Invalid kernel file",
+  "No more images in the standard input",
+  "Standard input/output (-) cannot be used in server mode",
 };
 
 
@@ -85,143 +156,1007 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
+// The command line is processed in two phases.
+//
+// First, it is parsed into a list of operations.  Each version of each
+// image in the buffer is a "value": operations that create images (load,
+// create, rotate, ...) produce a new value in a new buffer position, and
+// operations that modify CURR in-place (neg, paste, blur, ...) consume the
+// value in that position and produce a new one that replaces it.
+// This makes a graph of operations linked by the values they use.
+//
+// Then, only the operations whose values are demanded by a result (save,
+// info, locate) are executed, in command line order (so that tic/toc still
+// measure what is between them).  Unused branches are skipped, and each
+// image is destroyed right after its last consumer runs.
+
+// Operation codes
+enum {
+  OP_LOAD, OP_SAVE, OP_INFO, OP_TIC, OP_TOC, OP_LAYOUT,
+  OP_NEG, OP_THR, OP_BRI,
+  OP_CREATE, OP_DUP, OP_ROTATE, OP_MIRROR, OP_CROP, OP_ROTANGLE, OP_RESIZE,
+  OP_PASTE, OP_BLEND, OP_LOCATE,
+  OP_BLUR, OP_MEDIAN, OP_GBLUR, OP_CONV, OP_MORPH, OP_EDGES,
+  OP_STORE, OP_DROP, OP_LIST,
+  OP_LOADREGION, OP_CONVERT,   // (made by fuseLoads)
+};
+
+struct op {
+  int code;
+  const char* name;   // operation name (or file name or @NAME, for OP_LOAD)
+  const char* arg;    // operand string (if any)
+  const char* file;   // file read by OP_LOADREGION or OP_CONVERT
+  int x, y, w, h;     // integer operands (x: layout to load in, for OP_LOAD)
+  double d;           // real operand
+  int cur;            // value used as CURR (-1 if none)
+  int pred;           // value used as PRED (-1 if none)
+  int out;            // value produced (-1 if none)
+  int pos;            // buffer position of CURR (or of the new image)
+  int needed;         // must be executed?
+};
+
+// Growable arrays
+struct tool {
+  struct op* ops;   // operations, in command line order
+  int nops;
+  int capops;
+  Image* val;       // images, indexed by value
+  int* uses;        // number of pending consumers of each value
+  int nvals;
+  int capvals;
+  int* buf;         // values in the image buffer I0, I1, ...
+  int n;            // number of images in the buffer
+  int capbuf;
+  ImageSaveJob* jobs;   // pending saves
+  int njobs;
+  int capjobs;
+  FILE* out;        // for the output of operations
+  int quiet;        // do not report progress on stderr?
+  int stdinReads;   // images read from the standard input
+  int server;       // in server mode (where "-" is not allowed)?
+};
+
+// Return array arr (of elements of size sz) resized to ncap elements.
+// Exits on allocation failure.
+static void* resize(void* arr, int ncap, size_t sz) {
+  void* p = realloc(arr, ncap * sz);
+  if (p == NULL) error(4, errno, "Out of memory");
+  return p;
+}
+
+// Capacity to grow an array that is full
+#define GROWCAP(cap) ((cap) > 0 ? 2 * (cap) : 16)
+
+// Create a new value, produced by an operation not yet executed.
+static int newValue(struct tool* t) {
+  if (t->nvals == t->capvals) {
+    t->capvals = GROWCAP(t->capvals);
+    t->val = (Image*)resize(t->val, t->capvals, sizeof(Image));
+    t->uses = (int*)resize(t->uses, t->capvals, sizeof(int));
+  }
+  t->val[t->nvals] = NULL;
+  t->uses[t->nvals] = 0;
+  return t->nvals++;
+}
+
+// Append an image value to the buffer, returning its position.
+static int pushValue(struct tool* t, int v) {
+  if (t->n == t->capbuf) {
+    t->capbuf = GROWCAP(t->capbuf);
+    t->buf = (int*)resize(t->buf, t->capbuf, sizeof(int));
   }
+  t->buf[t->n] = v;
+  return t->n++;
+}
 
-  ImageInit();
+// Parse the operation in av[*k] (and its operands), and append it to t.
+// Returns 0 on success, or an error number (index into errors[]).
+static int parseOp(struct tool* t, int ac, char* av[], int* k) {
+  int n = t->n;
+  if (t->nops == t->capops) {
+    t->capops = GROWCAP(t->capops);
+    t->ops = (struct op*)resize(t->ops, t->capops, sizeof(struct op));
+  }
+  struct op* o = &t->ops[t->nops];
+  memset(o, 0, sizeof(*o));
+  o->name = av[*k];
+  o->cur = o->pred = o->out = -1;
+  const char* name = av[*k];
 
-  int err = 0;
-  int x, y, w, h;
+  // Operations without operands
+  if (strcmp(name, "info") == 0) o->code = OP_INFO;
+  else if (strcmp(name, "tic") == 0) o->code = OP_TIC;
+  else if (strcmp(name, "toc") == 0) o->code = OP_TOC;
+  else if (strcmp(name, "neg") == 0) o->code = OP_NEG;
+  else if (strcmp(name, "rotate") == 0) o->code = OP_ROTATE;
+  else if (strcmp(name, "mirror") == 0) o->code = OP_MIRROR;
+  else if (strcmp(name, "dup") == 0) o->code = OP_DUP;
+  else if (strcmp(name, "locate") == 0) o->code = OP_LOCATE;
+  else if (strcmp(name, "edges") == 0) o->code = OP_EDGES;
+  else if (strcmp(name, "list") == 0) o->code = OP_LIST;
+  // Operations with one operand
+  else {
+    if (strcmp(name, "save") == 0) o->code = OP_SAVE;
+    else if (strcmp(name, "store") == 0) o->code = OP_STORE;
+    else if (strcmp(name, "drop") == 0) o->code = OP_DROP;
+    else if (strcmp(name, "layout") == 0) o->code = OP_LAYOUT;
+    else if (strcmp(name, "thr") == 0) o->code = OP_THR;
+    else if (strcmp(name, "bri") == 0) o->code = OP_BRI;
+    else if (strcmp(name, "create") == 0) o->code = OP_CREATE;
+    else if (strcmp(name, "crop") == 0) o->code = OP_CROP;
+    else if (strcmp(name, "rotangle") == 0) o->code = OP_ROTANGLE;
+    else if (strcmp(name, "resize") == 0) o->code = OP_RESIZE;
+    else if (strcmp(name, "paste") == 0) o->code = OP_PASTE;
+    else if (strcmp(name, "blend") == 0) o->code = OP_BLEND;
+    else if (strcmp(name, "blur") == 0) o->code = OP_BLUR;
+    else if (strcmp(name, "median") == 0) o->code = OP_MEDIAN;
+    else if (strcmp(name, "gblur") == 0) o->code = OP_GBLUR;
+    else if (strcmp(name, "conv") == 0) o->code = OP_CONV;
+    else if (strcmp(name, "erode") == 0 || strcmp(name, "dilate") == 0 ||
+             strcmp(name, "open") == 0 || strcmp(name, "close") == 0) o->code = OP_MORPH;
+    else o->code = OP_LOAD;  // image file (or resident image)
+    if (o->code != OP_LOAD) {
+      if (++*k >= ac) return 1;
+      o->arg = av[*k];
+    }
+  }
+  // In server mode, stdin and stdout carry requests and replies
+  if (t->server && ((o->code == OP_LOAD && strcmp(o->name, "-") == 0) ||
+                    (o->code == OP_SAVE && strcmp(o->arg, "-") == 0))) {
+    return 11;
+  }
+
+  // Check number of images needed and parse operands
+  switch (o->code) {
+  case OP_LOAD: case OP_CREATE: case OP_TIC: case OP_TOC:
+  case OP_DROP: case OP_LIST:
+    break;
+  case OP_PASTE: case OP_BLEND: case OP_LOCATE:
+    if (n < 2) return 2;
+    break;
+  default:
+    if (n < 1) return 2;
+  }
+  switch (o->code) {
+  case OP_LAYOUT:
+    if (strcmp(o->arg, "raster") == 0) o->x = IMAGE_RASTER;
+    else if (strcmp(o->arg, "tiled") == 0) o->x = IMAGE_TILED;
+    else if (strcmp(o->arg, "aligned") == 0) o->x = IMAGE_ALIGNED;
+    else return 5;
+    break;
+  case OP_THR: {
+    uint8 thr;
+    if (sscanf(o->arg, "%hhu", &thr) != 1) return 5;
+    o->x = thr;
+    break;
+  }
+  case OP_BRI: case OP_ROTANGLE:
+    if (sscanf(o->arg, "%lf", &o->d) != 1) return 5;
+    break;
+  case OP_GBLUR:
+    if (sscanf(o->arg, "%lf", &o->d) != 1) return 5;
+    if (o->d < 0.0) return 5;   // precondition check!
+    break;
+  case OP_CREATE:
+    if (sscanf(o->arg, "%d,%d", &o->w, &o->h) != 2) return 5;
+    if (o->w < 0 || o->h < 0) return 5;   // precondition check!
+    break;
+  case OP_RESIZE:
+    if (sscanf(o->arg, "%d,%d", &o->w, &o->h) != 2) return 5;
+    if (o->w <= 0 || o->h <= 0) return 5;   // precondition check!
+    break;
+  case OP_CROP:
+    if (sscanf(o->arg, "%d,%d,%d,%d", &o->x, &o->y, &o->w, &o->h) != 4) return 5;
+    break;
+  case OP_PASTE:
+    if (sscanf(o->arg, "%d,%d", &o->x, &o->y) != 2) return 5;
+    break;
+  case OP_BLEND:
+    if (sscanf(o->arg, "%d,%d,%lf", &o->x, &o->y, &o->d) != 3) return 5;
+    break;
+  case OP_BLUR:
+    if (sscanf(o->arg, "%d,%d", &o->x, &o->y) != 2) return 5;
+    break;
+  case OP_MEDIAN:
+    if (sscanf(o->arg, "%d,%d", &o->x, &o->y) != 2) return 5;
+    if (o->x < 0 || o->y < 0 || o->y >= 32768) return 5;   // precondition check!
+    break;
+  case OP_MORPH:
+    if (sscanf(o->arg, "%d,%d", &o->x, &o->y) != 2) return 5;
+    if (o->x < 0 || o->y < 0) return 5;   // precondition check!
+    break;
+  }
+
+  // Link the operation to the values it uses and produces
+  switch (o->code) {
+  case OP_TIC: case OP_TOC: case OP_DROP: case OP_LIST:
+    break;
+  case OP_LOAD: case OP_CREATE:
+    o->out = newValue(t);
+    o->pos = pushValue(t, o->out);
+    break;
+  case OP_DUP: case OP_ROTATE: case OP_MIRROR: case OP_CROP: case OP_ROTANGLE:
+  case OP_RESIZE: case OP_EDGES:
+    o->cur = t->buf[n-1];
+    o->out = newValue(t);
+    o->pos = pushValue(t, o->out);
+    break;
+  case OP_SAVE: case OP_INFO: case OP_STORE:
+    o->cur = t->buf[n-1];
+    o->pos = n-1;
+    break;
+  case OP_LOCATE:
+    o->cur = t->buf[n-1];
+    o->pred = t->buf[n-2];
+    o->pos = n-1;
+    break;
+  case OP_PASTE: case OP_BLEND:
+    o->pred = t->buf[n-2];
+    // fall through
+  default:  // in-place operations on CURR
+    o->cur = t->buf[n-1];
+    o->out = newValue(t);
+    o->pos = n-1;
+    t->buf[n-1] = o->out;
+  }
+  t->nops++;
+  return 0;
+}
+
+// File format to save an image file in, given its name.
+static int formatOfName(const char* filename) {
+  size_t len = strlen(filename);
+  if (len >= 4 && strcmp(filename + len - 4, ".i8z") == 0) return IMAGE_I8Z;
+  if (len >= 4 && strcmp(filename + len - 4, ".i8t") == 0) return IMAGE_I8T;
+  return IMAGE_PGM;
+}
+
+// Is filename a PBM (bitmap) file?  (Saved and loaded as binary images.)
+static int isPBM(const char* filename) {
+  size_t len = strlen(filename);
+  return len >= 4 && strcmp(filename + len - 4, ".pbm") == 0;
+}
+
+// Convolution kernel, as read from a kernel file
+struct kernel {
+  int w, h;
+  int* coef;    // h rows of w coefficients
+  int divisor;
+  int bias;
+  int border;
+};
+
+// Read the next word of kernel file f (skipping # comments) into buf, of
+// size n.  Returns 0 at the end of the file, or if the word is too long.
+static int nextWord(FILE* f, char* buf, size_t n) {
+  int c;
+  for (;;) {
+    while ((c = getc(f)) == ' ' || c == '\t' || c == '\n' || c == '\r') {}
+    if (c != '#') break;
+    while ((c = getc(f)) != '\n' && c != EOF) {}
+  }
+  size_t len = 0;
+  while (c != EOF && c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+    if (len + 1 == n) return 0;
+    buf[len++] = (char)c;
+    c = getc(f);
+  }
+  buf[len] = '\0';
+  return len > 0;
+}
+
+// Read the next word of kernel file f as an int in [min, max] into *v.
+static int nextInt(FILE* f, int* v, long min, long max) {
+  char word[32];
+  if (!nextWord(f, word, sizeof(word))) return 0;
+  char* end;
+  errno = 0;
+  long l = strtol(word, &end, 10);
+  if (*end != '\0' || errno != 0 || l < min || l > max) return 0;
+  *v = (int)l;
+  return 1;
+}
+
+// Parse the contents of kernel file f into k, checking the preconditions
+// of ImageConvolve.  Returns 0 if they are invalid.
+// (k->coef is allocated even then, and must be freed by the caller.)
+static int parseKernel(FILE* f, struct kernel* k) {
+  static const char* borders[] = { "clamp", "mirror", "wrap", "zero" };
+  if (!nextInt(f, &k->w, 1, 4095) || !nextInt(f, &k->h, 1, 4095)) return 0;
+  if (k->w % 2 == 0 || k->h % 2 == 0) return 0;   // precondition check!
+  k->coef = (int*)malloc(sizeof(int) * k->w * k->h);
+  if (k->coef == NULL) error(4, errno, "Out of memory");
+  long sum = 0;
+  long abssum = 0;
+  for (int i = 0; i < k->w * k->h; i++) {
+    if (!nextInt(f, &k->coef[i], -32767, 32767)) return 0;
+    sum += k->coef[i];
+    abssum += labs(k->coef[i]);
+  }
+  if (abssum >= (1 << 23)) return 0;   // precondition check!
+  k->divisor = sum > 0 && sum <= INT_MAX ? (int)sum : 1;
+  char word[32];
+  while (nextWord(f, word, sizeof(word))) {
+    if (strcmp(word, "divisor") == 0) {
+      if (!nextInt(f, &k->divisor, 1, INT_MAX)) return 0;
+    } else if (strcmp(word, "bias") == 0) {
+      if (!nextInt(f, &k->bias, INT_MIN, INT_MAX)) return 0;
+    } else if (strcmp(word, "border") == 0) {
+      if (!nextWord(f, word, sizeof(word))) return 0;
+      k->border = -1;
+      for (int b = IMAGE_BORDER_CLAMP; b <= IMAGE_BORDER_ZERO; b++) {
+        if (strcmp(word, borders[b]) == 0) k->border = b;
+      }
+      if (k->border < 0) return 0;
+    } else {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Read kernel file filename into k.
+// Returns 0 on success, or an error number (index into errors[]).
+// On success, k->coef must be freed by the caller.
+static int readKernel(const char* filename, struct kernel* k) {
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) return 9;
+  k->coef = NULL;
+  k->bias = 0;
+  k->border = IMAGE_BORDER_CLAMP;
+  errno = 0;
+  int ok = parseKernel(f, k) && !ferror(f);
+  if (!ok && errno == 0) errno = EINVAL;
+  fclose(f);
+  if (!ok) {
+    free(k->coef);
+    return 9;
+  }
+  return 0;
+}
+
+// Mark the operations that must be executed, and count how many of them
+// use each value.
+static void markNeeded(struct tool* t) {
+  // needed[v]: value v is used by some needed operation
+  char* needed = (char*)calloc(t->nvals > 0 ? t->nvals : 1, 1);
+  if (needed == NULL) error(4, errno, "Out of memory");
+  for (int i = t->nops - 1; i >= 0; i--) {
+    struct op* o = &t->ops[i];
+    switch (o->code) {
+    case OP_SAVE: case OP_INFO: case OP_LOCATE: case OP_TIC: case OP_TOC:
+    case OP_STORE: case OP_DROP: case OP_LIST:
+      o->needed = 1;
+      break;
+    case OP_LOAD:   // (images of the standard input must all be read)
+      o->needed = needed[o->out] || strcmp(o->name, "-") == 0;
+      break;
+    default:
+      o->needed = needed[o->out];
+    }
+    if (o->needed) {
+      if (o->cur >= 0) { needed[o->cur] = 1; t->uses[o->cur]++; }
+      if (o->pred >= 0) { needed[o->pred] = 1; t->uses[o->pred]++; }
+    }
+  }
+  free(needed);
+}
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
-
-  int k = 1;
-  while (k < ac) {
-    if (strcmp(av[k], "info") == 0) {
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Info on I%d\n", n-1);
-      uint8 min, max;
-      w = ImageWidth(img[n-1]);
-      h = ImageHeight(img[n-1]);
-      uint8 maxval = ImageMaxval(img[n-1]);
-      ImageStats(img[n-1], &min, &max);
-      printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
-      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
-    } else if (strcmp(av[k], "tic") == 0) {
-      InstrReset();
-    } else if (strcmp(av[k], "toc") == 0) {
-      InstrPrint();
-    } else if (strcmp(av[k], "neg") == 0) {
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
-    } else if (strcmp(av[k], "thr") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      uint8 thr;
-      if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
-      fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
-    } else if (strcmp(av[k], "bri") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      double factor;
-      if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
-      fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
-    } else if (strcmp(av[k], "create") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n >= N) { err = 3; break; }
-      if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
-      if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
-      img[n] = ImageCreate(w, h, PixMax);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "rotate") == 0) {
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
-      img[n] = ImageRotate(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "mirror") == 0) {
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
-      img[n] = ImageMirror(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "crop") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
-      img[n] = ImageCrop(img[n-1], x, y, w, h);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "paste") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 2) { err = 2; break; }
-      if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
-      ImagePaste(img[n-1], x, y, img[n-2]);
-    } else if (strcmp(av[k], "blend") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 2) { err = 2; break; }
-      double alpha;
-      if (sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
-      ImageBlend(img[n-1], x, y, img[n-2], alpha);
-    } else if (strcmp(av[k], "locate") == 0) {
-      if (n < 2) { err = 2; break; }
-      fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
-      if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
-        printf("# FOUND (%d,%d)\n", x, y);
-      } else {
-        printf("# NOTFOUND\n");
+// Fuse operations whose CURR is loaded from a file just for them into
+// operations on the file itself, so that the whole image is never loaded:
+// crop becomes OP_LOADREGION, and saving in tiled format becomes
+// OP_CONVERT.  Likewise, a change of layout is done by loading the image
+// in that layout in the first place.  (Called after markNeeded.)
+static void fuseLoads(struct tool* t) {
+  for (int i = 0; i < t->nops; i++) {
+    struct op* o = &t->ops[i];
+    int code;
+    if (!o->needed) continue;
+    if (o->code == OP_LAYOUT && t->uses[o->cur] == 1) {
+      for (struct op* p = t->ops; p < o; p++) {
+        if (p->code == OP_LOAD && p->out == o->cur && p->name[0] != '@' &&
+            !isPBM(p->name)) {
+          o->needed = 0;
+          t->uses[o->cur] = 0;
+          p->x = o->x;
+          p->out = o->out;
+          break;
+        }
       }
-    } else if (strcmp(av[k], "blur") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      int dx; int dy;
-      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
-      fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
-    } else if (strcmp(av[k], "save") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
-    } else {  // image file
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      continue;
+    }
+    if (o->code == OP_CROP) code = OP_LOADREGION;
+    else if (o->code == OP_SAVE && formatOfName(o->arg) == IMAGE_I8T) code = OP_CONVERT;
+    else continue;
+    if (t->uses[o->cur] != 1) continue;
+    for (struct op* p = t->ops; p < o; p++) {
+      if (p->code == OP_LOAD && p->out == o->cur && p->name[0] != '@' &&
+          !isPBM(p->name) && strcmp(p->name, "-") != 0) {
+        p->needed = 0;
+        t->uses[o->cur] = 0;
+        o->code = code;
+        o->file = p->name;
+        o->cur = -1;
+        break;
+      }
+    }
+  }
+}
+
+// The value v was used by an operation: destroy its image if that was its
+// last use.
+static void release(struct tool* t, int v) {
+  if (v >= 0 && --t->uses[v] == 0) {
+    ImageDestroy(&t->val[v]);
+  }
+}
+
+// Wait for the pending saves.  Returns 0 if one failed (with errno and
+// ImageErrMsg() set for the first that failed).
+static int waitJobs(struct tool* t) {
+  int success = 1;
+  for (int i = 0; i < t->njobs; i++) {
+    int errsave = errno;
+    if (!ImageSaveWait(&t->jobs[i]) && success) {
+      success = 0;
+    } else if (!success) {
+      errno = errsave;
+    }
+  }
+  t->njobs = 0;
+  return success;
+}
+
+// Before operation o reads file filename, wait for pending saves, if an
+// earlier operation saved it.  Returns 0 if a save failed.
+static int waitSaved(struct tool* t, struct op* o, const char* filename) {
+  if (strcmp(filename, "-") == 0) return 1;   // (stdin, not stdout)
+  for (struct op* p = t->ops; p < o; p++) {
+    if (p->code == OP_SAVE && p->needed && strcmp(p->arg, filename) == 0) {
+      return waitJobs(t);
+    }
+  }
+  return 1;
+}
+
+// Has the standard input ended (rather than holding another image)?
+static int inputEnded(void) {
+  int c = getc(stdin);
+  if (c == EOF) return feof(stdin);   // (errors are reported by ImageLoad)
+  ungetc(c, stdin);
+  return 0;
+}
+
+// Report progress on stderr (unless quiet).
+static void note(struct tool* t, const char* fmt, ...) {
+  if (t->quiet) return;
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
+
+// Resident images
+//
+// Images stored by name (store NAME), to be used by later operations
+// (@NAME).  In server mode, they stay in memory across requests, and are
+// shared by all workers.  The table holds clones (see ImageClone), so
+// storing and using them involves no copying, and they are never modified.
+
+struct resident {
+  char* name;
+  Image img;
+};
+
+static struct resident* residents = NULL;
+static int nresidents = 0;
+static int capresidents = 0;
+static pthread_rwlock_t residentLock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Index of resident image name, or -1.  (Call with residentLock held.)
+static int findResident(const char* name) {
+  for (int i = 0; i < nresidents; i++) {
+    if (strcmp(residents[i].name, name) == 0) return i;
+  }
+  return -1;
+}
+
+// Store (a clone of) img as resident image name, replacing any other
+// with that name.  Returns 0 on failure.
+static int storeResident(const char* name, Image img) {
+  Image copy = ImageClone(img);
+  if (copy == NULL) return 0;
+  char* s = strdup(name);
+  if (s == NULL) {
+    ImageDestroy(&copy);
+    return 0;
+  }
+  Image old = NULL;
+  pthread_rwlock_wrlock(&residentLock);
+  int i = findResident(name);
+  if (i >= 0) {
+    old = residents[i].img;
+    residents[i].img = copy;
+    free(s);
+  } else {
+    if (nresidents == capresidents) {
+      capresidents = GROWCAP(capresidents);
+      residents = (struct resident*)resize(residents, capresidents, sizeof(struct resident));
+    }
+    residents[nresidents].name = s;
+    residents[nresidents].img = copy;
+    nresidents++;
+  }
+  pthread_rwlock_unlock(&residentLock);
+  ImageDestroy(&old);
+  return 1;
+}
+
+// Get (a clone of) resident image name.
+// Sets (*found) to whether it exists, and returns NULL if not, or on failure.
+static Image fetchResident(const char* name, int* found) {
+  Image img = NULL;
+  pthread_rwlock_rdlock(&residentLock);
+  int i = findResident(name);
+  *found = (i >= 0);
+  if (i >= 0) img = ImageClone(residents[i].img);
+  pthread_rwlock_unlock(&residentLock);
+  return img;
+}
+
+// Remove resident image name.  Returns 0 if there was none.
+static int dropResident(const char* name) {
+  struct resident r = { NULL, NULL };
+  pthread_rwlock_wrlock(&residentLock);
+  int i = findResident(name);
+  if (i >= 0) {
+    r = residents[i];
+    residents[i] = residents[--nresidents];
+  }
+  pthread_rwlock_unlock(&residentLock);
+  free(r.name);
+  ImageDestroy(&r.img);
+  return i >= 0;
+}
+
+// List the resident images to out.
+static void listResidents(FILE* out) {
+  pthread_rwlock_rdlock(&residentLock);
+  for (int i = 0; i < nresidents; i++) {
+    Image img = residents[i].img;
+    fprintf(out, "# %s %dx%d\n", residents[i].name, ImageWidth(img), ImageHeight(img));
+  }
+  pthread_rwlock_unlock(&residentLock);
+}
+
+// Execute operation o.
+// Returns 0 on success, or an error number (index into errors[]).
+static int execOp(struct tool* t, struct op* o) {
+  Image cur = o->cur >= 0 ? t->val[o->cur] : NULL;
+  Image pred = o->pred >= 0 ? t->val[o->pred] : NULL;
+  Image res = NULL;   // new image created by the operation
+  int n = o->pos;
+  int x, y, w, h;
+
+  switch (o->code) {
+  case OP_INFO: {
+    note(t, "Info on I%d\n", n);
+    uint8 min, max;
+    w = ImageWidth(cur);
+    h = ImageHeight(cur);
+    uint8 maxval = ImageMaxval(cur);
+    ImageStats(cur, &min, &max);
+    fprintf(t->out, "# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
+    fprintf(t->out, "# Gray level range: [%hhu, %hhu]\n", min, max);
+    break;
+  }
+  case OP_TIC:
+    InstrReset();
+    break;
+  case OP_TOC:
+    InstrFPrint(t->out);
+    break;
+  case OP_LAYOUT:
+    note(t, "Changing layout of I%d to %s\n", n, o->arg);
+    if (ImageSetLayout(cur, o->x) == 0) return 4;
+    break;
+  case OP_NEG:
+    note(t, "Negating I%d\n", n);
+    if (ImageNegative(cur) == 0) return 4;
+    break;
+  case OP_THR:
+    note(t, "Thresholding I%d at %d\n", n, o->x);
+    if (ImageThreshold(cur, (uint8)o->x) == 0) return 4;
+    break;
+  case OP_BRI:
+    note(t, "Brightening I%d by %lf\n", n, o->d);
+    if (ImageBrighten(cur, o->d) == 0) return 4;
+    break;
+  case OP_CREATE:
+    note(t, "Creating black image (%d,%d) -> I%d\n", o->w, o->h, n);
+    res = ImageCreate(o->w, o->h, PixMax);
+    if (res == NULL) return 4;
+    break;
+  case OP_DUP:
+    note(t, "Duplicating I%d -> I%d\n", n-1, n);
+    res = ImageClone(cur);
+    if (res == NULL) return 4;
+    break;
+  case OP_ROTATE:
+    note(t, "Rotating I%d -> I%d\n", n-1, n);
+    res = ImageRotate(cur);
+    if (res == NULL) return 4;
+    break;
+  case OP_MIRROR:
+    note(t, "Mirroring I%d -> I%d\n", n-1, n);
+    res = ImageMirror(cur);
+    if (res == NULL) return 4;
+    break;
+  case OP_CROP:
+    x = o->x; y = o->y; w = o->w; h = o->h;
+    if (!ImageValidRect(cur, x, y, w, h)) return 5;   // precondition check!
+    note(t, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+    res = ImageCrop(cur, x, y, w, h);
+    if (res == NULL) return 4;
+    break;
+  case OP_LOADREGION:
+    if (!waitSaved(t, o, o->file)) return 4;
+    x = o->x; y = o->y; w = o->w; h = o->h;
+    note(t, "Loading %s (%d,%d,%d,%d) -> I%d\n", o->file, x, y, w, h, n);
+    if (w < 0 || h < 0) return 5;   // precondition check!
+    res = ImageLoadRegion(o->file, x, y, w, h);
+    if (res == NULL) return 4;
+    break;
+  case OP_CONVERT:
+    if (!waitSaved(t, o, o->file)) return 4;
+    note(t, "Converting %s -> %s\n", o->file, o->arg);
+    if (ImageConvertToTiled(o->file, o->arg) == 0) return 4;
+    break;
+  case OP_ROTANGLE:
+    note(t, "Rotating I%d by %.3f degrees -> I%d\n", n-1, o->d, n);
+    res = ImageRotateAngle(cur, o->d, 1);
+    if (res == NULL) return 4;
+    break;
+  case OP_RESIZE:
+    if (ImageWidth(cur) == 0 || ImageHeight(cur) == 0) return 5;
+    note(t, "Resizing I%d to (%d,%d) -> I%d\n", n-1, o->w, o->h, n);
+    res = ImageResize(cur, o->w, o->h);
+    if (res == NULL) return 4;
+    break;
+  case OP_EDGES:
+    note(t, "Edges of I%d -> I%d\n", n-1, n);
+    res = ImageSobel(cur, NULL);
+    if (res == NULL) return 4;
+    break;
+  case OP_PASTE:
+    x = o->x; y = o->y;
+    w = ImageWidth(pred);
+    h = ImageHeight(pred);
+    if (!ImageValidRect(cur, x, y, w, h)) return 6;
+    note(t, "Pasting I%d at I%d (%d,%d)\n", n-1, n, x, y);
+    if (ImagePaste(cur, x, y, pred) == 0) return 4;
+    break;
+  case OP_BLEND:
+    x = o->x; y = o->y;
+    w = ImageWidth(pred);
+    h = ImageHeight(pred);
+    if (!ImageValidRect(cur, x, y, w, h)) return 6;
+    note(t, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-1, n, x, y, o->d);
+    if (ImageBlend(cur, x, y, pred, o->d) == 0) return 4;
+    break;
+  case OP_LOCATE:
+    note(t, "Locating I%d in I%d\n", n-1, n);
+    if (ImageLocateSubImage(cur, &x, &y, pred)) {
+      fprintf(t->out, "# FOUND (%d,%d)\n", x, y);
+    } else {
+      fprintf(t->out, "# NOTFOUND\n");
+    }
+    break;
+  case OP_BLUR:
+    note(t, "Blur I%d with %dx%d mean filter\n", n, 2*o->x+1, 2*o->y+1);
+    if (ImageBlur(cur, o->x, o->y) == 0) return 4;
+    break;
+  case OP_MEDIAN:
+    note(t, "Median I%d with %dx%d filter\n", n, 2*o->x+1, 2*o->y+1);
+    if (ImageMedian(cur, o->x, o->y) == 0) return 4;
+    break;
+  case OP_GBLUR:
+    note(t, "Gaussian blur I%d with sigma=%.3f\n", n, o->d);
+    if (ImageGaussianBlur(cur, o->d) == 0) return 4;
+    break;
+  case OP_CONV: {
+    struct kernel k;
+    int err = readKernel(o->arg, &k);
+    if (err != 0) return err;
+    note(t, "Convolve I%d with %dx%d kernel %s\n", n, k.w, k.h, o->arg);
+    int ok = ImageConvolve(cur, k.coef, k.w, k.h, k.divisor, k.bias, k.border);
+    free(k.coef);
+    if (ok == 0) return 4;
+    break;
+  }
+  case OP_MORPH: {
+    note(t, "Morphology %s I%d with %lldx%lld rectangle\n", o->name, n,
+         2LL*o->x+1, 2LL*o->y+1);
+    int ok;
+    if (o->name[0] == 'e') ok = ImageErode(cur, o->x, o->y);
+    else if (o->name[0] == 'd') ok = ImageDilate(cur, o->x, o->y);
+    else if (o->name[0] == 'o') ok = ImageOpen(cur, o->x, o->y);
+    else ok = ImageClose(cur, o->x, o->y);
+    if (ok == 0) return 4;
+    break;
+  }
+  case OP_SAVE:
+    note(t, "Saving %s <- I%d\n", o->arg, n);
+    if (isPBM(o->arg)) {
+      BitImage bin = ImageThresholdBits(cur, (uint8)((ImageMaxval(cur) + 1) / 2));
+      int saved = bin != NULL && BitImageSave(bin, o->arg);
+      BitImageDestroy(&bin);
+      if (!saved) return 4;
+      break;
+    }
+    if (strcmp(o->arg, "-") == 0) {
+      // Written right away, so that it stays in order with the output of
+      // info, toc, etc. on the standard output
+      if (ImageSave(cur, o->arg) == 0) return 4;
+      break;
     }
+    if (t->njobs == t->capjobs) {
+      t->capjobs = GROWCAP(t->capjobs);
+      t->jobs = (ImageSaveJob*)resize(t->jobs, t->capjobs, sizeof(ImageSaveJob));
+    }
+    if (ImageSaveAsync(cur, o->arg, formatOfName(o->arg), &t->jobs[t->njobs]) == 0) return 4;
+    t->njobs++;
+    break;
+  case OP_STORE:
+    note(t, "Storing I%d as %s\n", n, o->arg);
+    if (storeResident(o->arg, cur) == 0) return 4;
+    break;
+  case OP_DROP:
+    note(t, "Dropping %s\n", o->arg);
+    if (dropResident(o->arg) == 0) return 8;
+    break;
+  case OP_LIST:
+    listResidents(t->out);
+    break;
+  case OP_LOAD:
+    if (o->name[0] == '@') {
+      int found;
+      note(t, "Using %s -> I%d\n", o->name, n);
+      res = fetchResident(o->name + 1, &found);
+      if (!found) return 8;
+      if (res == NULL) return 4;
+      break;
+    }
+    if (!waitSaved(t, o, o->name)) return 4;
+    if (strcmp(o->name, "-") == 0 && inputEnded()) return 10;
+    note(t, "Loading %s -> I%d\n", o->name, n);
+    if (isPBM(o->name)) {
+      BitImage bin = BitImageLoad(o->name);
+      if (bin == NULL) return 4;
+      res = BitImageToImage(bin, PixMax);
+      BitImageDestroy(&bin);
+    } else {
+      res = ImageLoadLayout(o->name, o->x);
+    }
+    if (res == NULL) return 4;
+    if (strcmp(o->name, "-") == 0) t->stdinReads++;
+    break;
+  }
+
+  if (o->out >= 0) {
+    if (res != NULL) {
+      t->val[o->out] = res;   // a new image
+    } else {
+      t->val[o->out] = cur;   // CURR modified in-place: pass it on
+      t->val[o->cur] = NULL;  // (it has no other consumers)
+    }
+  }
+  release(t, o->cur);
+  release(t, o->pred);
+  return 0;
+}
+
+// Run the pipeline of operations in av[0..ac-1], writing its output to
+// out, and reporting progress on stderr unless quiet.
+// If stdinReads != NULL, (*stdinReads) is set to the number of images it
+// read from the standard input.  It is NULL in server mode, where files
+// named "-" are rejected.
+// Returns 0 on success, or an error number (index into errors[]), with
+// errno and ImageErrMsg() set as appropriate.
+static int runPipeline(int ac, char* av[], FILE* out, int quiet,
+                       int* stdinReads) {
+  struct tool t;
+  memset(&t, 0, sizeof(t));
+  t.out = out;
+  t.quiet = quiet;
+  t.server = stdinReads == NULL;
+
+  // Parse all operations (up to the first error)
+  int err = 0;
+  int k = 0;
+  while (k < ac && (err = parseOp(&t, ac, av, &k)) == 0) {
     k++;
   }
-  
-  // Destroy remaining images
-  while (n > 0) {
-    ImageDestroy(&img[--n]);
+  int parseErr = err;
+
+  // Execute the needed ones
+  markNeeded(&t);
+  fuseLoads(&t);
+  err = 0;
+  for (int i = 0; i < t.nops && err == 0; i++) {
+    if (t.ops[i].needed) err = execOp(&t, &t.ops[i]);
+  }
+  // Wait for the background saves
+  if (waitJobs(&t) == 0 && err == 0) err = 4;
+  if (err == 0) err = parseErr;
+
+  if (stdinReads != NULL) *stdinReads = t.stdinReads;
+
+  // Destroy remaining images (only if execution stopped early)
+  int errsave = errno;
+  for (int v = 0; v < t.nvals; v++) {
+    ImageDestroy(&t.val[v]);
+  }
+  free(t.ops);
+  free(t.val);
+  free(t.uses);
+  free(t.buf);
+  free(t.jobs);
+  errno = errsave;
+  return err;
+}
+
+// Server mode
+//
+// Each request line is run as a separate pipeline (with its own image
+// buffer), and only resident images persist between requests.
+// (Instrumentation counters are shared, so tic/toc also count the work of
+// requests running concurrently in other workers.)
+
+// Split line into whitespace-separated words, stored in (*av), which is
+// grown as needed (its capacity is *cap).  Returns the number of words.
+static int splitWords(char* line, char*** av, int* cap) {
+  int n = 0;
+  for (char* w = strtok(line, " \t\r\n"); w != NULL; w = strtok(NULL, " \t\r\n")) {
+    if (n == *cap) {
+      *cap = GROWCAP(*cap);
+      *av = (char**)resize(*av, *cap, sizeof(char*));
+    }
+    (*av)[n++] = w;
+  }
+  return n;
+}
+
+// Serve the requests read from in, writing the replies to out.
+static void serve(FILE* in, FILE* out) {
+  char* line = NULL;
+  size_t size = 0;
+  char** av = NULL;
+  int cap = 0;
+  while (getline(&line, &size, in) != -1) {
+    int ac = splitWords(line, &av, &cap);
+    if (ac == 0) continue;
+    errno = 0;
+    int err = runPipeline(ac, av, out, 1, NULL);
+    if (err == 0) {
+      fprintf(out, "OK\n");
+    } else {
+      int errnum = errno;
+      fprintf(out, "ERROR ");
+      fprintf(out, errors[err], ImageErrMsg());
+      if (errnum != 0) fprintf(out, ": %s", strerror(errnum));
+      fprintf(out, "\n");
+    }
+    if (fflush(out) != 0) break;   // client is gone
+  }
+  free(line);
+  free(av);
+}
+
+// Queue of client connections waiting for a worker
+struct client {
+  int fd;
+  struct client* next;
+};
+static struct client* clientHead = NULL;
+static struct client* clientTail = NULL;
+static pthread_mutex_t clientLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t clientCond = PTHREAD_COND_INITIALIZER;
+
+// Worker thread: serve clients from the queue, one at a time.
+static void* worker(void* arg) {
+  (void)arg;
+  for (;;) {
+    pthread_mutex_lock(&clientLock);
+    while (clientHead == NULL) pthread_cond_wait(&clientCond, &clientLock);
+    struct client* c = clientHead;
+    clientHead = c->next;
+    if (clientHead == NULL) clientTail = NULL;
+    pthread_mutex_unlock(&clientLock);
+
+    int fd2 = dup(c->fd);
+    FILE* in = fdopen(c->fd, "r");
+    FILE* out = fd2 >= 0 ? fdopen(fd2, "w") : NULL;
+    if (in != NULL && out != NULL) serve(in, out);
+    if (in != NULL) fclose(in); else close(c->fd);
+    if (out != NULL) fclose(out); else if (fd2 >= 0) close(fd2);
+    free(c);
+  }
+  return NULL;
+}
+
+// Serve clients connecting to Unix socket path with nworkers threads.
+// Never returns (but exits on failure).
+static void serveSocket(const char* path, int nworkers) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) error(5, 0, "Socket path too long: %s", path);
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) error(4, errno, "Creating socket");
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);   // stale socket
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+    error(4, errno, "%s", path);
+  }
+  signal(SIGPIPE, SIG_IGN);   // (clients may go away)
+  for (int i = 0; i < nworkers; i++) {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, worker, NULL);
+    if (rc != 0) error(4, rc, "Starting workers");
+    pthread_detach(thread);
   }
+  for (;;) {
+    int c = accept(fd, NULL, NULL);
+    if (c < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      error(4, errno, "Accepting connection");
+    }
+    struct client* cl = (struct client*)malloc(sizeof(struct client));
+    if (cl == NULL) {
+      close(c);
+      continue;
+    }
+    cl->fd = c;
+    cl->next = NULL;
+    pthread_mutex_lock(&clientLock);
+    if (clientTail != NULL) clientTail->next = cl;
+    else clientHead = cl;
+    clientTail = cl;
+    pthread_cond_signal(&clientCond);
+    pthread_mutex_unlock(&clientLock);
+  }
+}
 
+int main(int ac, char* av[]) {
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  ImageInit();
+
+  if (strcmp(av[1], "-s") == 0) {
+    InstrGetCTU();   // calibrate now, rather than in the first toc
+    if (ac == 2) {
+      serve(stdin, stdout);
+      return 0;
+    }
+    long nworkers = ac > 3 ? atol(av[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers <= 0) nworkers = 1;
+    serveSocket(av[2], (int)nworkers);
+  }
+
+  // A pipeline that reads images from the standard input is run again
+  // for each of them, until the input ends.
+  int frames = 0;
+  int reads;
+  int err;
+  while ((err = runPipeline(ac - 1, av + 1, stdout, frames > 0, &reads)) == 0 &&
+         reads > 0) {
+    frames++;
+  }
+  if (err == 10 && frames > 0) err = 0;
   error(err, errno, errors[err], ImageErrMsg());
   return 0;
 }
-
@@ -9,7 +9,6 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,10 +17,17 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// The Calibrated Time Unit (CTU) is measured on the first InstrPrint
+/// (or InstrGetCTU), unless given in environment variable INSTR_CTU
+/// (in seconds) or found in the cache file (INSTR_CACHE, by default
+/// ~/.cache/instrCTU), where it is kept per CPU model and build.
+/// (Missing directories of the cache file are created.)
 
 #include "instrumentation.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
@@ -32,6 +38,7 @@ double cpu_time(void) ; ///
 // GNU/Linux and MacOS code to measure elapsed time
 //
 
+#include <sys/stat.h>
 #include <time.h>
 
 double cpu_time(void) {
@@ -79,26 +86,133 @@ char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
 /// Cpu_time read on previous reset (~seconds)
 double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
+/// Calibrated Time Unit (in seconds, valid after InstrGetCTU)
 double InstrCTU = 1.0;  ///extern
 
+// Has InstrCTU been found?
+static int calibrated = 0;
+
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
 void InstrCalibrate(void) { ///
   const int size = 4*1024;     // 2^12!
   const int mask = size - 1;
-  int array[size];  // alloc array in stack, not initialized on purpose
+  unsigned array[size];  // alloc array in stack, not initialized on purpose
+      // (unsigned, so that the sums below may wrap around)
   double time = cpu_time();
   srand((unsigned int)(time*1e9));
   for (int n = 0; n < 40000000; n++) {
     int i = rand() & mask;
     int j = rand() & mask;
     int k = rand() & mask;
-    array[k] ^= array[i] + array[j] + i*j;
+    array[k] ^= array[i] + array[j] + (unsigned)(i*j);
     //printf("%d %d %d\n", i, j, k);  // debug
   }
   InstrCTU = cpu_time() - time;
+  calibrated = 1;
+}
+
+// Name of the CTU cache file, in buf (of size n).  Returns 0 if none.
+static int cacheName(char* buf, size_t n) {
+  const char* name = getenv("INSTR_CACHE");
+  if (name != NULL) return snprintf(buf, n, "%s", name) < (int)n;
+  const char* dir = getenv("XDG_CACHE_HOME");
+  if (dir != NULL && dir[0] != '\0') {
+    return snprintf(buf, n, "%s/instrCTU", dir) < (int)n;
+  }
+  dir = getenv("HOME");
+  if (dir == NULL || dir[0] == '\0') return 0;
+  return snprintf(buf, n, "%s/.cache/instrCTU", dir) < (int)n;
+}
+
+// Create the missing parent directories of file name (as mkdir -p), with
+// mode 0700.  Failures are ignored (then the cache is just not written).
+static void makeParents(const char* name) {
+#if defined(__linux__) || defined(__APPLE__)
+  char dir[4096];
+  snprintf(dir, sizeof(dir), "%s", name);
+  for (char* p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    (void)mkdir(dir, 0700);   // (fails harmlessly if it exists)
+    *p = '/';
+  }
+#else
+  (void)name;
+#endif
+}
+
+// Key for the cache, in buf (of size n): the CPU model and the build of
+// this module (the CTU depends on both).
+static void cacheKey(char* buf, size_t n) {
+  char model[256] = "unknown";
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  if (f != NULL) {
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+      if (strncmp(line, "model name", 10) == 0) {
+        char* s = strchr(line, ':');
+        if (s != NULL) snprintf(model, sizeof(model), "%s", s + 1 + (s[1] == ' '));
+        break;
+      }
+    }
+    fclose(f);
+  }
+  model[strcspn(model, "\t\n")] = '\0';
+  snprintf(buf, n, "%s|%s %s", model, __DATE__, __TIME__);
+}
+
+// Get the Calibrated Time Unit, finding it first if not done yet
+double InstrGetCTU(void) { ///
+  if (calibrated) return InstrCTU;
+
+  // Given by the user?
+  const char* env = getenv("INSTR_CTU");
+  if (env != NULL) {
+    char* end;
+    double ctu = strtod(env, &end);
+    if (end != env && *end == '\0' && ctu > 0.0) {
+      InstrCTU = ctu;
+      calibrated = 1;
+      return InstrCTU;
+    }
+  }
+
+  // In the cache?  (Lines with: key TAB ctu)
+  char name[4096];
+  char key[512];
+  int cached = cacheName(name, sizeof(name));
+  cacheKey(key, sizeof(key));
+  if (cached) {
+    FILE* f = fopen(name, "r");
+    if (f != NULL) {
+      char line[1024];
+      size_t len = strlen(key);
+      while (fgets(line, sizeof(line), f) != NULL) {
+        double ctu;
+        if (strncmp(line, key, len) == 0 && line[len] == '\t' &&
+            sscanf(line + len + 1, "%lf", &ctu) == 1 && ctu > 0.0) {
+          InstrCTU = ctu;
+          calibrated = 1;
+          break;
+        }
+      }
+      fclose(f);
+      if (calibrated) return InstrCTU;
+    }
+  }
+
+  // Measure it, and add it to the cache (if possible)
+  InstrCalibrate();
+  if (cached) {
+    makeParents(name);
+    FILE* f = fopen(name, "a");
+    if (f != NULL) {
+      fprintf(f, "%s\t%.9g\n", key, InstrCTU);
+      fclose(f);
+    }
+  }
+  return InstrCTU;
 }
 
 /// Reset counters to zero and store cpu_time.
@@ -110,20 +224,26 @@ void InstrReset(void) { ///
 
 // Print times and all named counter values
 void InstrPrint(void) { ///
+  InstrFPrint(stdout);
+}
+
+// Print times and all named counter values to file f
+void InstrFPrint(FILE* f) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
   // compute time in calibrated time units:
-  double caltime = time / InstrCTU;
+  // (calibrating, if needed, after measuring time)
+  double caltime = time / InstrGetCTU();
 
-  printf("#%14.15s\t%15.15s", "time", "caltime");
+  fprintf(f, "#%14.15s\t%15.15s", "time", "caltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15.15s", InstrName[i]);
-  puts("");
-  printf("%15.6f\t%15.6f", time, caltime);
+      fprintf(f, "\t%15.15s", InstrName[i]);
+  fputs("\n", f);
+  fprintf(f, "%15.6f\t%15.6f", time, caltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
-  puts("");
+      fprintf(f, "\t%15lu", InstrCount[i]);  
+  fputs("\n", f);
 }
 
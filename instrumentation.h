@@ -9,7 +9,6 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,10 +17,18 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// The Calibrated Time Unit (CTU) is measured on the first InstrPrint
+/// (or InstrGetCTU), unless given in environment variable INSTR_CTU
+/// (in seconds) or found in the cache file (INSTR_CACHE, by default
+/// ~/.cache/instrCTU), where it is kept per CPU model and build.
+/// (Missing directories of the cache file are created.)
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
+#include <stdio.h>
+
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
@@ -37,7 +44,7 @@ extern char* InstrName[NUMCOUNTERS];  ///extern
 /// Cpu_time read on previous reset (~seconds)
 extern double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
+/// Calibrated Time Unit (in seconds, valid after InstrGetCTU)
 extern double InstrCTU;  ///extern
 
 /// Find the Calibrated Time Unit (CTU).
@@ -45,10 +52,18 @@ extern double InstrCTU;  ///extern
 /// a reasonably cpu-independent time unit.
 void InstrCalibrate(void) ;
 
+/// Get the Calibrated Time Unit, finding it first if not done yet
+/// (from INSTR_CTU, the cache file, or else with InstrCalibrate).
+double InstrGetCTU(void) ;
+
 /// Reset counters to zero and store cpu_time.
 void InstrReset(void) ;
 
+/// Print times and all named counter values (to stdout).
 void InstrPrint(void) ;
 
+/// Print times and all named counter values to file f.
+void InstrFPrint(FILE* f) ;
+
 #endif
 
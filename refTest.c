@@ -0,0 +1,610 @@
+// refTest - Check image operations against brute-force references.
+//
+// Runs operations of image8bit on random images, in every layout, and
+// checks their results against direct evaluations of their definitions.
+// Exits with status 1 if any result differs.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <errno.h>
+#include <error.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "image8bit.h"
+
+static const int layouts[] = { IMAGE_RASTER, IMAGE_TILED, IMAGE_ALIGNED };
+static const char* layoutNames[] = { "raster", "tiled", "aligned" };
+#define NLAYOUTS 3
+
+static int checks;   // results checked (by all checks)
+static int bad;      // mismatches found
+
+static int randRange(int lo, int hi) {
+  return lo + rand() % (hi - lo + 1);
+}
+
+// Random image: levels in [0, maxval], or only a few levels (so that
+// there are many ties) if few is nonzero.
+static Image randomImage(int w, int h, int maxval, int layout, int few) {
+  Image img = ImageCreateLayout(w, h, (uint8)maxval, layout);
+  if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      int v = few ? rand() % 4 * maxval / 3 : rand() % (maxval + 1);
+      ImageSetPixel(img, x, y, (uint8)v);
+    }
+  }
+  return img;
+}
+
+// Are a and b the same image?
+static int sameImage(Image a, Image b) {
+  if (ImageWidth(a) != ImageWidth(b) || ImageHeight(a) != ImageHeight(b) ||
+      ImageMaxval(a) != ImageMaxval(b)) {
+    return 0;
+  }
+  for (int y = 0; y < ImageHeight(a); y++) {
+    for (int x = 0; x < ImageWidth(a); x++) {
+      if (ImageGetPixel(a, x, y) != ImageGetPixel(b, x, y)) return 0;
+    }
+  }
+  return 1;
+}
+
+// Count a result, which is right if ok: if not, report it (as printf).
+static void result(int ok, const char* fmt, ...) {
+  checks++;
+  if (ok) return;
+  va_list ap;
+  va_start(ap, fmt);
+  printf("MISMATCH: ");
+  vprintf(fmt, ap);
+  printf("\n");
+  va_end(ap);
+  bad++;
+}
+
+// Clone of img, exiting on failure.
+static Image clone(Image img) {
+  Image out = ImageClone(img);
+  if (out == NULL) error(2, errno, "Cloning image: %s", ImageErrMsg());
+  return out;
+}
+
+// Exit if an operation failed.
+static void must(int ok, const char* what) {
+  if (!ok) error(2, errno, "%s: %s", what, ImageErrMsg());
+}
+
+
+// Median filter
+
+// Brute-force ImageMedian of img, into a new raster image: the lower
+// median of the window clipped to the image.
+static Image refMedian(Image img, int dx, int dy) {
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  Image out = ImageCreate(w, h, (uint8)ImageMaxval(img));
+  if (out == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      size_t hist[256] = { 0 };
+      int n = 0;
+      for (int j = y - dy; j <= y + dy; j++) {
+        for (int i = x - dx; i <= x + dx; i++) {
+          if (0 <= i && i < w && 0 <= j && j < h) {
+            hist[ImageGetPixel(img, i, j)]++;
+            n++;
+          }
+        }
+      }
+      // Level of the element of rank (n-1)/2 in sorted order
+      int v = 0;
+      for (size_t c = hist[0]; c <= (size_t)(n - 1) / 2; c += hist[++v]) {}
+      ImageSetPixel(out, x, y, (uint8)v);
+    }
+  }
+  return out;
+}
+
+static void checkMedian(void) {
+  for (int n = 0; n < 120; n++) {
+    int w = randRange(1, n % 2 ? 9 : 90);
+    int h = randRange(1, 12);
+    int layout = n % NLAYOUTS;
+    Image img = randomImage(w, h, 255, layouts[layout], n % 4 == 0);
+    // Windows larger than the image, and even-count windows (at borders,
+    // or of even width)
+    int dx = n % 5 == 0 ? w + randRange(0, 5) : randRange(0, 4);
+    int dy = n % 7 == 0 ? h + randRange(0, 5) : randRange(0, 4);
+    Image ref = refMedian(img, dx, dy);
+    Image out = clone(img);
+    must(ImageMedian(out, dx, dy), "Median");
+    result(sameImage(ref, out), "median %d,%d of %dx%d %s image",
+           dx, dy, w, h, layoutNames[layout]);
+    ImageDestroy(&out);
+    ImageDestroy(&ref);
+    ImageDestroy(&img);
+  }
+}
+
+
+// Morphology
+
+// Brute-force min (or max, if isMax) filter of img, into a new raster
+// image: the min (max) of the window clipped to the image.
+static Image refMorph(Image img, int dx, int dy, int isMax) {
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  Image out = ImageCreate(w, h, (uint8)ImageMaxval(img));
+  if (out == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      int v = isMax ? 0 : 255;
+      for (int j = y - dy; j <= y + dy; j++) {
+        for (int i = x - dx; i <= x + dx; i++) {
+          if (0 <= i && i < w && 0 <= j && j < h) {
+            int p = ImageGetPixel(img, i, j);
+            if (isMax ? p > v : p < v) v = p;
+          }
+        }
+      }
+      ImageSetPixel(out, x, y, (uint8)v);
+    }
+  }
+  return out;
+}
+
+static void checkMorph(void) {
+  static const char* names[4] = { "erode", "dilate", "open", "close" };
+  static int (*const ops[4])(Image, int, int) = {
+    ImageErode, ImageDilate, ImageOpen, ImageClose
+  };
+  for (int n = 0; n < 240; n++) {
+    int w = randRange(1, n % 2 ? 9 : 150);
+    int h = randRange(1, 12);
+    int layout = n % NLAYOUTS;
+    int op = n / NLAYOUTS % 4;
+    Image img = randomImage(w, h, randRange(1, 255), layouts[layout], 0);
+    // Windows clipped by the borders, up to (and beyond) the whole image
+    int dx = n % 5 == 0 ? w + randRange(0, 1000) : randRange(0, 6);
+    int dy = n % 7 == 0 ? h + randRange(0, 1000) : randRange(0, 6);
+    Image ref = refMorph(img, dx, dy, op == 1 || op == 3);
+    if (op >= 2) {   // and then the other filter
+      Image t = ref;
+      ref = refMorph(t, dx, dy, op == 2);
+      ImageDestroy(&t);
+    }
+    Image out = clone(img);
+    must(ops[op](out, dx, dy), names[op]);
+    result(sameImage(ref, out), "%s %d,%d of %dx%d %s image",
+           names[op], dx, dy, w, h, layoutNames[layout]);
+    ImageDestroy(&out);
+    ImageDestroy(&ref);
+    ImageDestroy(&img);
+  }
+}
+
+
+// Resizing
+
+// Is out the integer-ratio downscale of img by (kx, ky), of size
+// (ceil(w/kx), ceil(h/ky))?  Each pixel must be the mean of a kx x ky
+// block, rounded to nearest, with halves rounded up (or either way, if
+// anyHalf is nonzero: fixed-point weights such as 1/3 are not exact).
+// Blocks that would cross the right or bottom edge use its last column
+// or row instead (as ImageBuildPyramid does for odd sizes).
+static int isBlockMeans(Image out, Image img, int kx, int ky, int anyHalf) {
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  int ow = (w + kx - 1) / kx;
+  int oh = (h + ky - 1) / ky;
+  if (ImageWidth(out) != ow || ImageHeight(out) != oh ||
+      ImageMaxval(out) != ImageMaxval(img)) {
+    return 0;
+  }
+  for (int y = 0; y < oh; y++) {
+    for (int x = 0; x < ow; x++) {
+      int sum = 0;
+      for (int j = y * ky; j < (y + 1) * ky; j++) {
+        for (int i = x * kx; i < (x + 1) * kx; i++) {
+          sum += ImageGetPixel(img, i < w ? i : w - 1, j < h ? j : h - 1);
+        }
+      }
+      int n = kx * ky;
+      int v = ImageGetPixel(out, x, y);
+      int half = (2 * sum) % n == 0 && (2 * sum / n) % 2 == 1;
+      if (v != (2 * sum + n) / (2 * n) && !(anyHalf && half && v == sum / n)) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+static void checkResize(void) {
+  for (int n = 0; n < 150; n++) {
+    int layout = n % NLAYOUTS;
+    // Integer-ratio downscale: the mean of each block
+    int kx = randRange(1, 5);
+    int ky = randRange(1, 5);
+    int ow = randRange(1, n % 2 ? 4 : 40);
+    int oh = randRange(1, 6);
+    Image img = randomImage(ow * kx, oh * ky, 255, layouts[layout], 0);
+    Image out = ImageResize(img, ow, oh);
+    must(out != NULL, "Resize");
+    // (Ratios that are powers of 2 have exact weights)
+    int exact = (kx & (kx - 1)) == 0 && (ky & (ky - 1)) == 0;
+    result(isBlockMeans(out, img, kx, ky, !exact),
+           "resize of %dx%d %s image to %dx%d",
+           ow * kx, oh * ky, layoutNames[layout], ow, oh);
+    ImageDestroy(&out);
+    ImageDestroy(&img);
+
+    // Pyramid: each level is the 2x2 means of the one above
+    int w = randRange(1, n % 2 ? 9 : 150);
+    int h = randRange(1, 20);
+    img = randomImage(w, h, 255, layouts[layout], 0);
+    Image pyr[4];
+    int levels = ImageBuildPyramid(img, 4, pyr);
+    must(levels >= 0, "Pyramid");
+    Image prev = img;
+    for (int k = 0; k < levels; k++) {
+      result(isBlockMeans(pyr[k], prev, 2, 2, 0),
+             "pyramid level %d of %dx%d %s image",
+             k, w, h, layoutNames[layout]);
+      prev = pyr[k];
+    }
+    for (int k = 0; k < levels; k++) ImageDestroy(&pyr[k]);
+    ImageDestroy(&img);
+  }
+}
+
+
+// Rotation
+
+// Rotation by multiples of 90 degrees is exact, with either sampling:
+// ImageRotateAngle must give ImageRotate applied that many times.
+static void checkRotate(void) {
+  for (int n = 0; n < 60; n++) {
+    int layout = n % NLAYOUTS;
+    int w = randRange(1, n % 2 ? 9 : 150);
+    int h = randRange(1, 70);
+    Image img = randomImage(w, h, 255, layouts[layout], 0);
+    Image ref = clone(img);
+    for (int turns = 1; turns <= 4; turns++) {
+      Image t = ImageRotate(ref);
+      must(t != NULL, "Rotate");
+      ImageDestroy(&ref);
+      ref = t;
+      for (int bilinear = 0; bilinear <= 1; bilinear++) {
+        Image out = ImageRotateAngle(img, 90.0 * turns, bilinear);
+        must(out != NULL, "Rotate by angle");
+        result(sameImage(ref, out), "rotangle %d (%s) of %dx%d %s image",
+               90 * turns, bilinear ? "bilinear" : "nearest", w, h,
+               layoutNames[layout]);
+        ImageDestroy(&out);
+      }
+    }
+    ImageDestroy(&ref);
+    ImageDestroy(&img);
+  }
+}
+
+
+// Incremental blur
+
+// After changes to an image (pastes, blends and set pixels, or an
+// operation on the whole image), ImageBlurUpdate must give the same
+// result as blurring the image from scratch.
+static void checkBlurUpdate(void) {
+  for (int n = 0; n < 90; n++) {
+    int layout = n % NLAYOUTS;
+    int w = randRange(1, n % 2 ? 12 : 150);
+    int h = randRange(1, 40);
+    int dx = randRange(0, n % 5 == 0 ? w + 2 : 4);
+    int dy = randRange(0, n % 7 == 0 ? h + 2 : 4);
+    Image img = randomImage(w, h, 255, layouts[layout], 0);
+    Image blurred = ImageBlurred(img, dx, dy);
+    must(blurred != NULL, "Blurred");
+    for (int round = 0; round < 4; round++) {
+      int changes = randRange(1, 3);
+      for (int c = 0; c < changes; c++) {
+        int sw = randRange(1, w);
+        int sh = randRange(1, h);
+        int x = randRange(0, w - sw);
+        int y = randRange(0, h - sh);
+        Image sub = randomImage(sw, sh, 255, layouts[rand() % NLAYOUTS], 0);
+        switch ((n + round + c) % 4) {
+        case 0: must(ImagePaste(img, x, y, sub), "Paste"); break;
+        case 1: must(ImageBlend(img, x, y, sub, 0.4), "Blend"); break;
+        case 2: ImageSetPixel(img, x, y, (uint8)rand()); break;
+        default:   // (makes all of img dirty)
+          if (round == 3) must(ImageNegative(img), "Negative");
+          else ImageSetPixel(img, w - 1 - x, h - 1 - y, (uint8)rand());
+        }
+        ImageDestroy(&sub);
+      }
+      must(ImageBlurUpdate(img, blurred, dx, dy), "Blur update");
+      Image ref = clone(img);
+      must(ImageBlur(ref, dx, dy), "Blur");
+      result(sameImage(ref, blurred), "blur update %d,%d of %dx%d %s image, "
+             "round %d", dx, dy, w, h, layoutNames[layout], round);
+      ImageDestroy(&ref);
+    }
+    ImageDestroy(&blurred);
+    ImageDestroy(&img);
+  }
+}
+
+
+// Statistics
+
+// Do the cached statistics of img (kept up to date by the operations)
+// agree with a fresh scan of its pixels?
+static int sameStats(Image img) {
+  size_t hist[256] = { 0 };
+  uint64_t sum = 0;
+  for (int y = 0; y < ImageHeight(img); y++) {
+    for (int x = 0; x < ImageWidth(img); x++) {
+      uint8 v = ImageGetPixel(img, x, y);
+      hist[v]++;
+      sum += v;
+    }
+  }
+  int min = 0, max = 255;
+  while (min < 255 && hist[min] == 0) min++;
+  while (max > 0 && hist[max] == 0) max--;
+  size_t h[256];
+  uint8 smin, smax;
+  ImageHistogram(img, h);
+  ImageStats(img, &smin, &smax);
+  for (int v = 0; v < 256; v++) {
+    if (h[v] != hist[v]) return 0;
+  }
+  return smin == min && smax == max && ImageSum(img) == sum;
+}
+
+// After each operation that updates the statistics of an image (rather
+// than dropping them), they must agree with a fresh scan.
+static void checkStats(void) {
+  static const char* names[6] = {
+    "neg", "thr", "bri", "paste", "blend", "set pixel"
+  };
+  for (int n = 0; n < 120; n++) {
+    int layout = n % NLAYOUTS;
+    int w = randRange(1, n % 2 ? 12 : 150);
+    int h = randRange(1, 40);
+    int maxval = randRange(1, 255);
+    Image img = randomImage(w, h, maxval, layouts[layout], n % 4 == 0);
+    for (int k = 0; k < 6; k++) {
+      uint8 min, max;
+      ImageStats(img, &min, &max);   // (so that they are cached)
+      int op = (n + k) % 6;
+      int sw = randRange(1, w);
+      int sh = randRange(1, h);
+      int x = randRange(0, w - sw);
+      int y = randRange(0, h - sh);
+      Image sub = randomImage(sw, sh, maxval, layouts[rand() % NLAYOUTS], 0);
+      switch (op) {
+      case 0: must(ImageNegative(img), "Negative"); break;
+      case 1: must(ImageThreshold(img, (uint8)rand()), "Threshold"); break;
+      case 2: must(ImageBrighten(img, randRange(0, 300) / 100.0), "Brighten");
+              break;
+      case 3: must(ImagePaste(img, x, y, sub), "Paste"); break;
+      case 4: must(ImageBlend(img, x, y, sub, 0.3), "Blend"); break;
+      default: ImageSetPixel(img, x, y, (uint8)(rand() % (maxval + 1)));
+      }
+      ImageDestroy(&sub);
+      result(sameStats(img), "stats after %s of %dx%d %s image",
+             names[op], w, h, layoutNames[layout]);
+    }
+    ImageDestroy(&img);
+  }
+}
+
+
+// Multi-subimage search
+
+// Does sub occur in img at (x, y)?  (Pixel by pixel.)
+static int occursAt(Image img, int x, int y, Image sub) {
+  for (int j = 0; j < ImageHeight(sub); j++) {
+    for (int i = 0; i < ImageWidth(sub); i++) {
+      if (ImageGetPixel(img, x + i, y + j) != ImageGetPixel(sub, i, j)) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+// ImageLocateMany must find every occurrence of each subimage, as a
+// search at every position does, in the same (sorted) order.
+static void checkLocateMany(void) {
+  enum { NSUB = 12 };
+  for (int n = 0; n < 60; n++) {
+    int layout = n % NLAYOUTS;
+    int w = randRange(1, n % 2 ? 12 : 150);
+    int h = randRange(1, 40);
+    // (Few levels, so that small subimages occur many times)
+    Image img = randomImage(w, h, 255, layouts[layout], n % 3 != 0);
+    Image sub[NSUB];
+    for (int k = 0; k < NSUB; k++) {
+      int sw = randRange(1, k % 3 == 0 ? 3 : w + 1);
+      int sh = randRange(1, k % 3 == 0 ? 2 : h + 1);
+      if (k % 2 && sw <= w && sh <= h) {   // a crop of img (found at least once)
+        sub[k] = ImageCrop(img, randRange(0, w - sw), randRange(0, h - sh),
+                           sw, sh);
+        must(sub[k] != NULL, "Crop");
+        must(ImageSetLayout(sub[k], layouts[rand() % NLAYOUTS]), "Layout");
+      } else {   // (maybe larger than img)
+        sub[k] = randomImage(sw, sh, 255, layouts[rand() % NLAYOUTS], 1);
+      }
+    }
+    ImageMatch* m;
+    int count = ImageLocateMany(img, sub, NSUB, &m);
+    must(count >= 0, "Locate many");
+    // Occurrences in sorted order: by position (y, then x), then index
+    int i = 0;
+    int ok = 1;
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        for (int k = 0; k < NSUB; k++) {
+          if (x + ImageWidth(sub[k]) > w || y + ImageHeight(sub[k]) > h ||
+              !occursAt(img, x, y, sub[k])) {
+            continue;
+          }
+          ok = ok && i < count && m[i].index == k && m[i].x == x && m[i].y == y;
+          i++;
+        }
+      }
+    }
+    result(ok && i == count, "locate many in %dx%d %s image: "
+           "%d occurrences found, %d expected",
+           w, h, layoutNames[layout], count, i);
+    free(m);
+    for (int k = 0; k < NSUB; k++) ImageDestroy(&sub[k]);
+    ImageDestroy(&img);
+  }
+}
+
+
+// Binary images
+
+// Random binary image (mostly white, if dense is nonzero, so that
+// erosions do not make it all black).
+static BitImage randomBits(int w, int h, int dense) {
+  BitImage bin = BitImageCreate(w, h);
+  if (bin == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      BitImageSetPixel(bin, x, y, dense ? rand() % 8 != 0 : rand() % 2);
+    }
+  }
+  return bin;
+}
+
+// 8-bit image of bin (white is 255), exiting on failure.
+static Image imageOfBits(BitImage bin) {
+  Image img = BitImageToImage(bin, 255);
+  if (img == NULL) error(2, errno, "Converting image: %s", ImageErrMsg());
+  return img;
+}
+
+// Binary operations must give the results of the corresponding 8-bit
+// operations on 0/255 images (morphology and paste), or of their
+// definitions pixel by pixel (bitwise operations).  Widths cross word
+// boundaries.
+static void checkBits(void) {
+  static const char* bitNames[4] = { "and", "or", "xor", "not" };
+  for (int n = 0; n < 120; n++) {
+    int layout = n % NLAYOUTS;
+    int w = randRange(1, n % 2 ? 70 : 200);
+    int h = randRange(1, 20);
+    BitImage bin = randomBits(w, h, n % 2);
+    Image img = imageOfBits(bin);
+    must(ImageSetLayout(img, layouts[layout]), "Layout");
+
+    // Morphology (windows clipped by the borders, or beyond the image)
+    int dx = n % 5 == 0 ? w + randRange(0, 100) : randRange(0, 5);
+    int dy = n % 7 == 0 ? h + randRange(0, 100) : randRange(0, 5);
+    int isMax = n / 2 % 2;
+    BitImage bout = randomBits(w, h, 0);
+    BitImagePaste(bout, 0, 0, bin);
+    Image ref = clone(img);
+    must((isMax ? BitImageDilate : BitImageErode)(bout, dx, dy), "Bit morphology");
+    must((isMax ? ImageDilate : ImageErode)(ref, dx, dy), "Morphology");
+    Image out = imageOfBits(bout);
+    result(sameImage(ref, out), "bit %s %d,%d of %dx%d image (%s)",
+           isMax ? "dilate" : "erode", dx, dy, w, h, layoutNames[layout]);
+    ImageDestroy(&out);
+    ImageDestroy(&ref);
+    BitImageDestroy(&bout);
+
+    // Paste
+    int sw = randRange(1, w);
+    int sh = randRange(1, h);
+    int x = randRange(0, w - sw);
+    int y = randRange(0, h - sh);
+    BitImage bsub = randomBits(sw, sh, 0);
+    Image sub = imageOfBits(bsub);
+    bout = randomBits(w, h, 0);
+    BitImagePaste(bout, 0, 0, bin);
+    BitImagePaste(bout, x, y, bsub);
+    ref = clone(img);
+    must(ImagePaste(ref, x, y, sub), "Paste");
+    out = imageOfBits(bout);
+    result(sameImage(ref, out), "bit paste of %dx%d at (%d,%d) of %dx%d image",
+           sw, sh, x, y, w, h);
+    ImageDestroy(&out);
+    ImageDestroy(&ref);
+    ImageDestroy(&sub);
+    BitImageDestroy(&bsub);
+    BitImageDestroy(&bout);
+
+    // Bitwise operations, and count
+    BitImage other = randomBits(w, h, 0);
+    for (int op = 0; op < 4; op++) {
+      bout = randomBits(w, h, 0);
+      BitImagePaste(bout, 0, 0, bin);
+      switch (op) {
+      case 0: BitImageAnd(bout, other); break;
+      case 1: BitImageOr(bout, other); break;
+      case 2: BitImageXor(bout, other); break;
+      default: BitImageNot(bout);
+      }
+      int ok = 1;
+      size_t white = 0;
+      for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+          int a = BitImageGetPixel(bin, i, j);
+          int b = BitImageGetPixel(other, i, j);
+          int v = op == 0 ? a & b : op == 1 ? a | b : op == 2 ? a ^ b : !a;
+          ok = ok && BitImageGetPixel(bout, i, j) == v;
+          white += v;
+        }
+      }
+      result(ok && BitImageCount(bout) == white, "bit %s of %dx%d image",
+             bitNames[op], w, h);
+      BitImageDestroy(&bout);
+    }
+    BitImageDestroy(&other);
+    ImageDestroy(&img);
+    BitImageDestroy(&bin);
+  }
+}
+
+
+// Checks, by name
+static const struct {
+  const char* name;
+  void (*run)(void);
+} tests[] = {
+  { "median", checkMedian },
+  { "morph", checkMorph },
+  { "resize", checkResize },
+  { "rotate", checkRotate },
+  { "blur", checkBlurUpdate },
+  { "stats", checkStats },
+  { "locate", checkLocateMany },
+  { "bits", checkBits },
+};
+
+int main(int argc, char* argv[]) {
+  if (argc != 1) {
+    error(1, 0, "Usage: refTest");
+  }
+  ImageInit();
+  srand(2025);
+  int failures = 0;
+  for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+    checks = bad = 0;
+    tests[i].run();
+    printf("%-8s %s (%d results checked)\n", tests[i].name,
+           bad == 0 ? "OK" : "FAILED", checks);
+    failures += bad;
+  }
+  return failures == 0 ? 0 : 1;
+}
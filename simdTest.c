@@ -0,0 +1,269 @@
+// simdTest - Check the vector kernels of image8bit against the scalar ones.
+//
+// Runs the operations that use the kernels with each instruction set
+// supported by this CPU, on random and edge-case images, and checks that
+// the results are exactly those of the scalar kernels.
+// Exits with status 1 if any result differs.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image8bit.h"
+
+// Image contents
+enum { RANDOM, ZEROS, MAXES, EXTREMES, GRADIENT, NCONTENTS };
+
+static const char* contentNames[NCONTENTS] = {
+  "random", "zeros", "maxes", "extremes", "gradient"
+};
+
+// Number of results in an operation, and the results.
+#define MAXRESULTS 8
+
+struct results {
+  int n;
+  Image img[MAXRESULTS];
+};
+
+static char tmpName[4096];   // temporary file for saving images
+
+static Image newImage(int w, int h, int content, int layout) {
+  Image img = ImageCreateLayout(w, h, 255, layout);
+  if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      int v;
+      switch (content) {
+      case RANDOM: v = rand() % 256; break;
+      case ZEROS: v = 0; break;
+      case MAXES: v = 255; break;
+      case EXTREMES: v = rand() % 2 ? 255 : 0; break;
+      default: v = (x * 255 / w + y * 3) % 256;
+      }
+      ImageSetPixel(img, x, y, (uint8)v);
+    }
+  }
+  return img;
+}
+
+static void add(struct results* r, Image img) {
+  if (img == NULL) error(2, errno, "Operation failed: %s", ImageErrMsg());
+  r->img[r->n++] = img;
+}
+
+// Binary image thresholded from img, as an image.
+static Image bitsOf(Image img, uint8 thr) {
+  BitImage bin = ImageThresholdBits(img, thr);
+  if (bin == NULL) return NULL;
+  Image out = BitImageToImage(bin, 255);
+  BitImageDestroy(&bin);
+  return out;
+}
+
+// Contents of file name, as an image of one row (file bytes as pixels).
+static Image fileBytes(const char* name) {
+  FILE* f = fopen(name, "rb");
+  if (f == NULL) error(2, errno, "%s", name);
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  rewind(f);
+  Image img = ImageCreate((int)size, 1, 255);
+  for (long i = 0; img != NULL && i < size; i++) {
+    ImageSetPixel(img, (int)i, 0, (uint8)getc(f));
+  }
+  fclose(f);
+  return img;
+}
+
+// Names of the operations
+static const char* opNames[] = {
+  "compress", "erode", "dilate", "sobel", "resize", "pyramid",
+  "rotate", "bits", "conv", "locate", NULL
+};
+
+// Run operation op on img, into r.
+static void runOp(int op, Image img, struct results* r) {
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  Image t;
+  r->n = 0;
+  switch (op) {
+  case 0:   // row deltas and checksums
+    if (!ImageSaveCompressed(img, tmpName)) {
+      error(2, errno, "%s: %s", tmpName, ImageErrMsg());
+    }
+    add(r, fileBytes(tmpName));
+    add(r, ImageLoadCompressed(tmpName));
+    break;
+  case 1:   // row min/max
+  case 2:
+    for (int k = 0; k < 3; k++) {
+      static const int d[3][2] = { { 1, 2 }, { 3, 0 }, { 0, 5 } };
+      add(r, t = ImageClone(img));
+      if (!(op == 1 ? ImageErode : ImageDilate)(t, d[k][0], d[k][1])) {
+        error(2, errno, "Morphology: %s", ImageErrMsg());
+      }
+    }
+    break;
+  case 3:   // Sobel spans
+    add(r, ImageSobel(img, NULL));
+    break;
+  case 4:   // accumulation of weighted rows
+    add(r, ImageResize(img, w / 3 + 1, h / 2 + 1));
+    add(r, ImageResize(img, 2 * w + 1, 3 * h / 2 + 1));
+    break;
+  case 5: { // halving rows
+    Image pyr[3];
+    int n = ImageBuildPyramid(img, 3, pyr);
+    if (n < 0) error(2, errno, "Pyramid: %s", ImageErrMsg());
+    for (int i = 0; i < n; i++) add(r, pyr[i]);
+    break;
+  }
+  case 6: { // bilinear interpolation
+    const double m[6] = { 1.7, 0.3, -2.0, -0.2, 1.3, 1.5 };
+    add(r, ImageRotateAngle(img, 17.0, 1));
+    add(r, ImageAffine(img, m, 2 * w + 3, 2 * h + 3, 1));
+    break;
+  }
+  case 7: { // threshold and pack, in raster and aligned layouts
+    static const uint8 thr[3] = { 0, 128, 255 };
+    Image aligned = ImageClone(img);
+    if (aligned == NULL || !ImageSetLayout(aligned, IMAGE_ALIGNED)) {
+      error(2, errno, "Layout: %s", ImageErrMsg());
+    }
+    for (int k = 0; k < 3; k++) {
+      add(r, bitsOf(img, thr[k]));
+      add(r, bitsOf(aligned, thr[k]));
+    }
+    ImageDestroy(&aligned);
+    break;
+  }
+  case 8: { // convolution of rows (and of 32-bit sums, for separable kernels)
+    static const int sharpen[9] = { 0, -1, 0, -1, 5, -1, 0, -1, 0 };
+    static const int gauss[25] = { 1, 4, 6, 4, 1, 4, 16, 24, 16, 4,
+                                   6, 24, 36, 24, 6, 4, 16, 24, 16, 4,
+                                   1, 4, 6, 4, 1 };
+    static const int extreme[15] = { 32767, -32767, 32767, -32767, 32767,
+                                     -2, 3, -5, 7, -11, 32767, 0, 0, 0, 1 };
+    static const int wide[17] = { 1, -2, 3, -4, 5, -6, 7, -8, 9,
+                                  -8, 7, -6, 5, -4, 3, -2, 1 };
+    struct { const int* k; int kw, kh, divisor, bias; } c[4] = {
+      { sharpen, 3, 3, 1, 0 }, { gauss, 5, 5, 256, 0 },
+      { extreme, 5, 3, 7, 128 }, { wide, 17, 1, 3, 0 },
+    };
+    for (int k = 0; k < 4; k++) {
+      add(r, t = ImageClone(img));
+      if (!ImageConvolve(t, c[k].k, c[k].kw, c[k].kh, c[k].divisor, c[k].bias,
+                         k % (IMAGE_BORDER_ZERO + 1))) {
+        error(2, errno, "Convolution: %s", ImageErrMsg());
+      }
+    }
+    break;
+  }
+  case 9: { // anchor search: the position found for subimages of img (at
+            // the last position, so most others are rejected, and altered
+            // so that they may match nowhere), as pixels
+    static const int size[3][2] = { { 1, 1 }, { 5, 2 }, { 40, 3 } };
+    add(r, t = ImageCreate(6 * 3, 1, 255));
+    for (int k = 0; k < 6; k++) {
+      int sw = size[k / 2][0] < w ? size[k / 2][0] : w;
+      int sh = size[k / 2][1] < h ? size[k / 2][1] : h;
+      Image sub = ImageCrop(img, w - sw, h - sh, sw, sh);
+      if (sub == NULL) error(2, errno, "Crop: %s", ImageErrMsg());
+      if (k % 2) {
+        ImageSetPixel(sub, sw - 1, 0, (uint8)(ImageGetPixel(sub, sw - 1, 0) + 1));
+      }
+      int x = 0, y = 0;
+      int found = ImageLocateSubImage(img, &x, &y, sub);
+      ImageSetPixel(t, 3 * k, 0, (uint8)found);
+      ImageSetPixel(t, 3 * k + 1, 0, (uint8)x);
+      ImageSetPixel(t, 3 * k + 2, 0, (uint8)y);
+      ImageDestroy(&sub);
+    }
+    break;
+  }
+  }
+}
+
+// Are a and b the same image?
+static int sameImage(Image a, Image b) {
+  if (ImageWidth(a) != ImageWidth(b) || ImageHeight(a) != ImageHeight(b) ||
+      ImageMaxval(a) != ImageMaxval(b)) {
+    return 0;
+  }
+  for (int y = 0; y < ImageHeight(a); y++) {
+    for (int x = 0; x < ImageWidth(a); x++) {
+      if (ImageGetPixel(a, x, y) != ImageGetPixel(b, x, y)) return 0;
+    }
+  }
+  return 1;
+}
+
+static void freeResults(struct results* r) {
+  for (int i = 0; i < r->n; i++) ImageDestroy(&r->img[i]);
+  r->n = 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 1) {
+    error(1, 0, "Usage: simdTest");
+  }
+  static const int widths[] = { 1, 2, 15, 16, 17, 31, 32, 33, 63, 64, 65,
+                                127, 128, 129, 200 };
+  static const int heights[] = { 1, 2, 3, 17, 64 };
+  int nw = sizeof(widths) / sizeof(widths[0]);
+  int nh = sizeof(heights) / sizeof(heights[0]);
+
+  ImageInit();
+  const char* dir = getenv("TMPDIR");
+  snprintf(tmpName, sizeof(tmpName), "%s/simdTest%ld.i8z",
+           dir != NULL ? dir : "/tmp", (long)getpid());
+  srand(2023);
+
+  int failures = 0;
+  for (int simd = IMAGE_SIMD_SCALAR + 1; simd <= IMAGE_SIMD_AVX512; simd++) {
+    if (!ImageSetSimd(simd)) {
+      printf("%-7s not supported, skipped\n", ImageSimdName(simd));
+      continue;
+    }
+    int checks = 0;
+    int bad = 0;
+    for (int wi = 0; wi < nw; wi++) {
+      for (int hi = 0; hi < nh; hi++) {
+        for (int c = 0; c < NCONTENTS; c++) {
+          Image img = newImage(widths[wi], heights[hi], c, IMAGE_RASTER);
+          for (int op = 0; opNames[op] != NULL; op++) {
+            struct results ref, res;
+            ImageSetSimd(IMAGE_SIMD_SCALAR);
+            runOp(op, img, &ref);
+            ImageSetSimd(simd);
+            runOp(op, img, &res);
+            for (int i = 0; i < ref.n; i++) {
+              checks++;
+              if (i >= res.n || !sameImage(ref.img[i], res.img[i])) {
+                printf("%-7s MISMATCH: %s (result %d) on %dx%d %s image\n",
+                       ImageSimdName(simd), opNames[op], i,
+                       widths[wi], heights[hi], contentNames[c]);
+                bad++;
+              }
+            }
+            freeResults(&ref);
+            freeResults(&res);
+          }
+          ImageDestroy(&img);
+        }
+      }
+    }
+    printf("%-7s %s (%d results checked)\n", ImageSimdName(simd),
+           bad == 0 ? "OK" : "FAILED", checks);
+    failures += bad;
+  }
+  unlink(tmpName);
+  return failures == 0 ? 0 : 1;
+}